@@ -0,0 +1,46 @@
+/**************************************************************************
+ *
+ * Copyright 2014 Scott Moreau <oreaus@gmail.com>
+ * All Rights Reserved.
+ *
+ **************************************************************************/
+
+#include <stddef.h>
+
+#include "alloc-count.h"
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+/* Per thread, so decoder and event threads don't show up in the
+ * render thread's frame accounting */
+static __thread unsigned long allocations;
+
+void *
+__wrap_malloc(size_t size)
+{
+   allocations++;
+   return __real_malloc(size);
+}
+
+void *
+__wrap_calloc(size_t nmemb, size_t size)
+{
+   allocations++;
+   return __real_calloc(nmemb, size);
+}
+
+void *
+__wrap_realloc(void *ptr, size_t size)
+{
+   allocations++;
+   return __real_realloc(ptr, size);
+}
+
+/* Allocations made so far by the calling thread */
+unsigned long
+alloc_count(void)
+{
+   return allocations;
+}
@@ -0,0 +1,18 @@
+/**************************************************************************
+ *
+ * Copyright 2014 Scott Moreau <oreaus@gmail.com>
+ * All Rights Reserved.
+ *
+ **************************************************************************/
+
+/*
+ * Debug accounting of heap allocations.  Only built with
+ * make DEBUG_ALLOC=1, which links our objects with --wrap for the
+ * allocator entry points; calls made inside GL and other shared
+ * libraries are not seen.
+ */
+
+#ifdef DEBUG_ALLOC
+unsigned long
+alloc_count(void);
+#endif
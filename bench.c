@@ -0,0 +1,1345 @@
+/**************************************************************************
+ *
+ * Copyright 2014 Scott Moreau <oreaus@gmail.com>
+ * All Rights Reserved.
+ *
+ **************************************************************************/
+
+/*
+ * Headless benchmarks for the wobbly core.  No X or GL is needed.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "wobbly.h"
+#include "perf-counters.h"
+#include "predict.h"
+#include "latency.h"
+#include "governor.h"
+#include "worker-pool.h"
+#include "tessellate.h"
+#include "mesh-export.h"
+
+static struct perf_counters *perf;
+
+static double
+now_ms(void)
+{
+   struct timeval t;
+
+   gettimeofday(&t, NULL);
+
+   return t.tv_sec * 1000.0 + t.tv_usec / 1000.0;
+}
+
+/* Time this thread spent running, not waiting or preempted */
+static double
+cpu_ms(void)
+{
+   struct timespec t;
+
+   clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+
+   return t.tv_sec * 1000.0 + t.tv_nsec / 1000000.0;
+}
+
+static void
+init_surface(struct surface *surface, int x, int y)
+{
+   memset(surface, 0, sizeof (*surface));
+   surface->x = x;
+   surface->y = y;
+   surface->width = 400;
+   surface->height = 200;
+   surface->x_cells = 8;
+   surface->y_cells = 8;
+   surface->synced = 1;
+}
+
+/*
+ * Keep a set of live surfaces and keep replacing random ones, the way
+ * tooltips and menus come and go in a compositor.  Each replacement is
+ * a wobbly_fini followed by a wobbly_init.
+ */
+static int
+bench_churn(int iterations, int live)
+{
+   struct surface *surfaces;
+   double start, elapsed;
+   int i, n;
+
+   surfaces = calloc(live, sizeof (*surfaces));
+   if (!surfaces)
+      return 0;
+
+   for (i = 0; i < live; i++) {
+      init_surface(&surfaces[i], i % 100, i / 100);
+      if (!wobbly_init(&surfaces[i]))
+         return 0;
+   }
+
+   srand(1);
+   start = now_ms();
+   for (i = 0; i < iterations; i++) {
+      n = rand() % live;
+      wobbly_fini(&surfaces[n]);
+      init_surface(&surfaces[n], n % 100, i % 100);
+      if (!wobbly_init(&surfaces[n]))
+         return 0;
+   }
+   elapsed = now_ms() - start;
+
+   printf("churn: %d surfaces live, %d replacements in %.2f ms, %.1f ns each\n",
+          live, iterations, elapsed, elapsed * 1000000.0 / iterations);
+
+   for (i = 0; i < live; i++)
+      wobbly_fini(&surfaces[i]);
+   free(surfaces);
+
+   return 1;
+}
+
+/*
+ * Drag a surface around in a circle and run the per-frame CPU work of
+ * the demo: the physics step, tessellation into an interleaved vertex
+ * array and index generation.  Reports the mean time per frame.
+ */
+static int
+bench_frame(int frames, int cells)
+{
+   struct wobbly_mesh_layout layout;
+   struct surface surface;
+   GLfloat *vertices;
+   GLushort *indices;
+   double start, elapsed;
+   int i, count;
+
+   init_surface(&surface, 300, 150);
+   surface.x_cells = cells;
+   surface.y_cells = cells;
+
+   count = wobbly_vertex_count(&surface);
+   if (count > 65536) {
+      printf("frame: %d cells need more than 16 bit indices\n", cells);
+      return 0;
+   }
+
+   vertices = malloc(sizeof (GLfloat) * 4 * count);
+   indices = malloc(sizeof (GLushort) * cells * cells * 6);
+   if (!vertices || !indices || !wobbly_init(&surface))
+      return 0;
+
+   layout.position = vertices;
+   layout.position_stride = sizeof (GLfloat) * 4;
+   layout.texcoord = vertices + 2;
+   layout.texcoord_stride = sizeof (GLfloat) * 4;
+
+   wobbly_grab_notify(&surface, 350, 200);
+
+   start = now_ms();
+   for (i = 0; i < frames; i++) {
+      perf_stage_begin(perf, PERF_STAGE_FRAME);
+
+      /* Keep it moving so the model never settles */
+      wobbly_move_notify(&surface, (int) (10 * cos(i * 0.1)), (int) (10 * sin(i * 0.1)));
+
+      perf_stage_begin(perf, PERF_STAGE_PHYSICS);
+      wobbly_prepare_paint(&surface, 16);
+      perf_stage_end(perf, PERF_STAGE_PHYSICS);
+
+      perf_stage_begin(perf, PERF_STAGE_TESSELLATION);
+      wobbly_write_geometry(&surface, &layout, count);
+      perf_stage_end(perf, PERF_STAGE_TESSELLATION);
+
+      perf_stage_begin(perf, PERF_STAGE_INDICES);
+      wobbly_write_indices(&surface, indices, cells * cells * 6);
+      perf_stage_end(perf, PERF_STAGE_INDICES);
+
+      wobbly_done_paint(&surface);
+
+      perf_stage_end(perf, PERF_STAGE_FRAME);
+   }
+   elapsed = now_ms() - start;
+
+   printf("frame: %dx%d cells, %d frames in %.2f ms, %.1f us each\n",
+          cells, cells, frames, elapsed, elapsed * 1000.0 / frames);
+
+   wobbly_fini(&surface);
+   free(vertices);
+   free(indices);
+
+   return 1;
+}
+
+static void
+noop_job(void *data, int job)
+{
+}
+
+/*
+ * Tessellate a wobbling surface of growing density with growing
+ * numbers of threads, checking every mesh against one written by a
+ * single thread, then time dispatching batches with nothing to do.
+ */
+static int
+bench_tessellate(int frames)
+{
+   static const int threads[] = { 1, 2, 4, 8 };
+   struct wobbly_mesh_layout layout, reference_layout;
+   struct worker_pool *pool;
+   struct surface surface;
+   GLfloat *vertices, *reference;
+   double start, elapsed;
+   int cells, count, i, k, mismatches, failed = 0;
+
+   for (cells = 32; cells <= 512; cells *= 2) {
+      count = (cells + 1) * (cells + 1);
+      vertices = malloc(sizeof (GLfloat) * 4 * count);
+      reference = malloc(sizeof (GLfloat) * 4 * count);
+      if (!vertices || !reference)
+         return 0;
+
+      layout.position = vertices;
+      layout.position_stride = sizeof (GLfloat) * 4;
+      layout.texcoord = vertices + 2;
+      layout.texcoord_stride = sizeof (GLfloat) * 4;
+      reference_layout = layout;
+      reference_layout.position = reference;
+      reference_layout.texcoord = reference + 2;
+
+      printf("tessellate: %3dx%-3d cells, %6d vertices, us per mesh by threads:",
+             cells, cells, count);
+
+      for (k = 0; k < (int) (sizeof (threads) / sizeof (threads[0])); k++) {
+         pool = threads[k] > 1 ? worker_pool_create(threads[k]) : NULL;
+         if (threads[k] > 1 && !pool)
+            return 0;
+
+         init_surface(&surface, 100, 100);
+         surface.x_cells = surface.y_cells = cells;
+         if (!wobbly_init(&surface))
+            return 0;
+         wobbly_grab_notify(&surface, 110, 110);
+
+         elapsed = 0;
+         mismatches = 0;
+         for (i = 0; i < frames; i++) {
+            wobbly_move_notify(&surface, (int) (10 * cos(i * 0.1)), (int) (10 * sin(i * 0.1)));
+            wobbly_prepare_paint(&surface, 16);
+
+            start = now_ms();
+            tessellate_parallel(pool, &surface, &layout, count);
+            elapsed += now_ms() - start;
+
+            wobbly_write_geometry(&surface, &reference_layout, count);
+            if (memcmp(vertices, reference, sizeof (GLfloat) * 4 * count))
+               mismatches++;
+
+            wobbly_done_paint(&surface);
+         }
+
+         printf("  %d: %.1f", threads[k], elapsed * 1000.0 / frames);
+         /* Every thread count must write the single thread's mesh */
+         if (mismatches) {
+            printf(" (%d mismatches)", mismatches);
+            failed = 1;
+         }
+
+         wobbly_fini(&surface);
+         worker_pool_destroy(pool);
+      }
+      printf("\n");
+
+      free(vertices);
+      free(reference);
+   }
+
+   /* What a batch costs before any work is done */
+   for (k = 1; k < (int) (sizeof (threads) / sizeof (threads[0])); k++) {
+      pool = worker_pool_create(threads[k]);
+      if (!pool)
+         return 0;
+
+      start = now_ms();
+      for (i = 0; i < frames * 10; i++)
+         worker_pool_run(pool, noop_job, NULL, threads[k] * 2);
+      elapsed = now_ms() - start;
+
+      printf("tessellate: %d threads, %.1f us to dispatch an empty batch\n",
+             threads[k], elapsed * 1000.0 / (frames * 10));
+      worker_pool_destroy(pool);
+   }
+
+   return !failed;
+}
+
+/*
+ * Vertices transformed per triangle by FIFO caches of a few sizes, for
+ * grids indexed cell by cell along whole rows and in the order
+ * wobbly_write_indices uses.
+ */
+static int
+bench_indices(void)
+{
+   static const int caches[] = { 16, 24, 32 };
+   struct surface surface;
+   GLushort *rows, *strips;
+   double start, elapsed;
+   int cells, x, y, i, k, iw, count;
+
+   for (cells = 8; cells <= 128; cells *= 2) {
+      count = cells * cells * 6;
+      rows = malloc(sizeof (*rows) * count);
+      strips = malloc(sizeof (*strips) * count);
+      if (!rows || !strips)
+         return 0;
+
+      iw = cells + 1;
+      for (y = 0, i = 0; y < cells; y++) {
+         for (x = 0; x < cells; x++) {
+            rows[i++] = y * iw + x;
+            rows[i++] = y * iw + x + 1;
+            rows[i++] = (y + 1) * iw + x;
+            rows[i++] = y * iw + x + 1;
+            rows[i++] = (y + 1) * iw + x + 1;
+            rows[i++] = (y + 1) * iw + x;
+         }
+      }
+
+      init_surface(&surface, 0, 0);
+      surface.x_cells = surface.y_cells = cells;
+      start = now_ms();
+      for (i = 0; i < 100; i++)
+         wobbly_write_indices(&surface, strips, count);
+      elapsed = (now_ms() - start) / 100;
+
+      printf("indices: %3dx%-3d cells, %.1f us to write, ACMR rows/strips:", cells,
+             cells, elapsed * 1000.0);
+      for (k = 0; k < (int) (sizeof (caches) / sizeof (caches[0])); k++)
+         printf("  %d: %.3f/%.3f", caches[k],
+                wobbly_index_acmr(rows, count, caches[k]),
+                wobbly_index_acmr(strips, count, caches[k]));
+      printf("\n");
+
+      free(rows);
+      free(strips);
+   }
+
+   return 1;
+}
+
+/* Columns of the square-ish grid n surfaces are laid out on */
+static int
+scene_columns(int n)
+{
+   return ceil(sqrt(n));
+}
+
+/* Surfaces sharing a scene, for the benchmarks of many of them */
+struct bench_scene {
+   struct wobbly_scene *scene;
+   struct surface *surfaces;
+   int cols;
+   int live;      /* surfaces initialised so far */
+};
+
+static void
+bench_scene_destroy(struct bench_scene *bench)
+{
+   int i;
+
+   for (i = 0; i < bench->live; i++)
+      wobbly_fini(&bench->surfaces[i]);
+   if (bench->scene)
+      wobbly_scene_destroy(bench->scene);
+   free(bench->surfaces);
+   memset(bench, 0, sizeof (*bench));
+}
+
+/*
+ * n surfaces in a scene of the given size, placed by place() and
+ * initialised.  On failure whatever was set up is torn down again.
+ */
+static int
+bench_scene_create(struct bench_scene *bench, int n, int width, int height,
+                   void (*place)(struct bench_scene *bench, int i))
+{
+   int i;
+
+   memset(bench, 0, sizeof (*bench));
+   bench->cols = scene_columns(n);
+   bench->surfaces = calloc(n, sizeof (*bench->surfaces));
+   bench->scene = wobbly_scene_create(width, height);
+   if (!bench->surfaces || !bench->scene) {
+      bench_scene_destroy(bench);
+      return 0;
+   }
+
+   for (i = 0; i < n; i++) {
+      place(bench, i);
+      if (!wobbly_init(&bench->surfaces[i])) {
+         bench_scene_destroy(bench);
+         return 0;
+      }
+      bench->live++;
+      if (!wobbly_scene_add(bench->scene, &bench->surfaces[i])) {
+         bench_scene_destroy(bench);
+         return 0;
+      }
+   }
+
+   return 1;
+}
+
+/* Well apart, so surfaces snap to their neighbours' edges */
+static void
+place_snap(struct bench_scene *bench, int i)
+{
+   init_surface(&bench->surfaces[i], (i % bench->cols) * 500 + 50,
+                (i / bench->cols) * 300 + 50);
+}
+
+/*
+ * Drag every surface of a scene at once with snapping on, for growing
+ * numbers of surfaces laid out at the same density.  With the grid
+ * index the cost per surface should stay about flat; a search over
+ * all surfaces would grow linearly with their number.
+ */
+static int
+bench_snap(int frames)
+{
+   struct bench_scene bench;
+   struct wobbly_scene *scene;
+   struct surface *surfaces;
+   double start, elapsed, update;
+   int i, j, n, cols, rows;
+
+   for (n = 64; n <= 1024; n *= 2) {
+      cols = scene_columns(n);
+      rows = (n + cols - 1) / cols;
+      if (!bench_scene_create(&bench, n, cols * 500, rows * 300, place_snap))
+         return 0;
+      scene = bench.scene;
+      surfaces = bench.surfaces;
+
+      for (i = 0; i < n; i++) {
+         wobbly_grab_notify(&surfaces[i], surfaces[i].x + 200, surfaces[i].y + 100);
+         wobbly_set_snapping(&surfaces[i], 1);
+      }
+
+      update = 0;
+      start = now_ms();
+      for (j = 0; j < frames; j++) {
+         double t = now_ms();
+
+         wobbly_scene_update(scene);
+         update += now_ms() - t;
+
+         for (i = 0; i < n; i++) {
+            /* Sweep each surface toward and away from its neighbours */
+            wobbly_move_notify(&surfaces[i], (int) (12 * cos(j * 0.05 + i)),
+                               (int) (8 * sin(j * 0.05 + i)));
+            wobbly_prepare_paint(&surfaces[i], 16);
+            wobbly_done_paint(&surfaces[i]);
+         }
+      }
+      elapsed = now_ms() - start;
+
+      printf("snap: %4d surfaces, %d frames, %.1f ns per surface per frame "
+             "(%.1f ns in the index)\n", n, frames,
+             elapsed * 1000000.0 / frames / n, update * 1000000.0 / frames / n);
+
+      bench_scene_destroy(&bench);
+   }
+
+   return 1;
+}
+
+/* Overlapping neighbours, so the topmost hit matters */
+static void
+place_pick(struct bench_scene *bench, int i)
+{
+   init_surface(&bench->surfaces[i], (i % bench->cols) * 300, (i / bench->cols) * 200);
+}
+
+/*
+ * Pick surfaces under random points through the scene hierarchy and,
+ * for comparison, by testing every surface's mesh from the top down.
+ * Half the surfaces are kept wobbling so the hierarchy is refit
+ * between frames.
+ */
+static int
+bench_pick(int queries)
+{
+   struct bench_scene bench;
+   struct wobbly_scene *scene;
+   struct surface *surfaces, *hit;
+   double start, scene_ms, linear_ms;
+   float u, v;
+   int i, j, n, cols, rows, hits, mismatches, failed = 0;
+
+   for (n = 64; n <= 1024; n *= 2) {
+      cols = scene_columns(n);
+      rows = (n + cols - 1) / cols;
+      if (!bench_scene_create(&bench, n, cols * 300, rows * 200, place_pick))
+         return 0;
+      scene = bench.scene;
+      surfaces = bench.surfaces;
+
+      for (i = 1; i < n; i += 2)
+         wobbly_grab_notify(&surfaces[i], surfaces[i].x + 10, surfaces[i].y + 10);
+
+      srand(1);
+      hits = mismatches = 0;
+      scene_ms = linear_ms = 0;
+      for (j = 0; j < queries; j++) {
+         float x = rand() % (cols * 300), y = rand() % (rows * 200);
+
+         /* A new frame every 100 queries */
+         if (j % 100 == 0) {
+            for (i = 1; i < n; i += 2) {
+               wobbly_move_notify(&surfaces[i], (int) (20 * cos(j * 0.01 + i)),
+                                  (int) (20 * sin(j * 0.01 + i)));
+               wobbly_prepare_paint(&surfaces[i], 16);
+               wobbly_done_paint(&surfaces[i]);
+            }
+         }
+
+         start = now_ms();
+         hit = wobbly_scene_pick(scene, x, y, &u, &v);
+         scene_ms += now_ms() - start;
+
+         start = now_ms();
+         for (i = n - 1; i >= 0; i--)
+            if (wobbly_hit_test(&surfaces[i], x, y, &u, &v))
+               break;
+         linear_ms += now_ms() - start;
+
+         if (hit)
+            hits++;
+         if (hit != (i >= 0 ? &surfaces[i] : NULL))
+            mismatches++;
+      }
+
+      printf("pick: %4d surfaces, %d queries, %d hits, %.0f ns per pick, "
+             "%.0f ns testing every surface, %d mismatches\n", n, queries, hits,
+             scene_ms * 1000000.0 / queries, linear_ms * 1000000.0 / queries,
+             mismatches);
+
+      bench_scene_destroy(&bench);
+      /* Picking must agree with the top down hit test */
+      if (mismatches)
+         failed = 1;
+   }
+
+   return !failed;
+}
+
+/*
+ * A 1920x1080 screen looking at a desktop nine times its size, with
+ * surfaces strewn across it and half of them wobbling.  Each frame
+ * tessellates every surface, then only those the scene finds on
+ * screen.  Overdraw compares shading each visible surface's pixels
+ * back to front with shading each screen pixel once, as opaque
+ * surfaces drawn front to back against a depth buffer do, counted on
+ * a grid of 4x4 pixel blocks.
+ */
+#define CULL_WIDTH 1920
+#define CULL_HEIGHT 1080
+#define CULL_BLOCK 4
+
+/* Strewn across a desktop nine times the screen's size */
+static void
+place_cull(struct bench_scene *bench, int i)
+{
+   init_surface(&bench->surfaces[i], rand() % (CULL_WIDTH * 3) - CULL_WIDTH,
+                rand() % (CULL_HEIGHT * 3) - CULL_HEIGHT);
+   bench->surfaces[i].x_cells = bench->surfaces[i].y_cells = 32;
+}
+
+static int
+bench_cull(int frames)
+{
+   struct bench_scene bench;
+   struct wobbly_scene *scene;
+   struct surface *surfaces, **visible;
+   unsigned char *covered;
+   double start, all_ms, culled_ms, drawn, shaded, front;
+   float x1, y1, x2, y2;
+   int i, j, k, n, count, shown, mismatches, bx, by;
+   int bw = CULL_WIDTH / CULL_BLOCK, bh = CULL_HEIGHT / CULL_BLOCK;
+
+   covered = malloc(bw * bh);
+   if (!covered)
+      return 0;
+
+   for (n = 64; n <= 1024; n *= 2) {
+      visible = calloc(n, sizeof (*visible));
+      srand(1);
+      if (!visible ||
+          !bench_scene_create(&bench, n, CULL_WIDTH * 3, CULL_HEIGHT * 3, place_cull)) {
+         free(visible);
+         free(covered);
+         return 0;
+      }
+      scene = bench.scene;
+      surfaces = bench.surfaces;
+
+      for (i = 1; i < n; i += 2)
+         wobbly_grab_notify(&surfaces[i], surfaces[i].x + 10, surfaces[i].y + 10);
+
+      all_ms = culled_ms = 0;
+      drawn = shaded = front = 0;
+      shown = mismatches = 0;
+      for (j = 0; j < frames; j++) {
+         for (i = 1; i < n; i += 2)
+            wobbly_move_notify(&surfaces[i], (int) (20 * cos(j * 0.1 + i)),
+                               (int) (20 * sin(j * 0.1 + i)));
+         for (i = 0; i < n; i++)
+            wobbly_prepare_paint(&surfaces[i], 16);
+         wobbly_scene_update(scene);
+
+         start = now_ms();
+         for (i = 0; i < n; i++)
+            wobbly_add_geometry(&surfaces[i]);
+         all_ms += now_ms() - start;
+
+         start = now_ms();
+         count = wobbly_scene_visible(scene, 0, 0, CULL_WIDTH, CULL_HEIGHT, visible, n);
+         for (i = 0; i < count; i++)
+            wobbly_add_geometry(visible[i]);
+         culled_ms += now_ms() - start;
+
+         /* Every surface overlapping the screen, topmost first */
+         for (i = n - 1, k = 0; i >= 0; i--) {
+            wobbly_bounds(&surfaces[i], &x1, &y1, &x2, &y2);
+            if (x2 < 0 || y2 < 0 || x1 > CULL_WIDTH || y1 > CULL_HEIGHT)
+               continue;
+            if (k >= count || visible[k] != &surfaces[i])
+               mismatches++;
+            k++;
+         }
+         if (k != count)
+            mismatches++;
+         shown += count;
+
+         memset(covered, 0, bw * bh);
+         for (i = 0; i < count; i++) {
+            wobbly_bounds(visible[i], &x1, &y1, &x2, &y2);
+            x1 = fmaxf(x1, 0) / CULL_BLOCK;
+            y1 = fmaxf(y1, 0) / CULL_BLOCK;
+            x2 = fminf(x2 / CULL_BLOCK, bw);
+            y2 = fminf(y2 / CULL_BLOCK, bh);
+            for (by = y1; by < y2; by++) {
+               for (bx = x1; bx < x2; bx++) {
+                  shaded++;
+                  if (!covered[by * bw + bx]) {
+                     covered[by * bw + bx] = 1;
+                     front++;
+                  }
+               }
+            }
+         }
+         drawn += count;
+
+         for (i = 0; i < n; i++)
+            wobbly_done_paint(&surfaces[i]);
+      }
+
+      printf("cull: %4d surfaces, %.1f on screen, tessellating all %.3f ms, "
+             "visible %.3f ms per frame, %d mismatches\n", n, (double) shown / frames,
+             all_ms / frames, culled_ms / frames, mismatches);
+      printf("      %.2f shaded per screen pixel back to front, %.2f front to back, "
+             "%.0f%% of shading saved\n", shaded / (bw * bh) / frames,
+             front / (bw * bh) / frames, shaded ? 100.0 * (shaded - front) / shaded : 0);
+
+      bench_scene_destroy(&bench);
+      free(visible);
+   }
+
+   free(covered);
+
+   return 1;
+}
+
+/*
+ * Largest distance between the midpoint of a mesh edge and the point
+ * of the surface it stands for, taken from a reference tessellation
+ * four times finer than the 64 cell lattice.
+ */
+static void
+d_max(double *max, double d)
+{
+   if (d > *max)
+      *max = d;
+}
+
+static double
+mesh_error(GLfloat *vertices, GLushort *indices, int count, GLfloat *reference)
+{
+   double error = 0, d;
+   GLfloat *a, *b, *ref;
+   int i, k, x, y;
+
+   for (i = 0; i < count; i += 3) {
+      for (k = 0; k < 3; k++) {
+         a = &vertices[4 * indices[i + k]];
+         b = &vertices[4 * indices[i + (k + 1) % 3]];
+
+         /* Texture coordinates are the position across the surface,
+          * with v flipped */
+         x = (a[2] + b[2]) * 0.5 * 256 + 0.5;
+         y = (2 - a[3] - b[3]) * 0.5 * 256 + 0.5;
+         ref = &reference[2 * (y * 257 + x)];
+
+         d = hypot((a[0] + b[0]) * 0.5 - ref[0], (a[1] + b[1]) * 0.5 - ref[1]);
+         if (d > error)
+            error = d;
+      }
+   }
+
+   return error;
+}
+
+/*
+ * Tessellate a surface 64x64 cells uniformly and adaptively while it
+ * is dragged gently, then violently.  Reports the vertices each needs,
+ * the time taken and the worst error against a much finer mesh.
+ */
+static int
+bench_adaptive(int frames, float tolerance)
+{
+   static const struct {
+      const char *name;
+      int amplitude;
+   } phases[] = { { "at rest", 0 }, { "gentle", 2 }, { "violent", 30 } };
+   struct wobbly_mesh_layout layout, ref_layout;
+   struct surface surface, fine;
+   GLfloat *vertices, *reference;
+   GLushort *indices;
+   double uniform_ms, adaptive_ms, uniform_error, adaptive_error, start;
+   long long adaptive_vertices;
+   int max_vertices, max_indices, count, phase, i, n;
+
+   init_surface(&surface, 300, 150);
+   surface.x_cells = surface.y_cells = 64;
+   if (!wobbly_init(&surface))
+      return 0;
+
+   wobbly_adaptive_bounds(&surface, &max_vertices, &max_indices);
+   if (max_indices < 64 * 64 * 6)
+      max_indices = 64 * 64 * 6;
+
+   vertices = malloc(sizeof (GLfloat) * 4 * max_vertices);
+   indices = malloc(sizeof (GLushort) * max_indices);
+   reference = malloc(sizeof (GLfloat) * 2 * 257 * 257);
+   if (!vertices || !indices || !reference)
+      return 0;
+
+   layout.position = vertices;
+   layout.position_stride = sizeof (GLfloat) * 4;
+   layout.texcoord = vertices + 2;
+   layout.texcoord_stride = sizeof (GLfloat) * 4;
+
+   ref_layout.position = reference;
+   ref_layout.position_stride = sizeof (GLfloat) * 2;
+   ref_layout.texcoord = NULL;
+   ref_layout.texcoord_stride = 0;
+
+   wobbly_grab_notify(&surface, 350, 200);
+
+   for (phase = 0; phase < 3; phase++) {
+      uniform_ms = adaptive_ms = uniform_error = adaptive_error = 0;
+      adaptive_vertices = 0;
+
+      for (i = 0; i < frames; i++) {
+         if (phases[phase].amplitude) {
+            wobbly_move_notify(&surface,
+                               (int) (phases[phase].amplitude * cos(i * 0.3)),
+                               (int) (phases[phase].amplitude * sin(i * 0.2)));
+            wobbly_prepare_paint(&surface, 16);
+         }
+
+         start = now_ms();
+         wobbly_write_geometry(&surface, &layout, max_vertices);
+         wobbly_write_indices(&surface, indices, max_indices);
+         uniform_ms += now_ms() - start;
+
+         /* The same surface, tessellated at the reference density */
+         fine = surface;
+         fine.x_cells = fine.y_cells = 256;
+         wobbly_write_geometry(&fine, &ref_layout, 257 * 257);
+
+         d_max(&uniform_error, mesh_error(vertices, indices, 64 * 64 * 6, reference));
+
+         start = now_ms();
+         n = wobbly_write_adaptive(&surface, &layout, max_vertices, indices,
+                                   max_indices, tolerance, &count);
+         adaptive_ms += now_ms() - start;
+         adaptive_vertices += n;
+
+         d_max(&adaptive_error, mesh_error(vertices, indices, count, reference));
+      }
+
+      printf("adaptive: %-8s uniform %d vertices, %.1f us, %.2f px error; "
+             "adaptive %.0f vertices, %.1f us, %.2f px error\n", phases[phase].name,
+             65 * 65, uniform_ms * 1000 / frames, uniform_error,
+             (double) adaptive_vertices / frames, adaptive_ms * 1000 / frames,
+             adaptive_error);
+   }
+
+   wobbly_fini(&surface);
+   free(vertices);
+   free(indices);
+   free(reference);
+
+   return 1;
+}
+
+static void
+spin_ms(double ms)
+{
+   double end = now_ms() + ms;
+
+   while (now_ms() < end)
+      ;
+}
+
+/*
+ * Run the demo's per-frame CPU work for eight surfaces of different
+ * sizes at 64x64 cells, with an extra load of spike_ms during the
+ * middle third of the run, once as is and once under the governor.
+ * Reports the spread of frame times and how many went over budget.
+ */
+static int
+bench_govern(int frames, double budget_ms, double spike_ms)
+{
+   struct governed_surface governed[8];
+   struct frame_governor governor;
+   struct latency_histogram histogram;
+   struct wobbly_mesh_layout layout;
+   struct surface surfaces[8];
+   GLfloat *vertices;
+   GLushort *indices;
+   double start, frame_ms;
+   int i, j, pass, over, count = 65 * 65;
+
+   vertices = malloc(sizeof (GLfloat) * 4 * count);
+   indices = malloc(sizeof (GLushort) * 64 * 64 * 6);
+   if (!vertices || !indices)
+      return 0;
+
+   layout.position = vertices;
+   layout.position_stride = sizeof (GLfloat) * 4;
+   layout.texcoord = vertices + 2;
+   layout.texcoord_stride = sizeof (GLfloat) * 4;
+
+   for (pass = 0; pass < 2; pass++) {
+      governor_init(&governor, budget_ms);
+      memset(&histogram, 0, sizeof (histogram));
+      over = 0;
+
+      for (i = 0; i < 8; i++) {
+         init_surface(&surfaces[i], 100 * i, 50 * i);
+         surfaces[i].width = 100 + 60 * i;
+         surfaces[i].x_cells = surfaces[i].y_cells = 64;
+         if (!wobbly_init(&surfaces[i]))
+            return 0;
+         wobbly_grab_notify(&surfaces[i], surfaces[i].x + 20, surfaces[i].y + 20);
+         governor_add_surface(&governed[i], &surfaces[i]);
+      }
+
+      for (j = 0; j < frames; j++) {
+         start = now_ms();
+
+         for (i = 0; i < 8; i++) {
+            wobbly_move_notify(&surfaces[i], (int) (10 * cos(j * 0.1 + i)),
+                               (int) (10 * sin(j * 0.1 + i)));
+            wobbly_prepare_paint(&surfaces[i], 16);
+            wobbly_write_geometry(&surfaces[i], &layout, count);
+            wobbly_write_indices(&surfaces[i], indices, 64 * 64 * 6);
+            wobbly_done_paint(&surfaces[i]);
+         }
+
+         if (j > frames / 3 && j < frames * 2 / 3)
+            spin_ms(spike_ms);
+
+         frame_ms = now_ms() - start;
+         latency_record(&histogram, frame_ms);
+         if (frame_ms > budget_ms)
+            over++;
+
+         if (pass)
+            governor_frame(&governor, frame_ms, governed, 8);
+      }
+
+      printf("govern: %s, %d of %d frames over %.1f ms\n",
+             pass ? "governed" : "ungoverned", over, frames, budget_ms);
+      latency_report(&histogram, "  frame time", stdout);
+      if (pass)
+         governor_report(&governor, governed, 8, stdout);
+
+      for (i = 0; i < 8; i++)
+         wobbly_fini(&surfaces[i]);
+   }
+
+   free(vertices);
+   free(indices);
+
+   return 1;
+}
+
+/*
+ * Replay pointer motion through the predictor at 60 Hz and report how
+ * far the drawn anchor is from the real pointer when it is presented.
+ * Without a log recorded by wobbly -record-motion, a synthetic 125 Hz
+ * drag with changing direction and speed is used.
+ */
+static int
+bench_predict(const char *path, double lead_ms)
+{
+   struct predict_error predicted, unpredicted;
+   struct pointer_sample *samples;
+   int i, count;
+
+   if (path) {
+      count = predictor_load_samples(path, &samples);
+      if (count < 0) {
+         printf("predict: couldn't read %s\n", path);
+         return 0;
+      }
+   } else {
+      count = 10 * 125;
+      samples = malloc(sizeof (*samples) * count);
+      if (!samples)
+         return 0;
+      for (i = 0; i < count; i++) {
+         double t = i * 8.0;
+
+         samples[i].t = t;
+         samples[i].x = floor(500 + 300 * sin(t * 2 * M_PI / 1500));
+         samples[i].y = floor(250 + 150 * sin(t * 2 * M_PI / 900));
+      }
+   }
+
+   predictor_replay(samples, count, 1000.0 / 60, lead_ms, &predicted, &unpredicted);
+   free(samples);
+
+   printf("predict: %d samples, %u frames, %.1f ms ahead\n",
+          count, predicted.frames, lead_ms);
+   printf("  %-12s mean %6.2f px, rms %6.2f px, max %6.2f px\n", "unpredicted",
+          unpredicted.mean, unpredicted.rms, unpredicted.max);
+   printf("  %-12s mean %6.2f px, rms %6.2f px, max %6.2f px\n", "predicted",
+          predicted.mean, predicted.rms, predicted.max);
+
+   return 1;
+}
+
+/*
+ * What a consumer process saw of the frames published to it, and the
+ * CPU time it spent taking them in.  Torn frames passed the sequence
+ * check with their two frame numbers disagreeing, and there should
+ * never be any.
+ */
+struct export_stats {
+   unsigned int frames, retries, torn;
+   double cpu_ms;
+};
+
+/* Read the newest frame in place, as fast as it comes, until closed */
+static void
+export_consumer(int fd, int out)
+{
+   const struct mesh_export_frame *frame;
+   struct mesh_export *export;
+   struct export_stats stats;
+   uint32_t sequence, number, last = 0;
+   const GLfloat *vertices;
+   volatile GLfloat sum = 0;
+   double start;
+   int i, torn;
+
+   memset(&stats, 0, sizeof (stats));
+   export = mesh_export_open_fd(fd);
+   while (export && !mesh_export_closed(export)) {
+      frame = mesh_export_begin_read(export, &sequence);
+      if (!frame || frame->frame == last) {
+         usleep(50);
+         continue;
+      }
+
+      /* Touch every vertex, as uploading it would */
+      start = cpu_ms();
+      number = frame->frame;
+      vertices = mesh_export_vertices(export, frame);
+      for (i = 0; i < frame->num_vertices; i++)
+         sum += vertices[4 * i];
+      torn = mesh_export_tail(export, frame) != number;
+      stats.cpu_ms += cpu_ms() - start;
+
+      if (!mesh_export_end_read(export, frame, sequence)) {
+         stats.retries++;
+         continue;
+      }
+      stats.frames++;
+      stats.torn += torn;
+      last = number;
+   }
+
+   if (write(out, &stats, sizeof (stats)) != sizeof (stats))
+      perror("write");
+   mesh_export_destroy(export);
+}
+
+/*
+ * Read whole frames of the given size from a socket and touch them
+ * until the producer stops sending, then report back on the socket.
+ */
+static void
+socket_consumer(int fd, int size)
+{
+   char *buffer = malloc(size);
+   struct export_stats stats;
+   volatile GLfloat sum = 0;
+   double start;
+   ssize_t n;
+   int got = 0, i;
+
+   memset(&stats, 0, sizeof (stats));
+   while (buffer) {
+      start = cpu_ms();
+      n = read(fd, buffer + got, size - got);
+      if (n > 0 && (got += n) == size) {
+         for (i = 0; i < size / (int) sizeof (GLfloat); i += 4)
+            sum += ((GLfloat *) buffer)[i];
+         stats.frames++;
+         got = 0;
+      }
+      stats.cpu_ms += cpu_ms() - start;
+      if (n <= 0)
+         break;
+   }
+   free(buffer);
+
+   if (write(fd, &stats, sizeof (stats)) != sizeof (stats))
+      perror("write");
+}
+
+static int
+write_all(int fd, const void *data, size_t size)
+{
+   const char *p = data;
+   ssize_t n;
+
+   while (size) {
+      n = write(fd, p, size);
+      if (n <= 0)
+         return 0;
+      p += n;
+      size -= n;
+   }
+
+   return 1;
+}
+
+/* Wobble the surface for one more frame of the run */
+static void
+export_step(struct surface *surface, int i)
+{
+   wobbly_move_notify(surface, (int) (10 * cos(i * 0.1)), (int) (10 * sin(i * 0.1)));
+   wobbly_prepare_paint(surface, 16);
+}
+
+/*
+ * Publish a wobbling surface through shared memory while a forked
+ * consumer reads each newest frame in place, then send the same
+ * vertices through a socket pair to a consumer that reads them out,
+ * for a few grid sizes.  Publishing tessellates straight into the
+ * shared slot, so it is compared with tessellating alone; the socket
+ * has to send what was tessellated on top.  Times are CPU time on each
+ * side, which holds up when the two processes share a core.
+ */
+static int
+bench_export(int frames)
+{
+   static const int sizes[] = { 8, 32, 128, 255 };
+   struct wobbly_mesh_layout layout;
+   struct mesh_export *export;
+   struct export_stats stats, received;
+   struct surface surface;
+   GLfloat *vertices;
+   double start, tess_ms, shm_ms, send_ms;
+   int k, i, count, bytes, fds[2];
+   pid_t pid;
+
+   for (k = 0; k < (int) (sizeof (sizes) / sizeof (sizes[0])); k++) {
+      init_surface(&surface, 100, 100);
+      surface.x_cells = surface.y_cells = sizes[k];
+      count = wobbly_vertex_count(&surface);
+      bytes = sizeof (GLfloat) * 4 * count;
+
+      vertices = malloc(bytes);
+      if (!vertices || !wobbly_init(&surface))
+         return 0;
+
+      layout.position = vertices;
+      layout.position_stride = sizeof (GLfloat) * 4;
+      layout.texcoord = vertices + 2;
+      layout.texcoord_stride = sizeof (GLfloat) * 4;
+
+      wobbly_grab_notify(&surface, 110, 110);
+      tess_ms = 0;
+      for (i = 0; i < frames; i++) {
+         export_step(&surface, i);
+         start = cpu_ms();
+         wobbly_write_geometry(&surface, &layout, count);
+         tess_ms += cpu_ms() - start;
+         wobbly_done_paint(&surface);
+      }
+      wobbly_fini(&surface);
+
+      init_surface(&surface, 100, 100);
+      surface.x_cells = surface.y_cells = sizes[k];
+      export = mesh_export_create(NULL, count);
+      if (!export || pipe(fds) || !wobbly_init(&surface))
+         return 0;
+
+      fflush(stdout);
+      pid = fork();
+      if (pid < 0)
+         return 0;
+      if (pid == 0) {
+         close(fds[0]);
+         export_consumer(mesh_export_fd(export), fds[1]);
+         _exit(0);
+      }
+      close(fds[1]);
+
+      wobbly_grab_notify(&surface, 110, 110);
+      shm_ms = 0;
+      for (i = 0; i < frames; i++) {
+         export_step(&surface, i);
+         start = cpu_ms();
+         mesh_export_publish(export, &surface);
+         shm_ms += cpu_ms() - start;
+         wobbly_done_paint(&surface);
+         /* Give the consumer its turn, as a frame's wait would */
+         usleep(100);
+      }
+
+      mesh_export_destroy(export);
+      memset(&stats, 0, sizeof (stats));
+      if (read(fds[0], &stats, sizeof (stats)) != sizeof (stats))
+         printf("export: consumer didn't report\n");
+      close(fds[0]);
+      waitpid(pid, NULL, 0);
+      wobbly_fini(&surface);
+
+      /* The same vertices, serialized through a socket */
+      init_surface(&surface, 100, 100);
+      surface.x_cells = surface.y_cells = sizes[k];
+      if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) || !wobbly_init(&surface))
+         return 0;
+
+      fflush(stdout);
+      pid = fork();
+      if (pid < 0)
+         return 0;
+      if (pid == 0) {
+         close(fds[0]);
+         socket_consumer(fds[1], bytes);
+         _exit(0);
+      }
+      close(fds[1]);
+
+      wobbly_grab_notify(&surface, 110, 110);
+      send_ms = 0;
+      for (i = 0; i < frames; i++) {
+         export_step(&surface, i);
+         wobbly_write_geometry(&surface, &layout, count);
+         start = cpu_ms();
+         if (!write_all(fds[0], vertices, bytes))
+            break;
+         send_ms += cpu_ms() - start;
+         wobbly_done_paint(&surface);
+      }
+
+      shutdown(fds[0], SHUT_WR);
+      memset(&received, 0, sizeof (received));
+      if (read(fds[0], &received, sizeof (received)) != sizeof (received))
+         printf("export: socket consumer didn't report\n");
+      close(fds[0]);
+      waitpid(pid, NULL, 0);
+
+      wobbly_fini(&surface);
+      free(vertices);
+
+      printf("export: %3dx%-3d cells, %5d vertices, cpu us per frame\n",
+             sizes[k], sizes[k], count);
+      printf("        producer: tessellate %.1f, publish %.1f, send %.1f after tessellating\n",
+             tess_ms * 1000.0 / frames, shm_ms * 1000.0 / frames,
+             send_ms * 1000.0 / frames);
+      printf("        consumer: read in place %.1f, receive %.1f\n",
+             stats.frames ? stats.cpu_ms * 1000.0 / stats.frames : 0.0,
+             received.frames ? received.cpu_ms * 1000.0 / received.frames : 0.0);
+      printf("        %u of %d frames read in place, %u reread, %u torn; "
+             "%u received\n", stats.frames, frames, stats.retries, stats.torn,
+             received.frames);
+      if (stats.torn)
+         return 0;
+   }
+
+   return 1;
+}
+
+static void
+usage(void)
+{
+   printf("Usage: wobbly-bench [-hugepages] [-perf] <benchmark> [args]\n");
+   printf("  churn [iterations] [live]   create/destroy surfaces\n");
+   printf("  frame [frames] [cells]      physics, tessellation and indices\n");
+   printf("  tessellate [frames]         tessellation time by threads and density\n");
+   printf("  indices                     vertex cache misses of the index order\n");
+   printf("  snap [frames]               edge snapping, 64 to 1024 surfaces\n");
+   printf("  pick [queries]              hit testing, 64 to 1024 surfaces\n");
+   printf("  cull [frames]               off screen culling and overdraw, 64 to\n");
+   printf("                              1024 surfaces\n");
+   printf("  adaptive [frames] [px]      uniform against adaptive tessellation\n");
+   printf("  govern [frames] [budget] [spike]\n");
+   printf("                              frame times with and without the governor\n");
+   printf("  predict [motion.txt] [lead] pointer prediction error on replay,\n");
+   printf("                              - replays a synthetic drag\n");
+   printf("  export [frames]             shared memory mesh export against a\n");
+   printf("                              socket, with a consumer process\n");
+   printf("  -perf reports hardware counters per stage\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+   int i = 1, ret;
+
+   for (; i < argc && argv[i][0] == '-'; i++) {
+      if (strcmp(argv[i], "-hugepages") == 0) {
+         wobbly_use_huge_pages(1);
+      } else if (strcmp(argv[i], "-perf") == 0) {
+         perf = perf_counters_create();
+         if (!perf)
+            printf("Warning: hardware counters unavailable\n");
+      } else {
+         usage();
+         return -1;
+      }
+   }
+
+   if (i >= argc) {
+      usage();
+      return -1;
+   }
+
+   if (strcmp(argv[i], "churn") == 0) {
+      int iterations = i + 1 < argc ? atoi(argv[i + 1]) : 1000000;
+      int live = i + 2 < argc ? atoi(argv[i + 2]) : 256;
+
+      if (iterations <= 0 || live <= 0) {
+         usage();
+         return -1;
+      }
+      ret = bench_churn(iterations, live);
+   } else if (strcmp(argv[i], "frame") == 0) {
+      int frames = i + 1 < argc ? atoi(argv[i + 1]) : 10000;
+      int cells = i + 2 < argc ? atoi(argv[i + 2]) : 8;
+
+      if (frames <= 0 || cells <= 0) {
+         usage();
+         return -1;
+      }
+      ret = bench_frame(frames, cells);
+   } else if (strcmp(argv[i], "tessellate") == 0) {
+      int frames = i + 1 < argc ? atoi(argv[i + 1]) : 100;
+
+      if (frames <= 0) {
+         usage();
+         return -1;
+      }
+      ret = bench_tessellate(frames);
+   } else if (strcmp(argv[i], "indices") == 0) {
+      ret = bench_indices();
+   } else if (strcmp(argv[i], "snap") == 0) {
+      int frames = i + 1 < argc ? atoi(argv[i + 1]) : 1000;
+
+      if (frames <= 0) {
+         usage();
+         return -1;
+      }
+      ret = bench_snap(frames);
+   } else if (strcmp(argv[i], "pick") == 0) {
+      int queries = i + 1 < argc ? atoi(argv[i + 1]) : 100000;
+
+      if (queries <= 0) {
+         usage();
+         return -1;
+      }
+      ret = bench_pick(queries);
+   } else if (strcmp(argv[i], "cull") == 0) {
+      int frames = i + 1 < argc ? atoi(argv[i + 1]) : 200;
+
+      if (frames <= 0) {
+         usage();
+         return -1;
+      }
+      ret = bench_cull(frames);
+   } else if (strcmp(argv[i], "adaptive") == 0) {
+      int frames = i + 1 < argc ? atoi(argv[i + 1]) : 500;
+      float tolerance = i + 2 < argc ? atof(argv[i + 2]) : 0.5;
+
+      if (frames <= 0 || tolerance <= 0) {
+         usage();
+         return -1;
+      }
+      ret = bench_adaptive(frames, tolerance);
+   } else if (strcmp(argv[i], "govern") == 0) {
+      int frames = i + 1 < argc ? atoi(argv[i + 1]) : 1500;
+      double budget = i + 2 < argc ? atof(argv[i + 2]) : 4.0;
+      double spike = i + 3 < argc ? atof(argv[i + 3]) : 2.0;
+
+      if (frames <= 0 || budget <= 0 || spike < 0) {
+         usage();
+         return -1;
+      }
+      ret = bench_govern(frames, budget, spike);
+   } else if (strcmp(argv[i], "predict") == 0) {
+      const char *path = i + 1 < argc && strcmp(argv[i + 1], "-") ? argv[i + 1] : NULL;
+      double lead = i + 2 < argc ? atof(argv[i + 2]) : 16.0;
+
+      if (lead <= 0) {
+         usage();
+         return -1;
+      }
+      ret = bench_predict(path, lead);
+   } else if (strcmp(argv[i], "export") == 0) {
+      int frames = i + 1 < argc ? atoi(argv[i + 1]) : 500;
+
+      if (frames <= 0) {
+         usage();
+         return -1;
+      }
+      ret = bench_export(frames);
+   } else {
+      usage();
+      return -1;
+   }
+
+   perf_counters_report(perf, stdout);
+   perf_counters_destroy(perf);
+
+   return ret ? 0 : -1;
+}
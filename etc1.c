@@ -0,0 +1,273 @@
+#include "etc1.h"
+
+/*
+ * Intensity modifier tables from the
+ * OES_compressed_ETC1_RGB8_texture spec.
+ * A pixel index of (msb << 1 | lsb)
+ * selects the column.
+ */
+static const int etc1Modifiers[8][4] = {
+    {  2,   8,  -2,   -8 },
+    {  5,  17,  -5,  -17 },
+    {  9,  29,  -9,  -29 },
+    { 13,  42, -13,  -42 },
+    { 18,  60, -18,  -60 },
+    { 24,  80, -24,  -80 },
+    { 33, 106, -33, -106 },
+    { 47, 183, -47, -183 }
+};
+
+static inline int clamp255(int v) {
+    return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+static inline int expand4(int c) {
+    return (c << 4) | c;
+}
+
+static inline int expand5(int c) {
+    return (c << 3) | (c >> 2);
+}
+
+/* Whether pixel (x, y) of a block lies in the
+ * second sub-block for the given flip bit */
+static inline int inSecondHalf(int x, int y, int flip) {
+    return flip ? y >= 2 : x >= 2;
+}
+
+int etc1DataSize(int width, int height) {
+    return ((width + 3) / 4) * ((height + 3) / 4) * ETC1_BLOCK_SIZE;
+}
+
+/*
+ * Pick the modifier table and per pixel
+ * indices that best fit the 8 pixels of
+ * one sub-block around a base color.
+ * Returns the squared error.
+ */
+static int fitSubBlock(const int pixels[16][3], int flip, int half,
+                       const int base[3], int *outTable,
+                       unsigned int *outIndices) {
+    int bestError = -1, t, x, y, m, c;
+
+    for (t = 0; t < 8; t++) {
+        unsigned int indices = 0;
+        int error = 0;
+
+        for (x = 0; x < 4; x++) {
+            for (y = 0; y < 4; y++) {
+                const int *p = pixels[y * 4 + x];
+                int best = 0, bestPixelError = -1;
+
+                if (inSecondHalf(x, y, flip) != half)
+                    continue;
+
+                for (m = 0; m < 4; m++) {
+                    int e = 0;
+
+                    for (c = 0; c < 3; c++) {
+                        int d = clamp255(base[c] + etc1Modifiers[t][m]) - p[c];
+                        e += d * d;
+                    }
+                    if (bestPixelError < 0 || e < bestPixelError) {
+                        bestPixelError = e;
+                        best = m;
+                    }
+                }
+
+                error += bestPixelError;
+                /* 2 bits per pixel, MSB plane in the
+                 * upper 16 bits, column major */
+                indices |= ((best >> 1) << (16 + x * 4 + y)) |
+                           ((best & 1) << (x * 4 + y));
+            }
+        }
+
+        if (bestError < 0 || error < bestError) {
+            bestError = error;
+            *outTable = t;
+            *outIndices = indices;
+        }
+    }
+
+    return bestError;
+}
+
+static void storeBlock(unsigned char *out, unsigned int high, unsigned int low) {
+    out[0] = high >> 24;
+    out[1] = high >> 16;
+    out[2] = high >> 8;
+    out[3] = high;
+    out[4] = low >> 24;
+    out[5] = low >> 16;
+    out[6] = low >> 8;
+    out[7] = low;
+}
+
+static void encodeBlock(const int pixels[16][3], unsigned char *out) {
+    unsigned int bestHigh = 0, bestLow = 0;
+    int bestError = -1, flip, half, diff, c, x, y;
+
+    for (flip = 0; flip < 2; flip++) {
+        float average[2][3] = { { 0 } };
+        int q4[2][3], q5[2][3], delta[3], canDiff = 1;
+
+        for (x = 0; x < 4; x++)
+            for (y = 0; y < 4; y++)
+                for (c = 0; c < 3; c++)
+                    average[inSecondHalf(x, y, flip)][c] +=
+                        pixels[y * 4 + x][c] / 8.0f;
+
+        for (half = 0; half < 2; half++) {
+            for (c = 0; c < 3; c++) {
+                q4[half][c] = (int) (average[half][c] * 15.0f / 255.0f + 0.5f);
+                q5[half][c] = (int) (average[half][c] * 31.0f / 255.0f + 0.5f);
+            }
+        }
+
+        for (c = 0; c < 3; c++) {
+            delta[c] = q5[1][c] - q5[0][c];
+            if (delta[c] < -4 || delta[c] > 3)
+                canDiff = 0;
+        }
+
+        /* Try individual mode, and differential
+         * mode when the averages are close enough */
+        for (diff = 0; diff <= canDiff; diff++) {
+            unsigned int high, low = 0, indices;
+            int base[2][3], table[2], error = 0;
+
+            for (half = 0; half < 2; half++)
+                for (c = 0; c < 3; c++)
+                    base[half][c] = diff ? expand5(q5[half][c]) :
+                                           expand4(q4[half][c]);
+
+            for (half = 0; half < 2; half++) {
+                error += fitSubBlock(pixels, flip, half, base[half],
+                                     &table[half], &indices);
+                low |= indices;
+            }
+
+            if (bestError >= 0 && error >= bestError)
+                continue;
+
+            if (diff)
+                high = (q5[0][0] << 27) | ((delta[0] & 7) << 24) |
+                       (q5[0][1] << 19) | ((delta[1] & 7) << 16) |
+                       (q5[0][2] << 11) | ((delta[2] & 7) << 8);
+            else
+                high = (q4[0][0] << 28) | (q4[1][0] << 24) |
+                       (q4[0][1] << 20) | (q4[1][1] << 16) |
+                       (q4[0][2] << 12) | (q4[1][2] << 8);
+
+            high |= (table[0] << 5) | (table[1] << 2) | (diff << 1) | flip;
+
+            bestError = error;
+            bestHigh = high;
+            bestLow = low;
+        }
+    }
+
+    storeBlock(out, bestHigh, bestLow);
+}
+
+/*
+ * Compress an 8 bit image of any loader format
+ * to ETC1.  Alpha is dropped and luminance is
+ * replicated; partial edge blocks repeat the
+ * last row and column.
+ */
+int etc1EncodeImage(int width, int height, int format, void *data, void **outData) {
+    const unsigned char *src = data;
+    unsigned char *out, *block;
+    int pixels[16][3];
+    int bx, by, x, y, c;
+
+    out = malloc(etc1DataSize(width, height));
+    if (!out)
+        return 0;
+
+    block = out;
+    for (by = 0; by < height; by += 4) {
+        for (bx = 0; bx < width; bx += 4) {
+            for (y = 0; y < 4; y++) {
+                for (x = 0; x < 4; x++) {
+                    int sx = bx + x < width ? bx + x : width - 1;
+                    int sy = by + y < height ? by + y : height - 1;
+                    const unsigned char *p = src + (sy * width + sx) * format;
+
+                    for (c = 0; c < 3; c++)
+                        pixels[y * 4 + x][c] = format >= 3 ? p[c] : p[0];
+                }
+            }
+
+            encodeBlock((const int (*)[3]) pixels, block);
+            block += ETC1_BLOCK_SIZE;
+        }
+    }
+
+    *outData = out;
+
+    return 1;
+}
+
+/* Expand ETC1 data to tightly packed RGB, for
+ * drivers without the compressed format */
+int etc1DecodeImage(int width, int height, void *data, void **outData) {
+    const unsigned char *block = data;
+    unsigned char *out;
+    int bx, by, x, y, c;
+
+    out = malloc(width * height * 3);
+    if (!out)
+        return 0;
+
+    for (by = 0; by < height; by += 4) {
+        for (bx = 0; bx < width; bx += 4) {
+            unsigned int high, low;
+            int base[2][3], table[2], diff, flip;
+
+            high = (block[0] << 24) | (block[1] << 16) | (block[2] << 8) | block[3];
+            low = (block[4] << 24) | (block[5] << 16) | (block[6] << 8) | block[7];
+            block += ETC1_BLOCK_SIZE;
+
+            diff = (high >> 1) & 1;
+            flip = high & 1;
+            table[0] = (high >> 5) & 7;
+            table[1] = (high >> 2) & 7;
+
+            for (c = 0; c < 3; c++) {
+                int shift = 24 - c * 8;
+
+                if (diff) {
+                    int b = (high >> (shift + 3)) & 31;
+                    int d = (high >> shift) & 7;
+
+                    if (d >= 4)
+                        d -= 8;
+                    base[0][c] = expand5(b);
+                    base[1][c] = expand5((b + d) & 31);
+                } else {
+                    base[0][c] = expand4((high >> (shift + 4)) & 15);
+                    base[1][c] = expand4((high >> shift) & 15);
+                }
+            }
+
+            for (x = 0; x < 4 && bx + x < width; x++) {
+                for (y = 0; y < 4 && by + y < height; y++) {
+                    int bit = x * 4 + y;
+                    int m = (((low >> (16 + bit)) & 1) << 1) | ((low >> bit) & 1);
+                    int half = inSecondHalf(x, y, flip);
+                    unsigned char *p = out + ((by + y) * width + bx + x) * 3;
+
+                    for (c = 0; c < 3; c++)
+                        p[c] = clamp255(base[half][c] + etc1Modifiers[table[half]][m]);
+                }
+            }
+        }
+    }
+
+    *outData = out;
+
+    return 1;
+}
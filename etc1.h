@@ -0,0 +1,11 @@
+#include <stdlib.h>
+#include <string.h>
+
+/* Ericsson Texture Compression: every 4x4 block of RGB
+ * pixels is stored in 8 bytes, with rows in the same
+ * order as the source image. */
+#define ETC1_BLOCK_SIZE 8
+
+int etc1DataSize(int width, int height);
+int etc1EncodeImage(int width, int height, int format, void *data, void **outData);
+int etc1DecodeImage(int width, int height, void *data, void **outData);
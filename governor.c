@@ -0,0 +1,175 @@
+/**************************************************************************
+ *
+ * Copyright 2014 Scott Moreau <oreaus@gmail.com>
+ * All Rights Reserved.
+ *
+ **************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "wobbly.h"
+#include "governor.h"
+
+/* Lower detail after this many frames over budget */
+#define GOVERNOR_OVER_FRAMES 3
+/* Raise it after this many frames under GOVERNOR_HEADROOM of it */
+#define GOVERNOR_UNDER_FRAMES 30
+#define GOVERNOR_HEADROOM 0.7
+/* Frames to leave a change to show its effect before the next */
+#define GOVERNOR_COOLDOWN 10
+/* Weight of the newest frame in the smoothed cost */
+#define GOVERNOR_SMOOTHING 0.2
+
+static const double level_scale[GOVERNOR_LEVELS] = { 1.0, 0.75, 0.5, 0.375, 0.25 };
+/* 0 leaves the physics steps unlimited */
+static const int level_steps[GOVERNOR_LEVELS] = { 0, 0, 3, 2, 1 };
+
+void
+governor_init(struct frame_governor *governor, double budget_ms)
+{
+   memset(governor, 0, sizeof (*governor));
+   governor->budget_ms = budget_ms;
+}
+
+void
+governor_add_surface(struct governed_surface *governed, struct surface *surface)
+{
+   memset(governed, 0, sizeof (*governed));
+   governed->surface = surface;
+   governed->x_cells = governed->applied_x = surface->x_cells;
+   governed->y_cells = governed->applied_y = surface->y_cells;
+   governed->last_x = surface->x;
+   governed->last_y = surface->y;
+}
+
+/* Large surfaces and ones in motion show their detail the most */
+static double
+priority(struct governed_surface *governed)
+{
+   struct surface *surface = governed->surface;
+
+   return (double) surface->width * surface->height * (1.0 + governed->speed / 8.0);
+}
+
+static void
+apply_level(struct governed_surface *governed)
+{
+   struct surface *surface = governed->surface;
+   double scale = level_scale[governed->level];
+
+   governed->applied_x = governed->x_cells * scale + 0.5;
+   governed->applied_y = governed->y_cells * scale + 0.5;
+   if (governed->applied_x < 1)
+      governed->applied_x = 1;
+   if (governed->applied_y < 1)
+      governed->applied_y = 1;
+
+   surface->x_cells = governed->applied_x;
+   surface->y_cells = governed->applied_y;
+   wobbly_set_step_budget(surface, level_steps[governed->level]);
+}
+
+/*
+ * Account for a frame that cost frame_ms and adjust at most one
+ * surface.  Returns 1 if anything changed.
+ */
+int
+governor_frame(struct frame_governor *governor, double frame_ms,
+               struct governed_surface *surfaces, int count)
+{
+   struct governed_surface *governed, *pick = NULL;
+   double p, best = 0;
+   int i, dx, dy;
+
+   governor->frames++;
+   if (governor->frames == 1)
+      governor->frame_ms = frame_ms;
+   else
+      governor->frame_ms += (frame_ms - governor->frame_ms) * GOVERNOR_SMOOTHING;
+
+   for (i = 0; i < count; i++) {
+      governed = &surfaces[i];
+
+      /* Cell counts changed behind our back are a new request */
+      if (governed->surface->x_cells != governed->applied_x ||
+          governed->surface->y_cells != governed->applied_y) {
+         governed->x_cells = governed->surface->x_cells;
+         governed->y_cells = governed->surface->y_cells;
+         apply_level(governed);
+      }
+
+      dx = governed->surface->x - governed->last_x;
+      dy = governed->surface->y - governed->last_y;
+      governed->last_x = governed->surface->x;
+      governed->last_y = governed->surface->y;
+      governed->speed += (abs(dx) + abs(dy) - governed->speed) * GOVERNOR_SMOOTHING;
+   }
+
+   if (governor->frame_ms > governor->budget_ms) {
+      governor->over++;
+      governor->under = 0;
+   } else if (governor->frame_ms < governor->budget_ms * GOVERNOR_HEADROOM) {
+      governor->under++;
+      governor->over = 0;
+   } else {
+      governor->over = governor->under = 0;
+   }
+
+   if (governor->cooldown) {
+      governor->cooldown--;
+      return 0;
+   }
+
+   if (governor->over >= GOVERNOR_OVER_FRAMES) {
+      for (i = 0; i < count; i++) {
+         p = priority(&surfaces[i]);
+         if (surfaces[i].level < GOVERNOR_LEVELS - 1 && (!pick || p < best)) {
+            pick = &surfaces[i];
+            best = p;
+         }
+      }
+      if (pick) {
+         pick->level++;
+         governor->lowered++;
+      }
+   } else if (governor->under >= GOVERNOR_UNDER_FRAMES) {
+      for (i = 0; i < count; i++) {
+         p = priority(&surfaces[i]);
+         if (surfaces[i].level > 0 && (!pick || p > best)) {
+            pick = &surfaces[i];
+            best = p;
+         }
+      }
+      if (pick) {
+         pick->level--;
+         governor->raised++;
+      }
+   }
+
+   if (!pick)
+      return 0;
+
+   apply_level(pick);
+   governor->over = governor->under = 0;
+   governor->cooldown = GOVERNOR_COOLDOWN;
+
+   return 1;
+}
+
+void
+governor_report(struct frame_governor *governor, struct governed_surface *surfaces,
+                int count, FILE *out)
+{
+   int i;
+
+   fprintf(out, "governor: %.2f ms budget, %.2f ms smoothed frame cost, "
+           "%u frames, detail lowered %u times, raised %u times\n",
+           governor->budget_ms, governor->frame_ms, governor->frames,
+           governor->lowered, governor->raised);
+
+   for (i = 0; i < count; i++)
+      fprintf(out, "  surface %d: level %d, %dx%d of %dx%d cells, step budget %d\n",
+              i, surfaces[i].level, surfaces[i].applied_x, surfaces[i].applied_y,
+              surfaces[i].x_cells, surfaces[i].y_cells, level_steps[surfaces[i].level]);
+}
@@ -0,0 +1,54 @@
+/**************************************************************************
+ *
+ * Copyright 2014 Scott Moreau <oreaus@gmail.com>
+ * All Rights Reserved.
+ *
+ **************************************************************************/
+
+#include <stdio.h>
+
+struct surface;
+
+/* Detail levels, from the cell counts asked for down to a quarter */
+#define GOVERNOR_LEVELS 5
+
+/*
+ * A surface under the governor's control.  The cell counts found on
+ * the surface when it was added, or set on it since, are taken as the
+ * most it should get; the governor scales them down by level.
+ */
+struct governed_surface {
+   struct surface *surface;
+   int x_cells, y_cells;         /* asked for */
+   int applied_x, applied_y;     /* last set by the governor */
+   int level;                    /* 0 is full detail */
+   int last_x, last_y;
+   double speed;                 /* pixels per frame, smoothed */
+};
+
+/*
+ * Keeps the measured cost of a frame under budget_ms by trading
+ * detail: tessellation density and the physics steps a surface may
+ * take per frame.  Small, slow surfaces give up detail first and get
+ * it back last.  It only acts once the cost has been over budget, or
+ * comfortably under it, for a run of frames, and then holds off for a
+ * while, so it doesn't oscillate between two levels.
+ */
+struct frame_governor {
+   double budget_ms;
+   double frame_ms;              /* smoothed cost */
+   int over, under;              /* consecutive frames either side */
+   int cooldown;
+   unsigned int frames, lowered, raised;
+};
+
+void
+governor_init(struct frame_governor *governor, double budget_ms);
+void
+governor_add_surface(struct governed_surface *governed, struct surface *surface);
+int
+governor_frame(struct frame_governor *governor, double frame_ms,
+               struct governed_surface *surfaces, int count);
+void
+governor_report(struct frame_governor *governor, struct governed_surface *surfaces,
+                int count, FILE *out);
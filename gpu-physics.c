@@ -0,0 +1,733 @@
+/**************************************************************************
+ *
+ * Copyright 2014 Scott Moreau <oreaus@gmail.com>
+ * All Rights Reserved.
+ *
+ **************************************************************************/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <GLES2/gl2.h>
+#include <GLES2/gl2ext.h>
+
+#include "wobbly.h"
+#include "gpu-physics.h"
+
+/* Texels per model, one per control point, side by side in a row */
+#define GPU_POINTS (WOBBLY_GRID_SIZE * WOBBLY_GRID_SIZE)
+#define GPU_MAX_WIDTH 4096
+
+struct gpu_model {
+   int anchor;          /* point held still, -1 for none */
+   float x, y;          /* where it is held */
+   float hpad, vpad;    /* spring lengths */
+};
+
+struct gpu_physics {
+   GLuint state[2], fbo[2], params;
+   int current;         /* state texture holding the newest step */
+   int width, height, blocks;
+   int max_models, num_models;
+   struct gpu_model *models;
+   float steps;
+
+   GLuint step_program, draw_program, quad;
+   GLint step_texel;
+   GLint draw_matrix, draw_texel, draw_blocks;
+
+   GLuint grid_vbo, grid_ibo;
+   int grid_cells, grid_models, batch_models;
+};
+
+/*
+ * One step for every control point at once.  A point's springs go to
+ * the points beside it in its row of texels and a lattice row of
+ * texels away; anchored points stand still.
+ *
+ * Everything must be highp, or positions get rounded to a fraction of
+ * a pixel: samplers default to lowp, and gl_FragColor is mediump in
+ * GLSL ES 1.00, so where the context allows the step is built as
+ * GLSL ES 3.00 with a highp output instead.
+ */
+static const char *es3_vert_header =
+   "#version 300 es\n"
+   "#define attribute in\n";
+
+static const char *es3_frag_header =
+   "#version 300 es\n"
+   "#define texture2D texture\n"
+   "out highp vec4 next_state;\n";
+
+static const char *es2_frag_header =
+   "#define next_state gl_FragColor\n";
+
+static const char *step_vert_text =
+   "attribute vec2 corner;\n"
+   "void main() {\n"
+   "   gl_Position = vec4(corner, 0.0, 1.0);\n"
+   "}\n";
+
+static const char *step_frag_text =
+   "precision highp float;\n"
+   "precision highp sampler2D;\n"
+   "uniform sampler2D state;\n"
+   "uniform sampler2D params;\n"
+   "uniform vec2 texel;\n"
+   "uniform float k, friction, mass;\n"
+   "vec2 pull(vec2 coord, vec2 p, vec2 offset) {\n"
+   "   return k * (0.5 * (texture2D(state, coord).xy - p + offset));\n"
+   "}\n"
+   "void main() {\n"
+   "   vec2 coord = gl_FragCoord.xy * texel;\n"
+   "   vec4 s = texture2D(state, coord);\n"
+   "   vec4 p = texture2D(params, coord);\n"
+   "   float i = mod(floor(gl_FragCoord.x), GRID_POINTS);\n"
+   "   float gx = mod(i, GRID_SIZE), gy = floor(i / GRID_SIZE);\n"
+   "   vec2 f = vec2(0.0), v;\n"
+   "   if (p.z > 0.5) {\n"
+   "      next_state = vec4(s.xy, 0.0, 0.0);\n"
+   "      return;\n"
+   "   }\n"
+   "   if (gx > 0.5)\n"
+   "      f += pull(coord - vec2(texel.x, 0.0), s.xy, vec2(p.x, 0.0));\n"
+   "   if (gx < GRID_SIZE - 1.5)\n"
+   "      f += pull(coord + vec2(texel.x, 0.0), s.xy, vec2(-p.x, 0.0));\n"
+   "   if (gy > 0.5)\n"
+   "      f += pull(coord - vec2(GRID_SIZE * texel.x, 0.0), s.xy, vec2(0.0, p.y));\n"
+   "   if (gy < GRID_SIZE - 1.5)\n"
+   "      f += pull(coord + vec2(GRID_SIZE * texel.x, 0.0), s.xy, vec2(0.0, -p.y));\n"
+   "   f -= friction * s.zw;\n"
+   "   v = s.zw + f / mass;\n"
+   "   next_state = vec4(s.xy + v, v);\n"
+   "}\n";
+
+/* The same bicubic patch wobbly_write_geometry evaluates, over the
+ * first 4x4 points of the lattice */
+static const char *draw_vert_text =
+   "precision highp sampler2D;\n"
+   "uniform mat4 modelviewProjection;\n"
+   "uniform sampler2D state;\n"
+   "uniform vec2 texel;\n"
+   "uniform float blocks;\n"
+   "attribute vec3 grid;\n"
+   "varying vec2 v_texcoord;\n"
+   "vec4 bernstein(float t) {\n"
+   "   float s = 1.0 - t;\n"
+   "   return vec4(s * s * s, 3.0 * t * s * s, 3.0 * t * t * s, t * t * t);\n"
+   "}\n"
+   "void main() {\n"
+   "   float row = floor((grid.z + 0.5) / blocks);\n"
+   "   vec2 origin = vec2(((grid.z - row * blocks) * GRID_POINTS + 0.5) * texel.x,\n"
+   "                      (row + 0.5) * texel.y);\n"
+   "   vec4 cu = bernstein(grid.x), cv = bernstein(grid.y);\n"
+   "   vec2 pos = vec2(0.0);\n"
+   "   for (int j = 0; j < 4; j++)\n"
+   "      for (int i = 0; i < 4; i++)\n"
+   "         pos += cu[i] * cv[j] *\n"
+   "                texture2D(state, origin +\n"
+   "                          vec2((float(j) * GRID_SIZE + float(i)) * texel.x, 0.0)).xy;\n"
+   "   gl_Position = modelviewProjection * vec4(pos, 0.0, 1.0);\n"
+   "   v_texcoord = vec2(grid.x, 1.0 - grid.y);\n"
+   "}\n";
+
+static const char *draw_frag_text =
+   "precision mediump float;\n"
+   "varying vec2 v_texcoord;\n"
+   "uniform sampler2D tex;\n"
+   "void main() {\n"
+   "   gl_FragColor = texture2D(tex, v_texcoord);\n"
+   "}\n";
+
+/*
+ * Each shader is its header, the lattice layout the wobbly core was
+ * built with, then its text.
+ */
+static GLuint
+build_program(const char *vert_header, const char *vert_text,
+              const char *frag_header, const char *frag_text, const char *attribute)
+{
+   char grid[128];
+   const char *vert[3] = { vert_header, grid, vert_text };
+   const char *frag[3] = { frag_header, grid, frag_text };
+   GLuint program, shaders[2];
+   GLint stat;
+   char log[1000];
+   int i;
+
+   snprintf(grid, sizeof (grid), "#define GRID_SIZE %d.0\n#define GRID_POINTS %d.0\n",
+            WOBBLY_GRID_SIZE, GPU_POINTS);
+
+   program = glCreateProgram();
+   shaders[0] = glCreateShader(GL_VERTEX_SHADER);
+   shaders[1] = glCreateShader(GL_FRAGMENT_SHADER);
+   glShaderSource(shaders[0], 3, vert, NULL);
+   glShaderSource(shaders[1], 3, frag, NULL);
+
+   for (i = 0; i < 2; i++) {
+      glCompileShader(shaders[i]);
+      glGetShaderiv(shaders[i], GL_COMPILE_STATUS, &stat);
+      if (!stat) {
+         glGetShaderInfoLog(shaders[i], sizeof (log), NULL, log);
+         printf("Error: gpu physics shader did not compile:\n%s\n", log);
+      }
+      glAttachShader(program, shaders[i]);
+      glDeleteShader(shaders[i]);
+   }
+
+   glBindAttribLocation(program, 0, attribute);
+   glLinkProgram(program);
+   glGetProgramiv(program, GL_LINK_STATUS, &stat);
+   if (!stat) {
+      glDeleteProgram(program);
+      return 0;
+   }
+
+   return program;
+}
+
+/*
+ * Float textures the size of the state.  OpenGL ES 2 drivers take an
+ * unsized format; ES 3 ones only render to the sized one.
+ */
+static int
+create_state_textures(struct gpu_physics *gp, GLfloat *zero)
+{
+   static const GLenum formats[] = { GL_RGBA, GL_RGBA32F_EXT };
+   GLuint textures[3];
+   int i, f;
+
+   for (f = 0; f < 2; f++) {
+      glGenTextures(3, textures);
+      for (i = 0; i < 3; i++) {
+         glBindTexture(GL_TEXTURE_2D, textures[i]);
+         glTexImage2D(GL_TEXTURE_2D, 0, formats[f], gp->width, gp->height, 0,
+                      GL_RGBA, GL_FLOAT, zero);
+         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+      }
+      glBindTexture(GL_TEXTURE_2D, 0);
+
+      for (i = 0; i < 2; i++) {
+         glBindFramebuffer(GL_FRAMEBUFFER, gp->fbo[i]);
+         glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+                                textures[i], 0);
+         if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            break;
+      }
+
+      if (i == 2 && glGetError() == GL_NO_ERROR) {
+         gp->state[0] = textures[0];
+         gp->state[1] = textures[1];
+         gp->params = textures[2];
+         return 1;
+      }
+
+      glDeleteTextures(3, textures);
+      while (glGetError() != GL_NO_ERROR)
+         ;
+   }
+
+   return 0;
+}
+
+/*
+ * Room for max_models models, or NULL if float textures can't be
+ * drawn into, read back or sampled in vertex shaders here.
+ */
+struct gpu_physics *
+gpu_physics_create(int max_models)
+{
+   static const GLfloat quad[] = { -1, -1, 1, -1, -1, 1, 1, 1 };
+   struct gpu_physics *gp;
+   const char *extensions, *version;
+   int major;
+   GLint units, max_size, range[2], precision, framebuffer, program, type;
+   GLfloat *zero;
+
+   extensions = (const char *) glGetString(GL_EXTENSIONS);
+   if (!extensions || !strstr(extensions, "GL_OES_texture_float"))
+      return NULL;
+
+   glGetIntegerv(GL_MAX_VERTEX_TEXTURE_IMAGE_UNITS, &units);
+   glGetShaderPrecisionFormat(GL_FRAGMENT_SHADER, GL_HIGH_FLOAT, range, &precision);
+   if (units < 1 || precision < 23)
+      return NULL;
+
+   gp = calloc(1, sizeof (*gp));
+   if (!gp)
+      return NULL;
+
+   glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+   if (max_size > GPU_MAX_WIDTH)
+      max_size = GPU_MAX_WIDTH;
+   gp->blocks = max_size / GPU_POINTS;
+   if (gp->blocks > max_models)
+      gp->blocks = max_models;
+   gp->width = gp->blocks * GPU_POINTS;
+   gp->height = (max_models + gp->blocks - 1) / gp->blocks;
+   gp->max_models = max_models;
+
+   gp->models = calloc(max_models, sizeof (*gp->models));
+   zero = calloc(gp->width * gp->height, sizeof (GLfloat) * 4);
+   if (!gp->models || !zero || gp->height > max_size) {
+      free(zero);
+      free(gp->models);
+      free(gp);
+      return NULL;
+   }
+
+   glGetIntegerv(GL_FRAMEBUFFER_BINDING, &framebuffer);
+   glGetIntegerv(GL_CURRENT_PROGRAM, &program);
+
+   glGenFramebuffers(2, gp->fbo);
+   if (!create_state_textures(gp, zero))
+      goto fail;
+
+   /* Grabs read points back to find the nearest */
+   glBindFramebuffer(GL_FRAMEBUFFER, gp->fbo[0]);
+   glGetIntegerv(GL_IMPLEMENTATION_COLOR_READ_TYPE, &type);
+   if (type != GL_FLOAT) {
+      GLfloat texel[4];
+
+      glReadPixels(0, 0, 1, 1, GL_RGBA, GL_FLOAT, texel);
+      if (glGetError() != GL_NO_ERROR)
+         goto fail;
+   }
+
+   version = (const char *) glGetString(GL_VERSION);
+   if (version && sscanf(version, "OpenGL ES %d", &major) == 1 && major >= 3)
+      gp->step_program = build_program(es3_vert_header, step_vert_text,
+                                       es3_frag_header, step_frag_text, "corner");
+   else
+      gp->step_program = build_program("", step_vert_text,
+                                       es2_frag_header, step_frag_text, "corner");
+   gp->draw_program = build_program("", draw_vert_text, "", draw_frag_text, "grid");
+   if (!gp->step_program || !gp->draw_program)
+      goto fail;
+
+   glUseProgram(gp->step_program);
+   glUniform1i(glGetUniformLocation(gp->step_program, "state"), 0);
+   glUniform1i(glGetUniformLocation(gp->step_program, "params"), 1);
+   glUniform1f(glGetUniformLocation(gp->step_program, "k"), WOBBLY_SPRING_K);
+   glUniform1f(glGetUniformLocation(gp->step_program, "friction"), WOBBLY_FRICTION);
+   glUniform1f(glGetUniformLocation(gp->step_program, "mass"), WOBBLY_MASS);
+   gp->step_texel = glGetUniformLocation(gp->step_program, "texel");
+   glUniform2f(gp->step_texel, 1.0f / gp->width, 1.0f / gp->height);
+
+   glUseProgram(gp->draw_program);
+   glUniform1i(glGetUniformLocation(gp->draw_program, "tex"), 0);
+   glUniform1i(glGetUniformLocation(gp->draw_program, "state"), 1);
+   gp->draw_matrix = glGetUniformLocation(gp->draw_program, "modelviewProjection");
+   gp->draw_texel = glGetUniformLocation(gp->draw_program, "texel");
+   gp->draw_blocks = glGetUniformLocation(gp->draw_program, "blocks");
+   glUniform2f(gp->draw_texel, 1.0f / gp->width, 1.0f / gp->height);
+   glUniform1f(gp->draw_blocks, gp->blocks);
+
+   glGenBuffers(1, &gp->quad);
+   glBindBuffer(GL_ARRAY_BUFFER, gp->quad);
+   glBufferData(GL_ARRAY_BUFFER, sizeof (quad), quad, GL_STATIC_DRAW);
+   glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+   glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+   glUseProgram(program);
+   free(zero);
+
+   return gp;
+
+fail:
+   glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+   glUseProgram(program);
+   free(zero);
+   gpu_physics_destroy(gp);
+
+   return NULL;
+}
+
+void
+gpu_physics_destroy(struct gpu_physics *gp)
+{
+   if (!gp)
+      return;
+
+   glDeleteFramebuffers(2, gp->fbo);
+   glDeleteTextures(2, gp->state);
+   glDeleteTextures(1, &gp->params);
+   glDeleteProgram(gp->step_program);
+   glDeleteProgram(gp->draw_program);
+   glDeleteBuffers(1, &gp->quad);
+   glDeleteBuffers(1, &gp->grid_vbo);
+   glDeleteBuffers(1, &gp->grid_ibo);
+   free(gp->models);
+   free(gp);
+}
+
+static void
+block_origin(struct gpu_physics *gp, int model, int *x, int *y)
+{
+   *x = (model % gp->blocks) * GPU_POINTS;
+   *y = model / gp->blocks;
+}
+
+static void
+write_texels(struct gpu_physics *gp, GLuint texture, int model, int point,
+             int count, const GLfloat *texels)
+{
+   int x, y;
+
+   block_origin(gp, model, &x, &y);
+   glBindTexture(GL_TEXTURE_2D, texture);
+   glTexSubImage2D(GL_TEXTURE_2D, 0, x + point, y, count, 1, GL_RGBA, GL_FLOAT, texels);
+   glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+static void
+read_block(struct gpu_physics *gp, int model, GLfloat *texels)
+{
+   GLint framebuffer;
+   int x, y;
+
+   block_origin(gp, model, &x, &y);
+   glGetIntegerv(GL_FRAMEBUFFER_BINDING, &framebuffer);
+   glBindFramebuffer(GL_FRAMEBUFFER, gp->fbo[gp->current]);
+   glReadPixels(x, y, GPU_POINTS, 1, GL_RGBA, GL_FLOAT, texels);
+   glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+}
+
+static void
+set_immobile(struct gpu_physics *gp, int model, int point, int immobile)
+{
+   GLfloat texel[4];
+
+   texel[0] = gp->models[model].hpad;
+   texel[1] = gp->models[model].vpad;
+   texel[2] = immobile;
+   texel[3] = 0;
+   write_texels(gp, gp->params, model, point, 1, texel);
+}
+
+/* Anchored points stand still where they are held */
+static void
+write_anchor(struct gpu_physics *gp, int model)
+{
+   GLfloat texel[4];
+
+   texel[0] = gp->models[model].x;
+   texel[1] = gp->models[model].y;
+   texel[2] = 0;
+   texel[3] = 0;
+   write_texels(gp, gp->state[gp->current], model, gp->models[model].anchor, 1, texel);
+}
+
+/*
+ * A model laid out the way the wobbly core starts one, held by its
+ * middle point.  Returns its index, or -1 if there is no room.
+ */
+int
+gpu_physics_add(struct gpu_physics *gp, float x, float y, float width, float height)
+{
+   GLfloat state[GPU_POINTS * 4], params[GPU_POINTS * 4];
+   float gw = WOBBLY_GRID_SIZE - 1, gh = WOBBLY_GRID_SIZE - 1;
+   int model, i, gx, gy, anchor;
+
+   if (gp->num_models == gp->max_models)
+      return -1;
+   model = gp->num_models++;
+
+   anchor = WOBBLY_GRID_SIZE * ((WOBBLY_GRID_SIZE - 1) / 2) + (WOBBLY_GRID_SIZE - 1) / 2;
+
+   for (i = 0; i < GPU_POINTS; i++) {
+      gx = i % WOBBLY_GRID_SIZE;
+      gy = i / WOBBLY_GRID_SIZE;
+      state[4 * i] = x + (gx * width) / gw;
+      state[4 * i + 1] = y + (gy * height) / gh;
+      state[4 * i + 2] = 0;
+      state[4 * i + 3] = 0;
+
+      params[4 * i] = width / gw;
+      params[4 * i + 1] = height / gh;
+      params[4 * i + 2] = i == anchor;
+      params[4 * i + 3] = 0;
+   }
+
+   gp->models[model].anchor = anchor;
+   gp->models[model].x = state[4 * anchor];
+   gp->models[model].y = state[4 * anchor + 1];
+   gp->models[model].hpad = params[0];
+   gp->models[model].vpad = params[1];
+
+   write_texels(gp, gp->state[gp->current], model, 0, GPU_POINTS, state);
+   write_texels(gp, gp->params, model, 0, GPU_POINTS, params);
+
+   return model;
+}
+
+/*
+ * Hold the point nearest (x, y) instead, nudging the points around it
+ * the way wobbly_grab_notify does.  Reads the model back, so it costs
+ * a round trip; only grabs need it.  Returns the point held.
+ */
+int
+gpu_physics_grab(struct gpu_physics *gp, int model, float x, float y)
+{
+   struct gpu_model *m = &gp->models[model];
+   GLfloat block[GPU_POINTS * 4];
+   float d, dx, dy, nearest = 0;
+   int i, point = 0, gx, gy;
+
+   read_block(gp, model, block);
+
+   for (i = 0; i < GPU_POINTS; i++) {
+      dx = block[4 * i] - x;
+      dy = block[4 * i + 1] - y;
+      d = sqrt(dx * dx + dy * dy);
+      if (i == 0 || d < nearest) {
+         nearest = d;
+         point = i;
+      }
+   }
+
+   if (m->anchor >= 0)
+      set_immobile(gp, model, m->anchor, 0);
+   set_immobile(gp, model, point, 1);
+
+   m->anchor = point;
+   m->x = block[4 * point];
+   m->y = block[4 * point + 1];
+
+   gx = point % WOBBLY_GRID_SIZE;
+   gy = point / WOBBLY_GRID_SIZE;
+   if (gx > 0)
+      block[4 * (point - 1) + 2] += m->hpad * 0.05f;
+   if (gx < WOBBLY_GRID_SIZE - 1)
+      block[4 * (point + 1) + 2] -= m->hpad * 0.05f;
+   if (gy > 0)
+      block[4 * (point - WOBBLY_GRID_SIZE) + 3] += m->vpad * 0.05f;
+   if (gy < WOBBLY_GRID_SIZE - 1)
+      block[4 * (point + WOBBLY_GRID_SIZE) + 3] -= m->vpad * 0.05f;
+
+   write_texels(gp, gp->state[gp->current], model, 0, GPU_POINTS, block);
+
+   return point;
+}
+
+void
+gpu_physics_move(struct gpu_physics *gp, int model, float dx, float dy)
+{
+   struct gpu_model *m = &gp->models[model];
+
+   if (m->anchor < 0)
+      return;
+
+   m->x += dx;
+   m->y += dy;
+   write_anchor(gp, model);
+}
+
+void
+gpu_physics_ungrab(struct gpu_physics *gp, int model)
+{
+   struct gpu_model *m = &gp->models[model];
+
+   if (m->anchor < 0)
+      return;
+
+   set_immobile(gp, model, m->anchor, 0);
+   m->anchor = -1;
+}
+
+void
+gpu_physics_step(struct gpu_physics *gp, int steps)
+{
+   GLint framebuffer, program, viewport[4];
+   int rows;
+
+   if (!gp->num_models || steps <= 0)
+      return;
+
+   glGetIntegerv(GL_FRAMEBUFFER_BINDING, &framebuffer);
+   glGetIntegerv(GL_CURRENT_PROGRAM, &program);
+   glGetIntegerv(GL_VIEWPORT, viewport);
+
+   /* Only the rows models are in */
+   rows = (gp->num_models + gp->blocks - 1) / gp->blocks;
+   glViewport(0, 0, gp->width, rows);
+
+   glUseProgram(gp->step_program);
+   glBindBuffer(GL_ARRAY_BUFFER, gp->quad);
+   glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, 0);
+   glEnableVertexAttribArray(0);
+
+   glActiveTexture(GL_TEXTURE1);
+   glBindTexture(GL_TEXTURE_2D, gp->params);
+   glActiveTexture(GL_TEXTURE0);
+
+   while (steps--) {
+      glBindFramebuffer(GL_FRAMEBUFFER, gp->fbo[!gp->current]);
+      glBindTexture(GL_TEXTURE_2D, gp->state[gp->current]);
+      glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+      gp->current = !gp->current;
+   }
+
+   glBindTexture(GL_TEXTURE_2D, 0);
+   glActiveTexture(GL_TEXTURE1);
+   glBindTexture(GL_TEXTURE_2D, 0);
+   glActiveTexture(GL_TEXTURE0);
+   glDisableVertexAttribArray(0);
+   glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+   glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+   glUseProgram(program);
+   glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+}
+
+/* Step as many times as the wobbly core would in ms; returns how many */
+int
+gpu_physics_advance(struct gpu_physics *gp, float ms)
+{
+   int steps;
+
+   gp->steps += ms / 15.0f;
+   steps = floor(gp->steps);
+   gp->steps -= steps;
+
+   gpu_physics_step(gp, steps);
+
+   return steps;
+}
+
+/* Read a model's control points back, as wobbly_control_points does */
+int
+gpu_physics_read(struct gpu_physics *gp, int model, GLfloat *points)
+{
+   GLfloat block[GPU_POINTS * 4];
+   int i;
+
+   read_block(gp, model, block);
+   for (i = 0; i < GPU_POINTS; i++) {
+      points[2 * i] = block[4 * i];
+      points[2 * i + 1] = block[4 * i + 1];
+   }
+
+   return GPU_POINTS;
+}
+
+/*
+ * Grids of cells by cells for every model: (u, v, model) per vertex,
+ * and indices for as many models as 16 bit indices reach, drawn in
+ * batches from successive offsets into the vertices.
+ */
+static int
+update_grid(struct gpu_physics *gp, int cells)
+{
+   struct surface grid;
+   GLfloat *vertices, *v;
+   GLushort *indices;
+   int per_model, count, m, i, x, y;
+
+   if (cells == gp->grid_cells && gp->num_models == gp->grid_models)
+      return 1;
+
+   per_model = (cells + 1) * (cells + 1);
+   if (per_model > 65536)
+      return 0;
+   gp->batch_models = 65536 / per_model;
+   if (gp->batch_models > gp->num_models)
+      gp->batch_models = gp->num_models;
+
+   count = cells * cells * 6;
+   vertices = malloc(sizeof (GLfloat) * 3 * per_model * gp->num_models);
+   indices = malloc(sizeof (GLushort) * count * gp->batch_models);
+   if (!vertices || !indices) {
+      free(vertices);
+      free(indices);
+      return 0;
+   }
+
+   for (m = 0, v = vertices; m < gp->num_models; m++) {
+      for (y = 0; y <= cells; y++) {
+         for (x = 0; x <= cells; x++) {
+            *v++ = (float) x / cells;
+            *v++ = (float) y / cells;
+            *v++ = m;
+         }
+      }
+   }
+
+   memset(&grid, 0, sizeof (grid));
+   grid.x_cells = grid.y_cells = cells;
+   wobbly_write_indices(&grid, indices, count);
+   for (m = 1; m < gp->batch_models; m++)
+      for (i = 0; i < count; i++)
+         indices[m * count + i] = indices[i] + m * per_model;
+
+   if (!gp->grid_vbo) {
+      glGenBuffers(1, &gp->grid_vbo);
+      glGenBuffers(1, &gp->grid_ibo);
+   }
+   glBindBuffer(GL_ARRAY_BUFFER, gp->grid_vbo);
+   glBufferData(GL_ARRAY_BUFFER, sizeof (GLfloat) * 3 * per_model * gp->num_models,
+                vertices, GL_STATIC_DRAW);
+   glBindBuffer(GL_ARRAY_BUFFER, 0);
+   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, gp->grid_ibo);
+   glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof (GLushort) * count * gp->batch_models,
+                indices, GL_STATIC_DRAW);
+   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+   free(vertices);
+   free(indices);
+
+   gp->grid_cells = cells;
+   gp->grid_models = gp->num_models;
+
+   return 1;
+}
+
+/* Draw every model, textured, as a grid of cells by cells */
+void
+gpu_physics_draw(struct gpu_physics *gp, const GLfloat *matrix, GLuint texture,
+                 int cells)
+{
+   GLint program;
+   int m, n, per_model;
+
+   if (!gp->num_models || cells < 1 || !update_grid(gp, cells))
+      return;
+
+   glGetIntegerv(GL_CURRENT_PROGRAM, &program);
+   glUseProgram(gp->draw_program);
+   glUniformMatrix4fv(gp->draw_matrix, 1, GL_FALSE, matrix);
+
+   glActiveTexture(GL_TEXTURE1);
+   glBindTexture(GL_TEXTURE_2D, gp->state[gp->current]);
+   glActiveTexture(GL_TEXTURE0);
+   glBindTexture(GL_TEXTURE_2D, texture);
+
+   glBindBuffer(GL_ARRAY_BUFFER, gp->grid_vbo);
+   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, gp->grid_ibo);
+   glEnableVertexAttribArray(0);
+
+   per_model = (cells + 1) * (cells + 1);
+   for (m = 0; m < gp->num_models; m += gp->batch_models) {
+      n = gp->num_models - m;
+      if (n > gp->batch_models)
+         n = gp->batch_models;
+      glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof (GLfloat) * 3,
+                            (const GLvoid *) (sizeof (GLfloat) * 3 * per_model * m));
+      glDrawElements(GL_TRIANGLES, n * cells * cells * 6, GL_UNSIGNED_SHORT, 0);
+   }
+
+   glDisableVertexAttribArray(0);
+   glBindBuffer(GL_ARRAY_BUFFER, 0);
+   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+   glBindTexture(GL_TEXTURE_2D, 0);
+   glActiveTexture(GL_TEXTURE1);
+   glBindTexture(GL_TEXTURE_2D, 0);
+   glActiveTexture(GL_TEXTURE0);
+
+   glUseProgram(program);
+}
@@ -0,0 +1,43 @@
+/**************************************************************************
+ *
+ * Copyright 2014 Scott Moreau <oreaus@gmail.com>
+ * All Rights Reserved.
+ *
+ **************************************************************************/
+
+#include <GLES2/gl2.h>
+
+/*
+ * Wobbly models stepped entirely on the GPU.  Every model's control
+ * points live in a float texture, one texel per point holding its
+ * position and velocity.  A step is a single pass drawing the next
+ * state into the other of two such textures, and surfaces are drawn by
+ * evaluating their patches from the newest one in the vertex shader.
+ * The CPU only writes the texels input changes.
+ *
+ * Springs, friction and anchoring follow the wobbly core's model;
+ * edge snapping is not done here.
+ */
+struct gpu_physics;
+
+struct gpu_physics *
+gpu_physics_create(int max_models);
+void
+gpu_physics_destroy(struct gpu_physics *gp);
+int
+gpu_physics_add(struct gpu_physics *gp, float x, float y, float width, float height);
+int
+gpu_physics_grab(struct gpu_physics *gp, int model, float x, float y);
+void
+gpu_physics_move(struct gpu_physics *gp, int model, float dx, float dy);
+void
+gpu_physics_ungrab(struct gpu_physics *gp, int model);
+void
+gpu_physics_step(struct gpu_physics *gp, int steps);
+int
+gpu_physics_advance(struct gpu_physics *gp, float ms);
+int
+gpu_physics_read(struct gpu_physics *gp, int model, GLfloat *points);
+void
+gpu_physics_draw(struct gpu_physics *gp, const GLfloat *matrix, GLuint texture,
+                 int cells);
@@ -1,10 +1,38 @@
 #include "image-loader.h"
  
-int loadPngImage(char *name, int *outWidth, int *outHeight, void **outData) {
+int loadPngImage(char *name, int *outWidth, int *outHeight,
+                 int *outFormat, void **outData) {
+    void *data = NULL;
+    int capacity = 0;
+ 
+    if (!loadPngImageReuse(name, outWidth, outHeight, outFormat,
+                           &data, &capacity))
+        return 0;
+ 
+    *outData = data;
+ 
+    return 1;
+}
+ 
+/*
+ * Decode into *outData when it already holds
+ * at least *capacity bytes that are big enough,
+ * so image sequences can recycle their buffers.
+ * Otherwise the buffer is replaced by a larger one.
+ */
+int loadPngImageReuse(char *name, int *outWidth, int *outHeight,
+                      int *outFormat, void **outData, int *capacity) {
     png_structp png_ptr;
     png_infop info_ptr;
     unsigned int sig_read = 0;
-    int color_type, interlace_type, i;
+    int color_type, interlace_type, bit_depth, channels;
+    png_uint_32 width, height, i;
+    png_size_t row_bytes;
+    /* Modified between setjmp and a possible longjmp,
+     * so they must not live in registers */
+    png_bytep volatile data = NULL;
+    png_bytepp volatile row_pointers = NULL;
+    volatile int owned = 0;
     FILE *fp;
  
     if ((fp = fopen(name, "rb")) == NULL)
@@ -51,6 +79,9 @@ int loadPngImage(char *name, int *outWidth, int *outHeight, void **outData) {
         /* Free all of the memory associated
          * with the png_ptr and info_ptr */
         png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+        free(row_pointers);
+        if (owned)
+            free(data);
         fclose(fp);
         /* If we get here, we had a
          * problem reading the file */
@@ -65,48 +96,67 @@ int loadPngImage(char *name, int *outWidth, int *outHeight, void **outData) {
      * read some of the signature */
     png_set_sig_bytes(png_ptr, sig_read);
  
+    png_read_info(png_ptr, info_ptr);
+    png_get_IHDR(png_ptr, info_ptr, &width, &height, &bit_depth, &color_type,
+                 &interlace_type, NULL, NULL);
+ 
     /*
-     * If you have enough memory to read
-     * in the entire image at once, and
-     * you need to specify only
-     * transforms that can be controlled
-     * with one of the PNG_TRANSFORM_*
-     * bits (this presently excludes
-     * dithering, filling, setting
-     * background, and doing gamma
-     * adjustment), then you can read the
-     * entire image (including pixels)
-     * into the info structure with this
-     * call
-     *
-     * PNG_TRANSFORM_STRIP_16 |
-     * PNG_TRANSFORM_PACKING  forces 8 bit
-     * PNG_TRANSFORM_EXPAND forces to
-     *  expand a palette into RGB
+     * Normalize everything to 8 bits per
+     * channel: expand palettes to RGB,
+     * low bit depth gray to 8 bit and
+     * tRNS chunks to a full alpha channel,
+     * and strip 16 bit channels down.
+     * Interlaced images are deinterlaced
+     * by png_read_image once libpng knows
+     * to handle the passes itself.
      */
-    png_read_png(png_ptr, info_ptr, PNG_TRANSFORM_STRIP_16 | PNG_TRANSFORM_PACKING | PNG_TRANSFORM_EXPAND, NULL);
+    png_set_expand(png_ptr);
+    png_set_strip_16(png_ptr);
+    png_set_packing(png_ptr);
+    if (interlace_type != PNG_INTERLACE_NONE)
+        png_set_interlace_handling(png_ptr);
+    png_read_update_info(png_ptr, info_ptr);
  
-    png_uint_32 width, height;
-    int bit_depth;
-    png_get_IHDR(png_ptr, info_ptr, &width, &height, &bit_depth, &color_type,
-                 &interlace_type, NULL, NULL);
-    *outWidth = width;
-    *outHeight = height;
+    channels = png_get_channels(png_ptr, info_ptr);
+    row_bytes = png_get_rowbytes(png_ptr, info_ptr);
  
-    unsigned int row_bytes = png_get_rowbytes(png_ptr, info_ptr);
-    *outData = malloc(row_bytes * height);
+    /*
+     * Allocate the final buffer once (or
+     * reuse the caller's) and let libpng
+     * decode straight into it.
+     * PNG is ordered top to bottom but
+     * OpenGL expects bottom to top, so
+     * the row pointers are handed out in
+     * reverse instead of copying rows.
+     */
+    if (*outData && *capacity >= row_bytes * height) {
+        data = *outData;
+    } else {
+        data = malloc(row_bytes * height);
+        owned = 1;
+    }
+    row_pointers = malloc(sizeof (png_bytep) * height);
+    if (data == NULL || row_pointers == NULL)
+        png_error(png_ptr, "out of memory");
+ 
+    for (i = 0; i < height; i++)
+        row_pointers[i] = data + row_bytes * (height - 1 - i);
  
-    png_bytepp row_pointers = png_get_rows(png_ptr, info_ptr);
+    png_read_image(png_ptr, row_pointers);
+    png_read_end(png_ptr, NULL);
  
-    for (i = 0; i < height; i++) {
-        // note that png is ordered top to
-        // bottom, but OpenGL expect it bottom to top
-        // so the order or swapped
-        memcpy(*outData+(row_bytes * (height-1-i)), row_pointers[i], row_bytes);
+    *outWidth = width;
+    *outHeight = height;
+    *outFormat = channels;
+    if (owned) {
+        free(*outData);
+        *outData = data;
+        *capacity = row_bytes * height;
     }
  
     /* Clean up after the read,
      * and free any memory allocated */
+    free(row_pointers);
     png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
  
     /* Close the file */
@@ -115,3 +165,278 @@ int loadPngImage(char *name, int *outWidth, int *outHeight, void **outData) {
     /* That's it */
     return 1;
 }
+ 
+/*
+ * Resample along one axis with a tent filter
+ * whose support widens when minifying, so the
+ * same code upsamples bilinearly and downsamples
+ * with an area-weighted average.  Works on float
+ * rows so both passes keep full precision.
+ */
+static void resampleAxis(const float *src, int srcLen, float *dst, int dstLen,
+                         int count, int srcStride, int dstStride,
+                         int srcStep, int dstStep, int channels) {
+    float scale = (float) srcLen / dstLen;
+    float radius = scale > 1.0f ? scale : 1.0f;
+    int line, i, s, c, first, last;
+ 
+    for (line = 0; line < count; line++) {
+        const float *in = src + line * srcStride;
+        float *out = dst + line * dstStride;
+ 
+        for (i = 0; i < dstLen; i++) {
+            float center = (i + 0.5f) * scale - 0.5f;
+            float sum[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+            float total = 0.0f;
+ 
+            first = (int) ceilf(center - radius);
+            last = (int) floorf(center + radius);
+ 
+            for (s = first; s <= last; s++) {
+                float w = 1.0f - fabsf(s - center) / radius;
+                int clamped = s < 0 ? 0 : (s >= srcLen ? srcLen - 1 : s);
+ 
+                if (w <= 0.0f)
+                    continue;
+                for (c = 0; c < channels; c++)
+                    sum[c] += w * in[clamped * srcStep + c];
+                total += w;
+            }
+ 
+            for (c = 0; c < channels; c++)
+                out[i * dstStep + c] = sum[c] / total;
+        }
+    }
+}
+ 
+int resampleImage(int width, int height, int format, void *data,
+                  int newWidth, int newHeight, void **outData) {
+    int channels = format, i, n;
+    unsigned char *src = data, *dst;
+    float *in, *tmp, *out;
+ 
+    in = malloc(sizeof (float) * width * height * channels);
+    tmp = malloc(sizeof (float) * newWidth * height * channels);
+    out = malloc(sizeof (float) * newWidth * newHeight * channels);
+    dst = malloc(newWidth * newHeight * channels);
+    if (!in || !tmp || !out || !dst) {
+        free(in);
+        free(tmp);
+        free(out);
+        free(dst);
+        return 0;
+    }
+ 
+    n = width * height * channels;
+    for (i = 0; i < n; i++)
+        in[i] = src[i];
+ 
+    /* Horizontal pass over every row, then
+     * vertical pass over every column */
+    resampleAxis(in, width, tmp, newWidth, height,
+                 width * channels, newWidth * channels,
+                 channels, channels, channels);
+    resampleAxis(tmp, height, out, newHeight, newWidth,
+                 channels, channels,
+                 newWidth * channels, newWidth * channels, channels);
+ 
+    n = newWidth * newHeight * channels;
+    for (i = 0; i < n; i++)
+        dst[i] = (unsigned char) (out[i] + 0.5f);
+ 
+    free(in);
+    free(tmp);
+    free(out);
+ 
+    *outData = dst;
+ 
+    return 1;
+}
+ 
+/*
+ * ETC1 containers.  PKM holds a single level
+ * behind a 16 byte big endian header; KTX 1.1
+ * holds any number of mip levels, each prefixed
+ * by its size.  Levels are returned back to back
+ * in one buffer, largest first.
+ */
+static const unsigned char ktxIdentifier[12] = {
+    0xAB, 0x4B, 0x54, 0x58, 0x20, 0x31, 0x31, 0xBB, 0x0D, 0x0A, 0x1A, 0x0A
+};
+ 
+#define KTX_ENDIAN_REF      0x04030201
+#define KTX_ETC1_RGB8_OES   0x8D64
+#define KTX_RGB             0x1907
+/* Largest side accepted of KTX and PKM files alike, so the sizes of
+ * all levels fit in an int */
+#define KTX_MAX_SIZE        32768
+ 
+static unsigned int swap32(unsigned int v) {
+    return (v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000) | (v << 24);
+}
+ 
+static int readPkm(FILE *fp, int *outWidth, int *outHeight, int *outLevels,
+                   void **outData) {
+    unsigned char header[16];
+    int width, height, size;
+    void *data;
+ 
+    if (fread(header, 1, sizeof (header), fp) != sizeof (header) ||
+        memcmp(header, "PKM 10", 6) != 0)
+        return 0;
+ 
+    /* Format 0 is ETC1_RGB_NO_MIPMAPS */
+    if (((header[6] << 8) | header[7]) != 0)
+        return 0;
+ 
+    width = (header[12] << 8) | header[13];
+    height = (header[14] << 8) | header[15];
+    if (width == 0 || width > KTX_MAX_SIZE || height == 0 || height > KTX_MAX_SIZE)
+        return 0;
+    size = etc1DataSize(width, height);
+ 
+    data = malloc(size);
+    if (!data)
+        return 0;
+ 
+    if (fread(data, 1, size, fp) != size) {
+        free(data);
+        return 0;
+    }
+ 
+    *outWidth = width;
+    *outHeight = height;
+    *outLevels = 1;
+    *outData = data;
+ 
+    return 1;
+}
+ 
+static int readKtx(FILE *fp, int *outWidth, int *outHeight, int *outLevels,
+                   void **outData) {
+    unsigned char identifier[12];
+    unsigned int header[13], imageSize;
+    int i, width, height, levels, maxLevels, size, offset, swapped = 0;
+    unsigned char *data;
+ 
+    if (fread(identifier, 1, sizeof (identifier), fp) != sizeof (identifier) ||
+        memcmp(identifier, ktxIdentifier, sizeof (identifier)) != 0 ||
+        fread(header, sizeof (header[0]), 13, fp) != 13)
+        return 0;
+ 
+    if (header[0] != KTX_ENDIAN_REF) {
+        if (swap32(header[0]) != KTX_ENDIAN_REF)
+            return 0;
+        for (i = 0; i < 13; i++)
+            header[i] = swap32(header[i]);
+        swapped = 1;
+    }
+ 
+    /* glInternalFormat, pixelWidth, pixelHeight,
+     * numberOfMipmapLevels, bytesOfKeyValueData */
+    if (header[4] != KTX_ETC1_RGB8_OES)
+        return 0;
+ 
+    if (header[6] == 0 || header[6] > KTX_MAX_SIZE ||
+        header[7] == 0 || header[7] > KTX_MAX_SIZE)
+        return 0;
+ 
+    width = header[6];
+    height = header[7];
+ 
+    /* No more levels than halving the larger side down to 1 gives */
+    for (maxLevels = 1; (width | height) >> maxLevels; maxLevels++)
+        ;
+    if (header[11] > maxLevels)
+        return 0;
+    levels = header[11] ? header[11] : 1;
+ 
+    if (fseek(fp, header[12], SEEK_CUR) != 0)
+        return 0;
+ 
+    for (i = 0, size = 0; i < levels; i++)
+        size += etc1DataSize(width >> i ? width >> i : 1,
+                             height >> i ? height >> i : 1);
+ 
+    data = malloc(size);
+    if (!data)
+        return 0;
+ 
+    for (i = 0, offset = 0; i < levels; i++) {
+        int levelSize = etc1DataSize(width >> i ? width >> i : 1,
+                                     height >> i ? height >> i : 1);
+ 
+        if (fread(&imageSize, sizeof (imageSize), 1, fp) != 1 ||
+            (swapped ? swap32(imageSize) : imageSize) != levelSize ||
+            fread(data + offset, 1, levelSize, fp) != levelSize) {
+            free(data);
+            return 0;
+        }
+        offset += levelSize;
+    }
+ 
+    *outWidth = width;
+    *outHeight = height;
+    *outLevels = levels;
+    *outData = data;
+ 
+    return 1;
+}
+ 
+int loadEtc1Image(char *name, int *outWidth, int *outHeight, int *outLevels,
+                  void **outData) {
+    FILE *fp;
+    int ret;
+ 
+    if ((fp = fopen(name, "rb")) == NULL)
+        return 0;
+ 
+    ret = readKtx(fp, outWidth, outHeight, outLevels, outData);
+    if (!ret) {
+        rewind(fp);
+        ret = readPkm(fp, outWidth, outHeight, outLevels, outData);
+    }
+ 
+    fclose(fp);
+ 
+    return ret;
+}
+ 
+int saveKtxImage(char *name, int width, int height, int levels, void *data) {
+    unsigned int header[13] = {
+        KTX_ENDIAN_REF,
+        0,                  /* glType, compressed */
+        1,                  /* glTypeSize */
+        0,                  /* glFormat, compressed */
+        KTX_ETC1_RGB8_OES,
+        KTX_RGB,
+        width, height,
+        0, 0,               /* pixelDepth, numberOfArrayElements */
+        1,                  /* numberOfFaces */
+        levels,
+        0                   /* bytesOfKeyValueData */
+    };
+    unsigned char *level = data;
+    unsigned int imageSize;
+    FILE *fp;
+    int i, ok;
+ 
+    if ((fp = fopen(name, "wb")) == NULL)
+        return 0;
+ 
+    ok = fwrite(ktxIdentifier, sizeof (ktxIdentifier), 1, fp) == 1 &&
+         fwrite(header, sizeof (header), 1, fp) == 1;
+ 
+    for (i = 0; ok && i < levels; i++) {
+        imageSize = etc1DataSize(width >> i ? width >> i : 1,
+                                 height >> i ? height >> i : 1);
+        ok = fwrite(&imageSize, sizeof (imageSize), 1, fp) == 1 &&
+             fwrite(level, imageSize, 1, fp) == 1;
+        level += imageSize;
+    }
+ 
+    if (fclose(fp) != 0)
+        ok = 0;
+ 
+    return ok;
+}
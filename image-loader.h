@@ -1,6 +1,23 @@
+#include <math.h>
 #include <png.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-int loadPngImage(char*, int*, int*, void**);
+#include "etc1.h"
+
+/* Pixel layouts produced by the loader.  The value of each
+ * uncompressed format is also its size in bytes per pixel. */
+enum image_format {
+    IMAGE_FORMAT_LUMINANCE       = 1,
+    IMAGE_FORMAT_LUMINANCE_ALPHA = 2,
+    IMAGE_FORMAT_RGB             = 3,
+    IMAGE_FORMAT_RGBA            = 4,
+    IMAGE_FORMAT_ETC1            = 0x10
+};
+
+int loadPngImage(char*, int*, int*, int*, void**);
+int loadPngImageReuse(char*, int*, int*, int*, void**, int*);
+int resampleImage(int, int, int, void*, int, int, void**);
+int loadEtc1Image(char*, int*, int*, int*, void**);
+int saveKtxImage(char*, int, int, int, void*);
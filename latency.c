@@ -0,0 +1,116 @@
+/**************************************************************************
+ *
+ * Copyright 2014 Scott Moreau <oreaus@gmail.com>
+ * All Rights Reserved.
+ *
+ **************************************************************************/
+
+/*
+ * Fixed-bucket latency histograms.  Recording is a couple of adds, so
+ * it can run every frame; percentiles are resolved to a bucket.
+ */
+
+#include <time.h>
+
+#include "latency.h"
+
+/* Monotonic, unlike gettimeofday, so NTP steps don't show up as latency */
+double
+latency_now_ms(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+
+   return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+void
+latency_record(struct latency_histogram *histogram, double ms)
+{
+   int bucket;
+
+   if (ms < 0)
+      ms = 0;
+
+   if (!histogram->count || ms < histogram->min)
+      histogram->min = ms;
+   if (!histogram->count || ms > histogram->max)
+      histogram->max = ms;
+   histogram->count++;
+   histogram->sum += ms;
+
+   bucket = ms / LATENCY_BUCKET_MS;
+   if (bucket < LATENCY_BUCKETS)
+      histogram->buckets[bucket]++;
+   else
+      histogram->overflow++;
+}
+
+/* Upper edge of the bucket holding the given percentile */
+double
+latency_percentile(struct latency_histogram *histogram, double percentile)
+{
+   unsigned int rank, seen = 0;
+   int i;
+
+   if (!histogram->count)
+      return 0;
+
+   rank = histogram->count * percentile / 100.0;
+   if (rank >= histogram->count)
+      rank = histogram->count - 1;
+
+   for (i = 0; i < LATENCY_BUCKETS; i++) {
+      seen += histogram->buckets[i];
+      if (seen > rank)
+         return (i + 1) * LATENCY_BUCKET_MS;
+   }
+
+   return histogram->max;
+}
+
+void
+latency_report(struct latency_histogram *histogram, const char *name, FILE *out)
+{
+   unsigned int peak = 0;
+   int i, lo, hi, width;
+
+   if (!histogram->count) {
+      fprintf(out, "%s: no samples\n", name);
+      return;
+   }
+
+   fprintf(out, "%s: %u samples, min %.2f ms, mean %.2f ms, p50 %.2f ms, "
+           "p90 %.2f ms, p99 %.2f ms, max %.2f ms\n", name, histogram->count,
+           histogram->min, histogram->sum / histogram->count,
+           latency_percentile(histogram, 50), latency_percentile(histogram, 90),
+           latency_percentile(histogram, 99), histogram->max);
+
+   /* One row per millisecond between the first and last bucket in use */
+   for (lo = 0; lo < LATENCY_BUCKETS && !histogram->buckets[lo]; lo++)
+      ;
+   for (hi = LATENCY_BUCKETS - 1; hi > lo && !histogram->buckets[hi]; hi--)
+      ;
+   lo -= lo % 4;
+
+   for (i = lo; i <= hi; i += 4) {
+      unsigned int n = histogram->buckets[i] + histogram->buckets[i + 1] +
+                       histogram->buckets[i + 2] + histogram->buckets[i + 3];
+      if (n > peak)
+         peak = n;
+   }
+
+   for (i = lo; i <= hi; i += 4) {
+      unsigned int n = histogram->buckets[i] + histogram->buckets[i + 1] +
+                       histogram->buckets[i + 2] + histogram->buckets[i + 3];
+
+      width = peak ? n * 50 / peak : 0;
+      fprintf(out, "  %3d ms %6u %.*s\n", (int) (i * LATENCY_BUCKET_MS), n, width,
+              "##################################################");
+   }
+
+   if (histogram->overflow)
+      fprintf(out, "  >%d ms %5u\n", (int) (LATENCY_BUCKETS * LATENCY_BUCKET_MS),
+              histogram->overflow);
+}
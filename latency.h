@@ -0,0 +1,36 @@
+/**************************************************************************
+ *
+ * Copyright 2014 Scott Moreau <oreaus@gmail.com>
+ * All Rights Reserved.
+ *
+ **************************************************************************/
+
+#include <stdio.h>
+
+/* 0.25 ms buckets up to 100 ms, slower samples land in overflow */
+#define LATENCY_BUCKET_MS 0.25
+#define LATENCY_BUCKETS 400
+
+/*
+ * Where an input event came from: the X server timestamp (server
+ * milliseconds, unrelated to our clocks) and when event_loop got it.
+ */
+struct input_tag {
+   unsigned long server_time;
+   double receive_ms;
+};
+
+struct latency_histogram {
+   unsigned int buckets[LATENCY_BUCKETS];
+   unsigned int count, overflow;
+   double sum, min, max;
+};
+
+double
+latency_now_ms(void);
+void
+latency_record(struct latency_histogram *histogram, double ms);
+double
+latency_percentile(struct latency_histogram *histogram, double percentile);
+void
+latency_report(struct latency_histogram *histogram, const char *name, FILE *out);
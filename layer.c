@@ -0,0 +1,126 @@
+/**************************************************************************
+ *
+ * Copyright 2014 Scott Moreau <oreaus@gmail.com>
+ * All Rights Reserved.
+ *
+ **************************************************************************/
+
+#include <string.h>
+
+#include "layer.h"
+
+static int
+layer_resize(struct layer *layer, int width, int height)
+{
+   if (!layer->fbo) {
+      glGenFramebuffers(1, &layer->fbo);
+      glGenTextures(1, &layer->texture);
+      glGenBuffers(1, &layer->quad);
+   }
+
+   glBindTexture(GL_TEXTURE_2D, layer->texture);
+   glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA,
+                GL_UNSIGNED_BYTE, NULL);
+   /* Window sized, so rarely a power of two */
+   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+   glBindTexture(GL_TEXTURE_2D, 0);
+
+   glBindFramebuffer(GL_FRAMEBUFFER, layer->fbo);
+   glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+                          layer->texture, 0);
+   if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+      glBindFramebuffer(GL_FRAMEBUFFER, layer->target);
+      return 0;
+   }
+
+   layer->width = width;
+   layer->height = height;
+
+   return 1;
+}
+
+/*
+ * Direct drawing into the layer, reallocating it if the size changed.
+ * Returns 0, with drawing still going to the window, if the layer
+ * can't be used.
+ */
+int
+layer_begin(struct layer *layer, int width, int height)
+{
+   glGetIntegerv(GL_FRAMEBUFFER_BINDING, &layer->target);
+
+   if (layer->width != width || layer->height != height || !layer->fbo) {
+      if (!layer_resize(layer, width, height))
+         return 0;
+   } else {
+      glBindFramebuffer(GL_FRAMEBUFFER, layer->fbo);
+   }
+
+   glViewport(0, 0, width, height);
+
+   return 1;
+}
+
+void
+layer_end(struct layer *layer)
+{
+   glBindFramebuffer(GL_FRAMEBUFFER, layer->target);
+   layer->valid = 1;
+   layer->renders++;
+}
+
+void
+layer_invalidate(struct layer *layer)
+{
+   layer->valid = 0;
+}
+
+/*
+ * Cover the window with the layer.  The caller's transform maps
+ * window pixels, y down, to clip space, as it did while the layer was
+ * drawn, so the quad's texture is flipped back to match.
+ */
+void
+layer_composite(struct layer *layer, GLint attr_pos, GLint attr_texture)
+{
+   GLfloat quad[] = {
+      0,            0,             0, 1,
+      layer->width, 0,             1, 1,
+      0,            layer->height, 0, 0,
+      layer->width, layer->height, 1, 0,
+   };
+
+   glBindBuffer(GL_ARRAY_BUFFER, layer->quad);
+   glBufferData(GL_ARRAY_BUFFER, sizeof (quad), quad, GL_STREAM_DRAW);
+   glVertexAttribPointer(attr_pos, 2, GL_FLOAT, GL_FALSE, sizeof (GLfloat) * 4, 0);
+   glVertexAttribPointer(attr_texture, 2, GL_FLOAT, GL_FALSE, sizeof (GLfloat) * 4,
+                         (const GLvoid *) (sizeof (GLfloat) * 2));
+   glEnableVertexAttribArray(attr_pos);
+   glEnableVertexAttribArray(attr_texture);
+
+   glActiveTexture(GL_TEXTURE0);
+   glBindTexture(GL_TEXTURE_2D, layer->texture);
+   glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+   glBindTexture(GL_TEXTURE_2D, 0);
+
+   glDisableVertexAttribArray(attr_pos);
+   glDisableVertexAttribArray(attr_texture);
+   glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+   layer->composites++;
+}
+
+void
+layer_destroy(struct layer *layer)
+{
+   if (layer->fbo) {
+      glDeleteFramebuffers(1, &layer->fbo);
+      glDeleteTextures(1, &layer->texture);
+      glDeleteBuffers(1, &layer->quad);
+   }
+
+   memset(layer, 0, sizeof (*layer));
+}
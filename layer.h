@@ -0,0 +1,33 @@
+/**************************************************************************
+ *
+ * Copyright 2014 Scott Moreau <oreaus@gmail.com>
+ * All Rights Reserved.
+ *
+ **************************************************************************/
+
+#include <GLES2/gl2.h>
+
+/*
+ * An offscreen copy of whatever doesn't change between frames.  It is
+ * drawn into once and then put on screen with a single quad until it
+ * is invalidated, so still content costs one texture fetch per pixel
+ * instead of its geometry and overdraw.
+ */
+struct layer {
+   GLuint fbo, texture, quad;
+   GLint target;        /* framebuffer to go back to after drawing */
+   int width, height;
+   int valid;
+   unsigned int renders, composites;
+};
+
+int
+layer_begin(struct layer *layer, int width, int height);
+void
+layer_end(struct layer *layer);
+void
+layer_invalidate(struct layer *layer);
+void
+layer_composite(struct layer *layer, GLint attr_pos, GLint attr_texture);
+void
+layer_destroy(struct layer *layer);
@@ -13,19 +13,64 @@
  */
 
 #include <assert.h>
+#include <errno.h>
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <time.h>
 #include <sys/time.h>
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/keysym.h>
 #include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <GLES2/gl2.h>
+#include <GLES2/gl2ext.h>
 
 #include "wobbly.h"
 #include "image-loader.h"
+#include "texture-stream.h"
+#include "program-cache.h"
+#include "alloc-count.h"
+#include "perf-counters.h"
+#include "trace.h"
+#include "latency.h"
+#include "predict.h"
+#include "triple-buffer.h"
+#include "governor.h"
+#include "layer.h"
+#include "worker-pool.h"
+#include "tessellate.h"
+#include "gpu-physics.h"
+#include "mesh-export.h"
+
+/* Interleaved x, y, u, v */
+#define VERTEX_STRIDE (sizeof (GLfloat) * 4)
+
+#define PIPELINE_MAX_DEPTH 4
+
+/*
+ * With a pipeline depth above 1 the vertex buffers form a ring: the
+ * next frame is written into the following slot while the GPU may
+ * still be reading the current one, and a slot is only reused once
+ * the fence placed after the frame that drew from it has signaled.
+ */
+struct mesh_buffers {
+   GLfloat *vertices;
+   GLushort *indices;
+   int vert_capacity, index_capacity;
+   int index_x_cells, index_y_cells;
+   int triangles;    /* in the index buffer, for the prepared frame */
+   GLuint ibo, cursor_vbo;
+   GLuint vbo[PIPELINE_MAX_DEPTH];
+   int vbo_capacity[PIPELINE_MAX_DEPTH];
+   EGLSyncKHR fence[PIPELINE_MAX_DEPTH];
+   int depth, slot;
+   int prepared;     /* slot holds a frame that hasn't been drawn */
+   int culled;       /* the prepared frame has nothing on screen */
+};
 
 struct shared_context {
    Display *x_dpy;
@@ -35,11 +80,203 @@ struct shared_context {
    struct window window;
    struct surface surface;
    struct timeval t1;
+   struct texture_stream *stream;
+   int stream_width, stream_height, stream_format;   /* level 0 as last specified */
+   struct mesh_buffers mesh;
+   struct input_tag next_input;     /* input carried by the prepared frame */
+   int next_has_input;
+   double next_prepare_ms;
+   struct input_tag frame_input;    /* oldest input shown by this frame */
+   int frame_has_input;
+   double frame_prepare_ms;
 };
 
 static int last_x = 0, last_y = 0, redraw = 0, running = 1, render_mode = 0, pointer[2];
 static GLint u_matrix = -1;
 static GLint attr_pos = 0, attr_texture = 1;
+static struct perf_counters *perf;
+static long long model_steps, vertices_generated;
+/* Holds the one surface, so it snaps to the window edges */
+static struct wobbly_scene *scene;
+/* With -budget, trades detail for keeping draw() within budget */
+static struct frame_governor governor;
+static struct governed_surface governed;
+static int governing;
+/* With -adaptive, tessellate only as finely as this many pixels need */
+static float adaptive_tolerance;
+
+/*
+ * With -cache-layers, a surface at rest is drawn once into an
+ * offscreen layer, which stands in for it until something it was drawn
+ * from changes.
+ */
+struct layer_key {
+   int x, y, width, height, x_cells, y_cells;
+   int render_mode, window_width, window_height;
+   GLuint texture;
+};
+
+static struct layer layer;
+static struct layer_key layer_key;
+static int cache_layers;
+
+/* Vertices transformed per triangle of the grid's index order */
+static float index_acmr;
+
+/* Frames the surface was off screen, and the area it would have had */
+static unsigned int frames_culled;
+static double pixels_culled;
+
+/* Drawn nearest first, so the depth test rejects what lies beneath */
+#define CURSOR_DEPTH -0.5f
+#define SURFACE_DEPTH 0.0f
+#define CROWD_DEPTH 0.25f
+
+/*
+ * With -gpu-physics, a crowd of surfaces behind the one that can be
+ * dragged, stepped and drawn entirely on the GPU.  A few of them are
+ * pulled somewhere else every frame to keep the crowd moving.
+ */
+#define CROWD_CELLS 8
+#define CROWD_PULL 20
+
+static struct gpu_physics *crowd;
+static int crowd_size, crowd_next;
+static int *crowd_pulls;      /* x, y of each anchor from where it was added */
+static double crowd_ms;
+static long long crowd_steps;
+
+/* With -export-mesh, every step is published for other processes */
+static struct mesh_export *exporter;
+static unsigned int frames_exported;
+
+/*
+ * Motion that moved the anchor but hasn't been picked up by a frame
+ * yet.  Only the oldest event is kept, so a frame is charged with the
+ * longest wait of all the motion it coalesces.
+ */
+static pthread_mutex_t input_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct input_tag pending_input;
+static int input_pending;
+/* Smallest receive time minus X timestamp seen, i.e. the fastest delivery */
+static double server_offset_ms;
+static int server_offset_valid;
+static struct latency_histogram motion_latency, server_latency;
+
+/*
+ * A mesh from the physics thread, interleaved like the vertex buffer
+ * so it uploads as is.  Three of them circulate through physics_mesh.
+ */
+struct mesh_frame {
+   GLfloat *vertices;
+   int capacity, num_pts;
+   int x_cells, y_cells;
+   int culled;
+   struct input_tag input;
+   int has_input;
+   double prepare_ms;
+};
+
+static struct mesh_frame physics_frames[3];
+static struct triple_buffer physics_mesh;
+static double physics_hz;     /* 0 runs physics in the render thread */
+static int physics_running;
+static pthread_t physics_thread_id;
+static unsigned int physics_published, physics_drawn;
+
+/* With -tess-threads, dense grids are tessellated a slice per thread */
+static struct worker_pool *tess_pool;
+
+/*
+ * Pointer prediction, also under input_mutex.  The anchor is kept
+ * predict_dx/dy pixels ahead of the real pointer; the render thread
+ * moves it each frame toward where the pointer should be when the
+ * frame is presented, render_ms from now.
+ */
+static struct pointer_predictor predictor;
+static int predict_enabled, predict_dx, predict_dy;
+static double render_ms = 16.0;
+static FILE *motion_log;
+static PFNGLMAPBUFFEROESPROC map_buffer;
+static PFNGLUNMAPBUFFEROESPROC unmap_buffer;
+static PFNEGLCREATESYNCKHRPROC create_sync;
+static PFNEGLCLIENTWAITSYNCKHRPROC client_wait_sync;
+static PFNEGLDESTROYSYNCKHRPROC destroy_sync;
+static unsigned int fence_stalls;
+static double fence_stall_ms;
+
+
+/*
+ * Startup timeline.  Each stage is written by exactly one thread and
+ * only read after that thread has been joined, so no locking is needed.
+ */
+enum startup_stage_id {
+   STAGE_DISPLAY,
+   STAGE_WINDOW,
+   STAGE_SHADERS,
+   STAGE_TEXTURE_DECODE,
+   STAGE_MODEL,
+   STAGE_TEXTURE_UPLOAD,
+   STAGE_FIRST_FRAME,
+   STAGE_COUNT
+};
+
+static struct startup_stage {
+   const char *name;
+   const char *thread;
+   double begin, end;
+} startup[STAGE_COUNT] = {
+   [STAGE_DISPLAY]        = { "X display + EGL init", "main" },
+   [STAGE_WINDOW]         = { "window + context",     "main" },
+   [STAGE_SHADERS]        = { "shader program",       "main" },
+   [STAGE_TEXTURE_DECODE] = { "texture decode",       "texture" },
+   [STAGE_MODEL]          = { "wobbly model",         "model" },
+   [STAGE_TEXTURE_UPLOAD] = { "texture upload",       "main" },
+   [STAGE_FIRST_FRAME]    = { "first frame + swap",   "main" },
+};
+
+static struct timeval startup_t0;
+
+static double
+startup_ms(void)
+{
+   struct timeval t;
+
+   gettimeofday(&t, NULL);
+
+   return (t.tv_sec - startup_t0.tv_sec) * 1000.0 +
+          (t.tv_usec - startup_t0.tv_usec) / 1000.0;
+}
+
+static void
+stage_begin(enum startup_stage_id id)
+{
+   startup[id].begin = startup_ms();
+}
+
+static void
+stage_end(enum startup_stage_id id)
+{
+   startup[id].end = startup_ms();
+}
+
+static void
+print_startup_timeline(void)
+{
+   double total = 0.0;
+   int i;
+
+   printf("startup timeline (ms):\n");
+   for (i = 0; i < STAGE_COUNT; i++) {
+      printf("  %-22s %-8s %8.2f - %8.2f  (%.2f)\n",
+             startup[i].name, startup[i].thread,
+             startup[i].begin, startup[i].end,
+             startup[i].end - startup[i].begin);
+      total += startup[i].end - startup[i].begin;
+   }
+   printf("  first swap at %.2f ms, stages sum to %.2f ms\n",
+          startup[STAGE_FIRST_FRAME].end, total);
+}
 
 
 static void
@@ -98,23 +335,337 @@ mul_matrix(GLfloat *prod, const GLfloat *a, const GLfloat *b)
 #undef PROD
 }
 
+static GLenum
+texture_format(int format)
+{
+   switch (format) {
+      case IMAGE_FORMAT_LUMINANCE:
+         return GL_LUMINANCE;
+      case IMAGE_FORMAT_LUMINANCE_ALPHA:
+         return GL_LUMINANCE_ALPHA;
+      case IMAGE_FORMAT_RGBA:
+         return GL_RGBA;
+      case IMAGE_FORMAT_RGB:
+      default:
+         return GL_RGB;
+   }
+}
+
+/* Largest unpack alignment that evenly divides a tightly packed row */
+static GLint
+texture_unpack_alignment(int width, int format)
+{
+   int row_bytes = width * format;
+
+   if (!(row_bytes & 7))
+      return 8;
+   if (!(row_bytes & 3))
+      return 4;
+   if (!(row_bytes & 1))
+      return 2;
+   return 1;
+}
+
+/*
+ * Upload the newest decoded frame of a texture stream into the bound
+ * texture.  Same-sized frames only replace the pixels; the storage is
+ * redefined on the first frame and when the frame size or format
+ * changes.  The texture as created may have been resampled or carry
+ * mipmaps of the still image, so the stream doesn't trust its size
+ * and samples level 0 only.
+ */
+static void
+update_stream_texture(struct shared_context *context)
+{
+   struct texture_frame *frame;
+
+   frame = texture_stream_acquire(context->stream);
+   if (!frame)
+      return;
+
+   glPixelStorei(GL_UNPACK_ALIGNMENT,
+                 texture_unpack_alignment(frame->width, frame->format));
+
+   if (frame->width != context->stream_width ||
+       frame->height != context->stream_height ||
+       frame->format != context->stream_format) {
+      context->stream_width = frame->width;
+      context->stream_height = frame->height;
+      context->stream_format = frame->format;
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+      glTexImage2D(GL_TEXTURE_2D, 0, texture_format(frame->format),
+                   frame->width, frame->height, 0,
+                   texture_format(frame->format), GL_UNSIGNED_BYTE, frame->data);
+   } else {
+      glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, frame->width, frame->height,
+                      texture_format(frame->format), GL_UNSIGNED_BYTE, frame->data);
+   }
+}
+
+/* Room for num_pts vertices in the client-side copy */
+static int
+ensure_client_vertices(struct mesh_buffers *mesh, int num_pts)
+{
+   GLfloat *vertices;
+
+   if (num_pts <= mesh->vert_capacity)
+      return 1;
+
+   vertices = realloc(mesh->vertices, VERTEX_STRIDE * num_pts);
+   if (!vertices)
+      return 0;
+   mesh->vertices = vertices;
+   mesh->vert_capacity = num_pts;
+
+   return 1;
+}
+
+/*
+ * Scratch memory and GL buffers reused from frame to frame.  They only
+ * grow, when the cell counts go up, so a steady-state frame makes no
+ * heap allocations and creates no GL objects.
+ */
+static int
+ensure_mesh_buffers(struct mesh_buffers *mesh, int num_pts, int num_indices)
+{
+   /* With GL_OES_mapbuffer vertices go straight into the buffer
+    * object and no client-side copy is needed */
+   if (!map_buffer && !ensure_client_vertices(mesh, num_pts))
+      return 0;
+
+   if (num_indices > mesh->index_capacity) {
+      GLushort *indices;
+
+      indices = realloc(mesh->indices, sizeof (GLushort) * num_indices);
+      if (!indices)
+         return 0;
+      mesh->indices = indices;
+      mesh->index_capacity = num_indices;
+   }
+
+   if (!mesh->ibo) {
+      glGenBuffers(mesh->depth, mesh->vbo);
+      glGenBuffers(1, &mesh->ibo);
+      glGenBuffers(1, &mesh->cursor_vbo);
+   }
+
+   return 1;
+}
+
+static void
+destroy_mesh_buffers(struct shared_context *context)
+{
+   struct mesh_buffers *mesh = &context->mesh;
+   int i;
+
+   for (i = 0; i < PIPELINE_MAX_DEPTH; i++)
+      if (mesh->fence[i])
+         destroy_sync(context->egl_dpy, mesh->fence[i]);
+
+   if (mesh->ibo) {
+      glDeleteBuffers(mesh->depth, mesh->vbo);
+      glDeleteBuffers(1, &mesh->ibo);
+      glDeleteBuffers(1, &mesh->cursor_vbo);
+   }
+
+   free(mesh->vertices);
+   free(mesh->indices);
+   memset(mesh, 0, sizeof (*mesh));
+}
+
+/* Block until the GPU is done with the frame last drawn from a slot */
 static void
-draw_elements(struct shared_context *context)
+wait_for_slot(struct shared_context *context, int slot)
 {
-   GLuint VBO, indexBuffer, textureID, textureUV;
-   GLfloat mat[16], trans[16], scale[16], y_flip[16], cursor[2], *verts, *uv, cell_w, cell_h, w, h;
-   GLushort *indices, x_pts, y_pts, num_pts;
-   struct window *window;
+   struct mesh_buffers *mesh = &context->mesh;
+   double start;
+
+   if (!mesh->fence[slot])
+      return;
+
+   if (client_wait_sync(context->egl_dpy, mesh->fence[slot],
+                        EGL_SYNC_FLUSH_COMMANDS_BIT_KHR, 0) == EGL_TIMEOUT_EXPIRED_KHR) {
+      trace_begin("fence wait");
+      start = latency_now_ms();
+      client_wait_sync(context->egl_dpy, mesh->fence[slot],
+                       EGL_SYNC_FLUSH_COMMANDS_BIT_KHR, EGL_FOREVER_KHR);
+      fence_stall_ms += latency_now_ms() - start;
+      fence_stalls++;
+      trace_end("fence wait");
+   }
+
+   destroy_sync(context->egl_dpy, mesh->fence[slot]);
+   mesh->fence[slot] = NULL;
+}
+
+/* Compute indices, only when the grid changed */
+static void
+update_indices(struct mesh_buffers *mesh, int x_cells, int y_cells)
+{
+   struct surface grid;
+
+   mesh->triangles = x_cells * y_cells * 2;
+   if (x_cells == mesh->index_x_cells && y_cells == mesh->index_y_cells)
+      return;
+
+   /* The grid may be one the physics thread tessellated, not the
+    * surface's current one */
+   memset(&grid, 0, sizeof (grid));
+   grid.x_cells = x_cells;
+   grid.y_cells = y_cells;
+
+   perf_stage_begin(perf, PERF_STAGE_INDICES);
+   trace_begin("indices");
+   wobbly_write_indices(&grid, mesh->indices, mesh->index_capacity);
+   trace_end("indices");
+   perf_stage_end(perf, PERF_STAGE_INDICES);
+
+   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->ibo);
+   glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof (GLushort) * x_cells * y_cells * 6,
+                mesh->indices, GL_STATIC_DRAW);
+
+   mesh->index_x_cells = x_cells;
+   mesh->index_y_cells = y_cells;
+   index_acmr = wobbly_index_acmr(mesh->indices, x_cells * y_cells * 6,
+                                  WOBBLY_VERTEX_CACHE);
+}
+
+/*
+ * Adaptive meshes bring their own indices every frame.  Respecifying
+ * the buffer lets frames still in flight keep the old ones.
+ */
+static void
+adaptive_upload_indices(struct mesh_buffers *mesh, int count)
+{
+   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->ibo);
+   glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof (GLushort) * count,
+                mesh->indices, GL_STREAM_DRAW);
+   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+   mesh->triangles = count / 3;
+   /* The uniform grid's indices are gone */
+   mesh->index_x_cells = mesh->index_y_cells = 0;
+}
+
+/*
+ * Whether any of the surface can land in a width by height window.
+ * A surface that can't is neither tessellated nor drawn.
+ */
+static int
+surface_visible(struct surface *surface, int width, int height)
+{
+   float x1, y1, x2, y2;
+
+   wobbly_bounds(surface, &x1, &y1, &x2, &y2);
+   if (x2 >= 0 && y2 >= 0 && x1 <= width && y1 <= height)
+      return 1;
+
+   frames_culled++;
+   pixels_culled += (x2 - x1) * (y2 - y1);
+
+   return 0;
+}
+
+/* Tessellate the surface into the next vertex buffer slot */
+static void
+prepare_mesh(struct shared_context *context)
+{
+   GLfloat *vertices;
+   int x_pts, y_pts, num_pts;
+   struct wobbly_mesh_layout layout;
+   struct mesh_buffers *mesh;
    struct surface *surface;
-   int x_cells, y_cells, i, x, y;
+   int x_cells, y_cells, slot, max_pts, max_indices, count, mapped;
 
-   window = &context->window;
    surface = &context->surface;
+   mesh = &context->mesh;
 
-   /* Viewport needs to be set in our rendering thread */
-   glViewport(0, 0, window->width, window->height);
+   /* Variable assignment */
+   x_cells = surface->x_cells;
+   y_cells = surface->y_cells;
+
+   x_pts = x_cells + 1;
+   y_pts = y_cells + 1;
+   num_pts = x_pts * y_pts;
+
+   mesh->culled = !surface_visible(surface, context->window.width,
+                                   context->window.height);
+   if (mesh->culled) {
+      mesh->prepared = 1;
+      return;
+   }
+
+   if (adaptive_tolerance > 0) {
+      /* Vertices and indices change every frame; room for the most */
+      wobbly_adaptive_bounds(surface, &max_pts, &max_indices);
+      num_pts = max_pts;
+      if (!ensure_mesh_buffers(mesh, num_pts, max_indices))
+         return;
+   } else {
+      if (!ensure_mesh_buffers(mesh, num_pts, x_cells * y_cells * 6))
+         return;
+
+      update_indices(mesh, x_cells, y_cells);
+   }
+
+   slot = mesh->slot = (mesh->slot + 1) % mesh->depth;
+   wait_for_slot(context, slot);
+
+   /* Let the wobbly core write positions and texture coordinates
+    * directly into the vertex buffer.  Without a ring the storage is
+    * orphaned every frame so the driver can hand out fresh memory;
+    * in a ring the fence already guarantees the slot is idle. */
+   glBindBuffer(GL_ARRAY_BUFFER, mesh->vbo[slot]);
+   if (mesh->depth == 1 || num_pts > mesh->vbo_capacity[slot]) {
+      glBufferData(GL_ARRAY_BUFFER, VERTEX_STRIDE * num_pts, NULL, GL_STREAM_DRAW);
+      mesh->vbo_capacity[slot] = num_pts;
+   }
+   vertices = map_buffer ? map_buffer(GL_ARRAY_BUFFER, GL_WRITE_ONLY_OES) : NULL;
+   mapped = vertices != NULL;
+
+   /* Without a mapping, write a client-side copy and upload that */
+   if (!mapped && ensure_client_vertices(mesh, num_pts))
+      vertices = mesh->vertices;
+
+   if (vertices) {
+      layout.position = vertices;
+      layout.position_stride = VERTEX_STRIDE;
+      layout.texcoord = vertices + 2;
+      layout.texcoord_stride = VERTEX_STRIDE;
+      perf_stage_begin(perf, PERF_STAGE_TESSELLATION);
+      trace_begin("tessellation");
+      if (adaptive_tolerance > 0) {
+         num_pts = wobbly_write_adaptive(surface, &layout, num_pts, mesh->indices,
+                                         mesh->index_capacity, adaptive_tolerance,
+                                         &count);
+         if (num_pts)
+            adaptive_upload_indices(mesh, count);
+         else
+            mesh->triangles = 0;
+      } else {
+         tessellate_parallel(tess_pool, surface, &layout, num_pts);
+      }
+      vertices_generated += num_pts;
+      trace_end("tessellation");
+      perf_stage_end(perf, PERF_STAGE_TESSELLATION);
+      trace_counter("vertices generated", vertices_generated);
+   }
+
+   if (mapped)
+      unmap_buffer(GL_ARRAY_BUFFER);
+   else if (vertices)
+      glBufferSubData(GL_ARRAY_BUFFER, 0, VERTEX_STRIDE * num_pts, vertices);
+
+   glBindBuffer(GL_ARRAY_BUFFER, 0);
+   mesh->prepared = 1;
+}
+
+/* Transform for drawing in window pixels, y down, at the given depth */
+static void
+make_window_matrix(struct window *window, GLfloat depth, GLfloat *mat)
+{
+   GLfloat trans[16], scale[16], y_flip[16];
 
-   /* Set modelview/projection matrix */
    make_identity_matrix(mat);
    make_identity_matrix(y_flip);
    y_flip[5] = -1;
@@ -123,189 +674,978 @@ draw_elements(struct shared_context *context)
    mul_matrix(mat, mat, y_flip);
    mul_matrix(mat, mat, trans);
    mul_matrix(mat, mat, scale);
+   mat[14] = depth;
+}
+
+static void
+set_window_transform(struct window *window, GLfloat depth)
+{
+   GLfloat mat[16];
+
+   make_window_matrix(window, depth, mat);
    glUniformMatrix4fv(u_matrix, 1, GL_FALSE, mat);
+}
 
-   /* Variable assignment */
-   w = surface->width;
-   h = surface->height;
+/* Draw the surface from the prepared vertex buffer slot */
+static void
+draw_surface(struct shared_context *context)
+{
+   struct mesh_buffers *mesh;
+   struct surface *surface;
+   int i;
 
-   x_cells = surface->x_cells;
-   y_cells = surface->y_cells;
+   surface = &context->surface;
+   mesh = &context->mesh;
 
-   cell_w = w / x_cells;
-   cell_h = h / y_cells;
+   if (mesh->culled)
+      return;
 
-   x_pts = x_cells + 1;
-   y_pts = y_cells + 1;
-   num_pts = x_pts * y_pts;
+   set_window_transform(&context->window, SURFACE_DEPTH);
+
+   /* Setup buffers */
+   glEnableVertexAttribArray(attr_pos);
+   glEnableVertexAttribArray(attr_texture);
+
+   glBindBuffer(GL_ARRAY_BUFFER, mesh->vbo[mesh->slot]);
+   glVertexAttribPointer(attr_pos, 2, GL_FLOAT, GL_FALSE, VERTEX_STRIDE, 0);
+   glVertexAttribPointer(attr_texture, 2, GL_FLOAT, GL_FALSE, VERTEX_STRIDE,
+                         (const GLvoid *) (sizeof (GLfloat) * 2));
+
+   glActiveTexture(GL_TEXTURE0);
+   glBindTexture(GL_TEXTURE_2D, surface->tex.id);
+   if (context->stream) {
+      perf_stage_begin(perf, PERF_STAGE_UPLOAD);
+      trace_begin("stream upload");
+      update_stream_texture(context);
+      trace_end("stream upload");
+      perf_stage_end(perf, PERF_STAGE_UPLOAD);
+   }
+
+   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->ibo);
+
+   /* Draw surface.  Outlines need a loop per triangle; otherwise one
+    * call keeps the index order, and with it the vertex cache, intact */
+   switch (render_mode) {
+      case 0:
+         glDrawElements(GL_TRIANGLES, mesh->triangles * 3, GL_UNSIGNED_SHORT, 0);
+         break;
+      case 1:
+         for (i = 0; i < mesh->triangles; i++)
+            glDrawElements(GL_LINE_LOOP, 3, GL_UNSIGNED_SHORT,
+                           (const GLvoid*) (i * 3 * sizeof(GLushort)));
+         break;
+      case 2:
+         glDrawElements(GL_POINTS, mesh->triangles * 3, GL_UNSIGNED_SHORT, 0);
+         break;
+      default:
+         break;
+   }
+
+   /* Clean up */
+   glBindBuffer(GL_ARRAY_BUFFER, 0);
+   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+   glBindTexture(GL_TEXTURE_2D, 0);
+
+   glDisableVertexAttribArray(attr_pos);
+   glDisableVertexAttribArray(attr_texture);
+}
+
+/* Draw point at cursor hotspot */
+static void
+draw_cursor(struct shared_context *context)
+{
+   GLfloat cursor[2];
+
+   cursor[0] = ((float) (pointer[0]));
+   cursor[1] = ((float) (pointer[1]));
+
+   set_window_transform(&context->window, CURSOR_DEPTH);
+
+   glEnableVertexAttribArray(attr_pos);
+   glBindBuffer(GL_ARRAY_BUFFER, context->mesh.cursor_vbo);
+   glBufferData(GL_ARRAY_BUFFER, sizeof (GLfloat) * 2, cursor, GL_STREAM_DRAW);
+   glVertexAttribPointer(attr_pos, 2, GL_FLOAT, GL_FALSE, 0, 0);
 
-   /* Memory allocation */
-   if (surface->synced) {
-      verts = malloc(sizeof (GLfloat) * num_pts * 2);
-      if (!verts)
+   glDrawArrays(GL_POINTS, 0, 1);
+
+   glBindBuffer(GL_ARRAY_BUFFER, 0);
+   glDisableVertexAttribArray(attr_pos);
+}
+
+/* Catch the crowd up with the time since the last frame, pulling a few */
+static void
+step_crowd(void)
+{
+   double now = latency_now_ms();
+   int i, m, x, y;
+
+   for (i = 0; i < crowd_size / 64 + 1; i++) {
+      m = crowd_next;
+      crowd_next = (crowd_next + 1) % crowd_size;
+
+      x = rand() % (2 * CROWD_PULL + 1) - CROWD_PULL;
+      y = rand() % (2 * CROWD_PULL + 1) - CROWD_PULL;
+      gpu_physics_move(crowd, m, x - crowd_pulls[2 * m], y - crowd_pulls[2 * m + 1]);
+      crowd_pulls[2 * m] = x;
+      crowd_pulls[2 * m + 1] = y;
+   }
+
+   trace_begin("gpu physics");
+   crowd_steps += gpu_physics_advance(crowd, now - crowd_ms);
+   trace_end("gpu physics");
+   crowd_ms = now;
+}
+
+static void
+draw_crowd(struct shared_context *context)
+{
+   GLfloat mat[16];
+
+   make_window_matrix(&context->window, CROWD_DEPTH, mat);
+   gpu_physics_draw(crowd, mat, context->surface.tex.id, CROWD_CELLS);
+}
+
+/* Lay n surfaces out in a grid filling the window */
+static int
+create_crowd(int n, int width, int height)
+{
+   int i, columns, rows, cw, ch;
+
+   crowd = gpu_physics_create(n);
+   crowd_pulls = calloc(n, sizeof (int) * 2);
+   if (!crowd || !crowd_pulls) {
+      printf("Warning: float textures unavailable, no gpu physics\n");
+      gpu_physics_destroy(crowd);
+      crowd = NULL;
+      return 0;
+   }
+
+   columns = ceil(sqrt((double) n * width / height));
+   rows = (n + columns - 1) / columns;
+   cw = width / columns;
+   ch = height / rows;
+
+   for (i = 0; i < n; i++)
+      gpu_physics_add(crowd, (i % columns) * cw + cw / 5, (i / columns) * ch + ch / 5,
+                      cw * 3 / 5, ch * 3 / 5);
+
+   crowd_size = n;
+   crowd_ms = latency_now_ms();
+
+   return 1;
+}
+
+/*
+ * Drag a surface around and let it go, once with the wobbly core and
+ * once on the GPU, and compare their control points after every frame.
+ */
+static int
+check_gpu_physics(void)
+{
+   struct gpu_physics *gp;
+   struct surface surface;
+   GLfloat cpu[WOBBLY_GRID_SIZE * WOBBLY_GRID_SIZE * 2];
+   GLfloat gpu[WOBBLY_GRID_SIZE * WOBBLY_GRID_SIZE * 2];
+   float error, max_error = 0;
+   int frame, steps, total = 0, i;
+
+   gp = gpu_physics_create(1);
+   if (!gp) {
+      printf("gpu physics: float textures unavailable\n");
+      return 0;
+   }
+
+   memset(&surface, 0, sizeof (surface));
+   surface.x = 100;
+   surface.y = 100;
+   surface.width = 400;
+   surface.height = 200;
+   surface.x_cells = surface.y_cells = 8;
+   if (!wobbly_init(&surface)) {
+      gpu_physics_destroy(gp);
+      return 0;
+   }
+   gpu_physics_add(gp, surface.x, surface.y, surface.width, surface.height);
+
+   wobbly_grab_notify(&surface, 130, 120);
+   gpu_physics_grab(gp, 0, 130, 120);
+
+   /* Drag for a second, then let go and settle for three */
+   for (frame = 0; frame < 250; frame++) {
+      if (frame < 60) {
+         wobbly_move_notify(&surface, 7, frame % 7 - 3);
+         gpu_physics_move(gp, 0, 7, frame % 7 - 3);
+      } else if (frame == 60) {
+         wobbly_ungrab_notify(&surface);
+         gpu_physics_ungrab(gp, 0);
+      }
+
+      steps = wobbly_prepare_paint(&surface, 16);
+      wobbly_done_paint(&surface);
+      gpu_physics_step(gp, steps);
+      total += steps;
+
+      wobbly_control_points(&surface, cpu);
+      gpu_physics_read(gp, 0, gpu);
+      for (i = 0; i < WOBBLY_GRID_SIZE * WOBBLY_GRID_SIZE * 2; i++) {
+         error = fabsf(cpu[i] - gpu[i]);
+         if (error > max_error)
+            max_error = error;
+      }
+   }
+
+   printf("gpu physics: %d frames, %d steps, control points within %.5f px of the cpu\n",
+          frame, total, max_error);
+
+   wobbly_fini(&surface);
+   gpu_physics_destroy(gp);
+
+   return max_error < 0.01f;
+}
+
+/* The prepared frame has been drawn; fence its slot and retire it */
+static void
+retire_mesh(struct shared_context *context)
+{
+   struct mesh_buffers *mesh = &context->mesh;
+
+   /* A culled frame never took a slot */
+   if (mesh->depth > 1 && !mesh->culled)
+      mesh->fence[mesh->slot] = create_sync(context->egl_dpy, EGL_SYNC_FENCE_KHR, NULL);
+   mesh->prepared = 0;
+
+   context->frame_has_input = context->next_has_input;
+   context->frame_input = context->next_input;
+   context->frame_prepare_ms = context->next_prepare_ms;
+}
+
+/* Draw the prepared frame and fence the slot it was drawn from */
+static void
+submit_mesh(struct shared_context *context)
+{
+   /* Viewport needs to be set in our rendering thread */
+   glViewport(0, 0, context->window.width, context->window.height);
+
+   /* Clear buffers */
+   trace_begin("submit");
+   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+   /* Front to back */
+   draw_cursor(context);
+   draw_surface(context);
+   if (crowd)
+      draw_crowd(context);
+   trace_end("submit");
+
+   retire_mesh(context);
+}
+
+static int
+is_power_of_two(int n)
+{
+   return n > 0 && !(n & (n - 1));
+}
+
+static int
+next_power_of_two(int n, int max)
+{
+   int p = 1;
+
+   while (p < n && p < max)
+      p <<= 1;
+
+   return p;
+}
+
+static int
+mip_levels(int width, int height)
+{
+   int levels = 1;
+
+   while (width > 1 || height > 1) {
+      width = width > 1 ? width >> 1 : 1;
+      height = height > 1 ? height >> 1 : 1;
+      levels++;
+   }
+
+   return levels;
+}
+
+/* Upload every level stored in an ETC1 container.  Compressed
+ * textures can't use glGenerateMipmap, so trilinear filtering is
+ * only enabled when the container carries a complete chain. */
+static void
+create_compressed_texture(struct surface *surface)
+{
+   unsigned char *level = surface->tex.data;
+   int i, width, height, size;
+
+   for (i = 0; i < surface->tex.levels; i++) {
+      width = surface->tex.width >> i ? surface->tex.width >> i : 1;
+      height = surface->tex.height >> i ? surface->tex.height >> i : 1;
+      size = etc1DataSize(width, height);
+      glCompressedTexImage2D(GL_TEXTURE_2D, i, GL_ETC1_RGB8_OES,
+                             width, height, 0, size, level);
+      level += size;
+   }
+
+   if (surface->tex.levels == mip_levels(surface->tex.width, surface->tex.height))
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+   else
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+}
+
+/*
+ * Compress a png to a KTX file holding a full ETC1 mip chain.
+ * This runs offline, before any display connection is made.
+ */
+static int
+encode_etc1(char *texFile, char *outFile)
+{
+   unsigned char *levels, *level;
+   void *image, *scaled, *block;
+   int width, height, format, pot_w, pot_h, count, size, i, w, h;
+
+   if (!loadPngImage(texFile, &width, &height, &format, &image)) {
+      printf("Error: couldn't load %s\n", texFile);
+      return 0;
+   }
+
+   pot_w = next_power_of_two(width, 1 << 14);
+   pot_h = next_power_of_two(height, 1 << 14);
+   count = mip_levels(pot_w, pot_h);
+
+   for (i = 0, size = 0; i < count; i++)
+      size += etc1DataSize(pot_w >> i ? pot_w >> i : 1, pot_h >> i ? pot_h >> i : 1);
+
+   levels = malloc(size);
+   if (!levels) {
+      free(image);
+      return 0;
+   }
+
+   for (i = 0, level = levels; i < count; i++) {
+      w = pot_w >> i ? pot_w >> i : 1;
+      h = pot_h >> i ? pot_h >> i : 1;
+
+      /* Each level is filtered from the source so errors don't compound */
+      if (!resampleImage(width, height, format, image, w, h, &scaled))
+         break;
+      if (!etc1EncodeImage(w, h, format, scaled, &block)) {
+         free(scaled);
+         break;
+      }
+      memcpy(level, block, etc1DataSize(w, h));
+      level += etc1DataSize(w, h);
+      free(block);
+      free(scaled);
+   }
+
+   if (i == count && saveKtxImage(outFile, pot_w, pot_h, count, levels)) {
+      printf("%s: %dx%d, %d levels, %d bytes (%d uncompressed)\n",
+             outFile, pot_w, pot_h, count, size, width * height * 3);
+   } else {
+      printf("Error: couldn't encode %s\n", outFile);
+      i = -1;
+   }
+
+   free(levels);
+   free(image);
+
+   return i == count;
+}
+
+/*
+ * Upload the surface image once with a full mip chain.  GLES2 only
+ * allows mipmaps on power-of-two textures unless GL_OES_texture_npot
+ * is present, so other sizes are resampled up to the next power of two
+ * first.  The texture coordinates span 0..1 and are unaffected.
+ */
+static void
+create_texture(struct surface *surface)
+{
+   const char *extensions = (const char *) glGetString(GL_EXTENSIONS);
+   GLint max_size;
+   void *data;
+   int width, height, mipmap;
+
+   glGenTextures(1, &surface->tex.id);
+   glBindTexture(GL_TEXTURE_2D, surface->tex.id);
+
+   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+   if (!surface->tex.data) {
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+      glBindTexture(GL_TEXTURE_2D, 0);
+      return;
+   }
+
+   if (surface->tex.format == IMAGE_FORMAT_ETC1) {
+      if (extensions && strstr(extensions, "GL_OES_compressed_ETC1_RGB8_texture")) {
+         create_compressed_texture(surface);
+         glBindTexture(GL_TEXTURE_2D, 0);
          return;
-      
-      uv = malloc(sizeof (GLfloat) * num_pts * 2);
-      if (!uv)
+      }
+
+      /* No driver support, fall back to the uncompressed path */
+      if (!etc1DecodeImage(surface->tex.width, surface->tex.height,
+                           surface->tex.data, &data)) {
+         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+         glBindTexture(GL_TEXTURE_2D, 0);
          return;
+      }
+      free(surface->tex.data);
+      surface->tex.data = data;
+      surface->tex.format = IMAGE_FORMAT_RGB;
+      surface->tex.levels = 1;
+   }
 
-      /* Compute vertices and texture coordinates */
-      for (y = 0, i = 0; y < y_pts; y++) {
-         float y1 = y * cell_h;
-         for (x = 0; x < x_pts; x++) {
-            float x1 = x * cell_w;
-            *(verts + i++) = x1 + surface->x;
-            *(verts + i++) = y1 + surface->y;
-            *(uv + (i - 2)) = x1 / w;
-            *(uv + (i - 1)) = 1.0 - (y1 / h);
-         }
+   glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+
+   data = surface->tex.data;
+   width = surface->tex.width;
+   height = surface->tex.height;
+   mipmap = 1;
+
+   if ((!is_power_of_two(width) || !is_power_of_two(height) ||
+        width > max_size || height > max_size) &&
+       !(extensions && strstr(extensions, "GL_OES_texture_npot") &&
+         width <= max_size && height <= max_size)) {
+      width = next_power_of_two(width, max_size);
+      height = next_power_of_two(height, max_size);
+      if (!resampleImage(surface->tex.width, surface->tex.height,
+                         surface->tex.format, surface->tex.data,
+                         width, height, &data)) {
+         /* NPOT without mipmaps is still valid with clamped edges */
+         data = surface->tex.data;
+         width = surface->tex.width;
+         height = surface->tex.height;
+         mipmap = 0;
       }
+   }
+
+   glPixelStorei(GL_UNPACK_ALIGNMENT,
+                 texture_unpack_alignment(width, surface->tex.format));
+   glTexImage2D(GL_TEXTURE_2D, 0, texture_format(surface->tex.format),
+                width, height, 0, texture_format(surface->tex.format),
+                GL_UNSIGNED_BYTE, data);
+
+   if (mipmap) {
+      glGenerateMipmap(GL_TEXTURE_2D);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
    } else {
-      verts = uv = NULL;
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+   }
+
+   glBindTexture(GL_TEXTURE_2D, 0);
+
+   if (data != surface->tex.data)
+      free(data);
+}
+
+static int
+prepare_paint(struct surface *surface, int msSinceLastPaint)
+{
+   return wobbly_prepare_paint(surface, msSinceLastPaint);
+}
+
+static void
+done_paint(struct surface *surface)
+{
+   wobbly_done_paint(surface);
+}
+
+#ifdef DEBUG_ALLOC
+/*
+ * A warmed-up frame must not touch the heap.  The only allocations
+ * allowed are the ones that grow the reusable mesh buffers, which
+ * happens when the cell counts go up or the surface starts wobbling.
+ */
+static void
+check_frame_allocations(struct shared_context *context, unsigned long before,
+                        int capacities_before)
+{
+   unsigned long allocs = alloc_count() - before;
+   int capacities = context->surface.vertex_capacity +
+                    context->mesh.vert_capacity + context->mesh.index_capacity;
+
+   if (allocs && capacities == capacities_before) {
+      fprintf(stderr, "Error: %lu heap allocations in a steady-state frame\n",
+              allocs);
+      assert(allocs == 0);
+   }
+}
+#endif
+
+/* Called by event_loop once an event has moved the anchor */
+static void
+tag_input(unsigned long server_time, double receive_ms)
+{
+   double offset = receive_ms - server_time;
+
+   pthread_mutex_lock(&input_mutex);
+   if (!server_offset_valid || offset < server_offset_ms) {
+      server_offset_ms = offset;
+      server_offset_valid = 1;
+   }
+   if (!input_pending) {
+      pending_input.server_time = server_time;
+      pending_input.receive_ms = receive_ms;
+      input_pending = 1;
    }
+   pthread_mutex_unlock(&input_mutex);
+}
+
+/*
+ * Hand pending input to the frame whose physics step is about to run.
+ * The physics thread may produce meshes the render thread never
+ * draws, so it leaves the input pending until one is drawn.
+ */
+static void
+take_input(struct surface *surface, struct input_tag *tag, int *has_input,
+           int consume)
+{
+   double now = latency_now_ms(), dx = 0, dy = 0;
+
+   pthread_mutex_lock(&input_mutex);
+   *has_input = input_pending;
+   *tag = pending_input;
+   if (consume)
+      input_pending = 0;
+
+   /* Turning prediction off eases the anchor back onto the pointer */
+   if (surface->grabbed) {
+      if (predict_enabled)
+         predictor_update_offset(&predictor, now, now + render_ms, &dx, &dy);
+      else
+         predictor.offset_x = predictor.offset_y = 0;
+
+      if ((int) lround(dx) != predict_dx || (int) lround(dy) != predict_dy) {
+         wobbly_move_notify(surface, lround(dx) - predict_dx, lround(dy) - predict_dy);
+         predict_dx = lround(dx);
+         predict_dy = lround(dy);
+      }
+   }
+   pthread_mutex_unlock(&input_mutex);
+}
+
+/*
+ * Swap and charge the input the frame carries with the time it took
+ * to get on screen.  eglSwapBuffers returning is the closest we get
+ * to presentation.  The X timestamp is on the server's clock, so the
+ * server to photon time assumes the fastest delivery seen took 0 ms.
+ */
+static void
+swap_buffers(struct shared_context *context)
+{
+   double now, offset;
 
-   indices = malloc(sizeof (GLushort) * x_cells * y_cells * 6);
-   if (!indices)
+   trace_begin("swap");
+   eglSwapBuffers(context->egl_dpy, context->egl_surf);
+   trace_end("swap");
+
+   now = latency_now_ms();
+   render_ms += (now - context->frame_prepare_ms - render_ms) * 0.1;
+
+   if (!context->frame_has_input)
       return;
+   latency_record(&motion_latency, now - context->frame_input.receive_ms);
+   trace_counter("motion to photon us",
+                 (now - context->frame_input.receive_ms) * 1000);
+
+   pthread_mutex_lock(&input_mutex);
+   offset = server_offset_ms;
+   pthread_mutex_unlock(&input_mutex);
+   latency_record(&server_latency,
+                  now - (context->frame_input.server_time + offset));
+
+   context->frame_has_input = 0;
+}
+
+/* Physics and tessellation for the next frame to be drawn */
+static void
+prepare_frame(struct shared_context *context)
+{
+   struct timeval *t1, t2;
+   double elapsedTime;
+
+   t1 = &context->t1;
+   gettimeofday(&t2, NULL);
+
+   elapsedTime = (t2.tv_sec - t1->tv_sec) * 1000.0;      // sec to ms
+   elapsedTime += (t2.tv_usec - t1->tv_usec) / 1000.0;   // us to ms
+
+   trace_begin("prepare");
+
+   context->next_prepare_ms = latency_now_ms();
+   take_input(&context->surface, &context->next_input, &context->next_has_input, 1);
+
+   perf_stage_begin(perf, PERF_STAGE_PHYSICS);
+   trace_begin("physics");
+   pthread_mutex_lock(&input_mutex);
+   if (scene)
+      wobbly_scene_update(scene);
+   model_steps += prepare_paint(&context->surface, (int) elapsedTime);
+   if (exporter && mesh_export_publish(exporter, &context->surface))
+      frames_exported++;
+   pthread_mutex_unlock(&input_mutex);
+   trace_end("physics");
+   perf_stage_end(perf, PERF_STAGE_PHYSICS);
+   trace_counter("model steps", model_steps);
+
+   gettimeofday(t1, NULL);
 
-   /* Compute indices */
-   for (y = 0, i = 0; y < y_cells; y++)
-      for (x = 0; x < x_cells; x++) {
-         *(indices + i++) = y * x_pts + x;
-         *(indices + i++) = y * x_pts + x + 1;
-         *(indices + i++) = (y + 1) * x_pts + x;
+   prepare_mesh(context);
+
+   done_paint(&context->surface);
+
+   trace_end("prepare");
+}
+
+static void
+sleep_until_ms(double ms)
+{
+   struct timespec ts;
 
-         *(indices + i++) = y * x_pts + x + 1;
-         *(indices + i++) = (y + 1) * x_pts + x + 1;
-         *(indices + i++) = (y + 1) * x_pts + x;
+   ts.tv_sec = ms / 1000;
+   ts.tv_nsec = (ms - ts.tv_sec * 1000.0) * 1000000;
+   while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+      ;
+}
+
+/*
+ * Step the model at a fixed rate and publish each tessellated mesh.
+ * The model gets whole milliseconds, with the remainder carried over,
+ * so it advances at the true rate.
+ */
+static void *
+physics_thread(void *data)
+{
+   struct shared_context *context = data;
+   struct surface *surface = &context->surface;
+   struct wobbly_mesh_layout layout;
+   struct mesh_frame *frame;
+   double period = 1000.0 / physics_hz, next, last, elapsed, carry = 0;
+   int ms, num_pts, x_cells, y_cells;
+
+   trace_thread_name("physics");
+
+   last = next = latency_now_ms();
+   while (__atomic_load_n(&physics_running, __ATOMIC_RELAXED)) {
+      next += period;
+      /* Don't try to catch up after a stall */
+      if (next < latency_now_ms() - period)
+         next = latency_now_ms();
+      sleep_until_ms(next);
+
+      trace_begin("physics tick");
+      frame = triple_buffer_write_slot(&physics_mesh);
+      frame->prepare_ms = latency_now_ms();
+      take_input(surface, &frame->input, &frame->has_input, 0);
+
+      elapsed = frame->prepare_ms - last + carry;
+      last = frame->prepare_ms;
+      ms = elapsed;
+      carry = elapsed - ms;
+
+      x_cells = surface->x_cells;
+      y_cells = surface->y_cells;
+      num_pts = (x_cells + 1) * (y_cells + 1);
+      if (num_pts > frame->capacity) {
+         GLfloat *vertices = realloc(frame->vertices, VERTEX_STRIDE * num_pts);
+
+         if (!vertices) {
+            trace_end("physics tick");
+            continue;
+         }
+         frame->vertices = vertices;
+         frame->capacity = num_pts;
       }
 
-   /* Setup buffers */
-   glGenBuffers(1, &VBO);
-   glGenBuffers(1, &indexBuffer);
-   glGenBuffers(1, &textureUV);
-   glGenTextures(1, &textureID);
+      layout.position = frame->vertices;
+      layout.position_stride = VERTEX_STRIDE;
+      layout.texcoord = frame->vertices + 2;
+      layout.texcoord_stride = VERTEX_STRIDE;
+
+      pthread_mutex_lock(&input_mutex);
+      if (scene)
+         wobbly_scene_update(scene);
+      model_steps += prepare_paint(surface, ms);
+      frame->culled = !surface_visible(surface, context->window.width,
+                                       context->window.height);
+      if (frame->culled)
+         frame->num_pts = num_pts;
+      else
+         frame->num_pts = tessellate_parallel(tess_pool, surface, &layout, num_pts);
+      if (exporter && mesh_export_publish(exporter, surface))
+         frames_exported++;
+      done_paint(surface);
+      pthread_mutex_unlock(&input_mutex);
+      vertices_generated += frame->num_pts;
+
+      trace_counter("model steps", model_steps);
+      trace_counter("vertices generated", vertices_generated);
+
+      /* The event thread changed the grid under us; try next tick */
+      if (frame->num_pts == num_pts &&
+          x_cells == surface->x_cells && y_cells == surface->y_cells) {
+         frame->x_cells = x_cells;
+         frame->y_cells = y_cells;
+         triple_buffer_publish(&physics_mesh);
+         physics_published++;
+      }
+      trace_end("physics tick");
+   }
 
-   glEnableVertexAttribArray(attr_pos);
-   glEnableVertexAttribArray(attr_texture);
+   return NULL;
+}
 
-   glBindBuffer(GL_ARRAY_BUFFER, VBO);
-   glBufferData(GL_ARRAY_BUFFER, sizeof (GLfloat) * num_pts * 2, surface->synced ? verts : surface->v, GL_STATIC_DRAW);
-   glVertexAttribPointer(attr_pos, 2, GL_FLOAT, GL_FALSE, 0, 0);
+static int
+start_physics_thread(struct shared_context *context)
+{
+   triple_buffer_init(&physics_mesh, &physics_frames[0], &physics_frames[1],
+                      &physics_frames[2]);
+   physics_running = 1;
+
+   if (pthread_create(&physics_thread_id, NULL, physics_thread, context)) {
+      physics_running = 0;
+      return 0;
+   }
+
+   return 1;
+}
+
+static void
+stop_physics_thread(void)
+{
+   int i;
 
-   glActiveTexture(GL_TEXTURE0);
-   glBindTexture(GL_TEXTURE_2D, textureID);
-   glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB,
-                  surface->tex.width, surface->tex.height,
-                  0, GL_RGB, GL_UNSIGNED_BYTE, surface->tex.data);
-   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+   if (!physics_running)
+      return;
 
-   glBindBuffer(GL_ARRAY_BUFFER, textureUV);
-   glBufferData(GL_ARRAY_BUFFER, sizeof (GLfloat) * num_pts * 2, surface->synced ? uv : surface->tex.uv, GL_STATIC_DRAW);
-   glVertexAttribPointer(attr_texture, 2, GL_FLOAT, GL_FALSE, 0, 0);
+   __atomic_store_n(&physics_running, 0, __ATOMIC_RELAXED);
+   pthread_join(physics_thread_id, NULL);
 
-   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
-   glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof (GLushort) * x_cells * y_cells * 6, indices, GL_STATIC_DRAW);
+   for (i = 0; i < 3; i++)
+      free(physics_frames[i].vertices);
+   memset(physics_frames, 0, sizeof (physics_frames));
 
-   /* Clear buffers */
-   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+   printf("physics: %u meshes published at %.0f Hz, %u drawn\n",
+          physics_published, physics_hz, physics_drawn);
+}
 
-   /* Draw surface */
-   for (i = 0; i < x_cells * y_cells * 2; i++) {
-      GLint mode;
-      switch (render_mode) {
-         case 0:
-            mode = GL_TRIANGLES;
-            break;
-         case 1:
-            mode = GL_LINE_LOOP;
-            break;
-         case 2:
-            mode = GL_POINTS;
-            break;
-         default:
-            break;
-      }
-      glDrawElements(mode, 3, GL_UNSIGNED_SHORT, (const GLvoid*) (i * 3 * sizeof(GLushort)));
-   }
-
-   /* Draw point at cursor hotspot */
-   cursor[0] = ((float) (pointer[0]));
-   cursor[1] = ((float) (pointer[1]));
+/*
+ * Upload the newest mesh the physics thread finished, if it is newer
+ * than the last; otherwise the vertex buffer is drawn again as is.
+ * Input it carries counts as presented once it is drawn.
+ */
+static void
+upload_physics_mesh(struct shared_context *context)
+{
+   struct mesh_buffers *mesh = &context->mesh;
+   struct mesh_frame *frame;
+   int fresh;
 
-   glBindBuffer(GL_ARRAY_BUFFER, VBO);
-   glBufferData(GL_ARRAY_BUFFER, sizeof (GLfloat) * 2, cursor, GL_STATIC_DRAW);
+   frame = triple_buffer_acquire(&physics_mesh, &fresh);
+   context->next_has_input = 0;
 
-   glDrawArrays(GL_POINTS, 0, 1);
+   if (!ensure_mesh_buffers(mesh, 0, frame->x_cells * frame->y_cells * 6) || !fresh)
+      return;
 
-   /* Clean up */
-   glBindBuffer(GL_ARRAY_BUFFER, 0);
-   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-   glBindTexture(GL_TEXTURE_2D, 0);
+   update_indices(mesh, frame->x_cells, frame->y_cells);
 
-   glDisableVertexAttribArray(attr_pos);
-   glDisableVertexAttribArray(attr_texture);
+   mesh->culled = frame->culled;
+   if (mesh->culled)
+      goto done;
 
-   glDeleteBuffers(1, &VBO);
-   glDeleteBuffers(1, &indexBuffer);
-   glDeleteBuffers(1, &textureUV);
-   glDeleteTextures(1, &textureID);
+   perf_stage_begin(perf, PERF_STAGE_UPLOAD);
+   trace_begin("mesh upload");
+   glBindBuffer(GL_ARRAY_BUFFER, mesh->vbo[mesh->slot]);
+   glBufferData(GL_ARRAY_BUFFER, VERTEX_STRIDE * frame->num_pts, frame->vertices,
+                GL_STREAM_DRAW);
+   glBindBuffer(GL_ARRAY_BUFFER, 0);
+   trace_end("mesh upload");
+   perf_stage_end(perf, PERF_STAGE_UPLOAD);
+
+done:
+   if (frame->has_input) {
+      pthread_mutex_lock(&input_mutex);
+      if (input_pending && pending_input.receive_ms == frame->input.receive_ms)
+         input_pending = 0;
+      pthread_mutex_unlock(&input_mutex);
+   }
 
-   free(uv);
-   free(verts);
-   free(indices);
+   context->next_input = frame->input;
+   context->next_has_input = frame->has_input;
+   context->next_prepare_ms = frame->prepare_ms;
+   physics_drawn++;
 }
 
-static void
-prepare_paint(struct surface *surface, int msSinceLastPaint)
+/* Nothing will move until the surface is grabbed again */
+static int
+surface_settled(struct shared_context *context)
 {
-   wobbly_prepare_paint(surface, msSinceLastPaint);
-}
+   struct surface *surface = &context->surface;
 
-static void
-done_paint(struct surface *surface)
-{
-   wobbly_done_paint(surface);
+   return surface->synced && !surface->grabbed && !context->stream && !crowd;
 }
 
-static void
-add_geometry(struct surface *surface)
+/*
+ * Put the cached layer on screen, drawing it first if it is missing or
+ * out of date.  Returns 0 if there is no layer to use.
+ */
+static int
+composite_frame(struct shared_context *context)
 {
-   wobbly_add_geometry(surface);
+   struct surface *surface = &context->surface;
+   struct window *window = &context->window;
+   struct layer_key key;
+
+   memset(&key, 0, sizeof (key));
+   key.x = surface->x;
+   key.y = surface->y;
+   key.width = surface->width;
+   key.height = surface->height;
+   key.x_cells = surface->x_cells;
+   key.y_cells = surface->y_cells;
+   key.render_mode = render_mode;
+   key.window_width = window->width;
+   key.window_height = window->height;
+   key.texture = surface->tex.id;
+
+   if (memcmp(&key, &layer_key, sizeof (key)))
+      layer_invalidate(&layer);
+
+   if (!layer.valid) {
+      trace_begin("layer render");
+      /* Draw the surface as it came to rest */
+      if (physics_hz > 0)
+         upload_physics_mesh(context);
+      else if (!context->mesh.prepared)
+         prepare_frame(context);
+
+      if (!layer_begin(&layer, window->width, window->height)) {
+         printf("Warning: offscreen layers unavailable\n");
+         cache_layers = 0;
+         trace_end("layer render");
+         return 0;
+      }
+      glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+      draw_surface(context);
+      layer_end(&layer);
+      retire_mesh(context);
+      layer_key = key;
+      trace_end("layer render");
+   } else {
+      /* Keep the model's clock running for when it moves again */
+      gettimeofday(&context->t1, NULL);
+      context->frame_prepare_ms = latency_now_ms();
+   }
+
+   trace_begin("composite");
+   glViewport(0, 0, window->width, window->height);
+   glClear(GL_DEPTH_BUFFER_BIT);
+   draw_cursor(context);
+   set_window_transform(window, SURFACE_DEPTH);
+   layer_composite(&layer, attr_pos, attr_texture);
+   trace_end("composite");
+
+   return 1;
 }
 
+/*
+ * Without pipelining a frame is prepared and drawn back to back.  With
+ * it, the frame after this one is prepared right after this one is
+ * submitted, so the CPU work overlaps the GPU drawing and the swap.
+ */
 static void
 draw(struct shared_context *context)
 {
-   struct timeval *t1, t2;
-   double elapsedTime;
+#ifdef DEBUG_ALLOC
+   unsigned long allocs_before = alloc_count();
+   int capacities_before = context->surface.vertex_capacity +
+                           context->mesh.vert_capacity +
+                           context->mesh.index_capacity;
+#endif
 
-   t1 = &context->t1;
-   gettimeofday(&t2, NULL);
+   double begin = latency_now_ms();
 
-   elapsedTime = (t2.tv_sec - t1->tv_sec) * 1000.0;      // sec to ms
-   elapsedTime += (t2.tv_usec - t1->tv_usec) / 1000.0;   // us to ms
+   perf_stage_begin(perf, PERF_STAGE_FRAME);
+   trace_begin("frame");
 
-   prepare_paint(&context->surface, (int) elapsedTime);
+   if (cache_layers && surface_settled(context) && composite_frame(context))
+      goto done;
 
-   gettimeofday(t1, NULL);
+   if (crowd)
+      step_crowd();
 
-   add_geometry(&context->surface);
+   if (physics_hz > 0)
+      upload_physics_mesh(context);
+   else if (!context->mesh.prepared)
+      prepare_frame(context);
 
-   draw_elements(context);
+   submit_mesh(context);
 
-   done_paint(&context->surface);
+   if (context->mesh.depth > 1 && physics_hz <= 0)
+      prepare_frame(context);
+
+done:
+   trace_end("frame");
+   perf_stage_end(perf, PERF_STAGE_FRAME);
+
+   /* The physics thread reads the cell counts and step budget the
+    * governor sets under the same lock */
+   if (governing) {
+      pthread_mutex_lock(&input_mutex);
+      if (governor_frame(&governor, latency_now_ms() - begin, &governed, 1))
+         trace_counter("detail level", governed.level);
+      pthread_mutex_unlock(&input_mutex);
+   }
+
+#ifdef DEBUG_ALLOC
+   check_frame_allocations(context, allocs_before, capacities_before);
+#endif
+}
+
+/*
+ * Draw frames back to back without vsync to see what the pipeline
+ * depth buys.  Stalls are fence waits for a slot the GPU still reads.
+ */
+static void
+run_frames(struct shared_context *context, int frames)
+{
+   double start, elapsed;
+   int i;
+
+   eglSwapInterval(context->egl_dpy, 0);
+
+   start = latency_now_ms();
+   for (i = 0; i < frames && running; i++) {
+      draw(context);
+      swap_buffers(context);
+   }
+   elapsed = latency_now_ms() - start;
+
+   printf("%d frames in %.1f ms, %.1f fps, pipeline depth %d, "
+          "%u fence stalls (%.2f ms)\n", i, elapsed, i * 1000.0 / elapsed,
+          context->mesh.depth, fence_stalls, fence_stall_ms);
+
+   eglSwapInterval(context->egl_dpy, 1);
 }
 
 /* new window size or exposure */
 static void
 reshape(struct shared_context *context, int width, int height)
 {
+   /* The physics thread culls against the window under the lock */
+   pthread_mutex_lock(&input_mutex);
    context->window.width = width;
    context->window.height = height;
+   if (scene)
+      wobbly_scene_set_size(scene, width, height);
+   pthread_mutex_unlock(&input_mutex);
    redraw = 1;
 }
 
@@ -331,8 +1671,27 @@ create_shaders(void)
       "   v_texcoord = texcoord;\n"
       "}\n";
 
+   struct program_cache cache;
+   struct timeval t1, t2;
    GLuint fragShader, vertShader, program;
    GLint stat;
+   int cached;
+   double ms, compile_ms;
+
+   gettimeofday(&t1, NULL);
+
+   program = glCreateProgram();
+
+   cached = program_cache_init(&cache, vertShaderText, fragShaderText);
+   if (cached && program_cache_load(&cache, program, &compile_ms)) {
+      gettimeofday(&t2, NULL);
+      ms = (t2.tv_sec - t1.tv_sec) * 1000.0 + (t2.tv_usec - t1.tv_usec) / 1000.0;
+      printf("shaders: loaded cached program in %.2f ms, saved %.2f ms\n",
+             ms, compile_ms - ms);
+      glUseProgram(program);
+      u_matrix = glGetUniformLocation(program, "modelviewProjection");
+      return;
+   }
 
    fragShader = glCreateShader(GL_FRAGMENT_SHADER);
    glShaderSource(fragShader, 1, (const char **) &fragShaderText, NULL);
@@ -352,9 +1711,12 @@ create_shaders(void)
       exit(1);
    }
 
-   program = glCreateProgram();
    glAttachShader(program, fragShader);
    glAttachShader(program, vertShader);
+
+   /* Attribute locations only take effect at link time */
+   glBindAttribLocation(program, attr_pos, "pos");
+   glBindAttribLocation(program, attr_texture, "texcoord");
    glLinkProgram(program);
 
    glGetProgramiv(program, GL_LINK_STATUS, &stat);
@@ -367,10 +1729,18 @@ create_shaders(void)
    }
 
    glUseProgram(program);
-   
-   glBindAttribLocation(program, attr_pos, "pos");
-   glBindAttribLocation(program, attr_texture, "texcoord");
-   glLinkProgram(program);
+
+   /* The program holds everything it needs once linked */
+   glDeleteShader(fragShader);
+   glDeleteShader(vertShader);
+
+   gettimeofday(&t2, NULL);
+   ms = (t2.tv_sec - t1.tv_sec) * 1000.0 + (t2.tv_usec - t1.tv_usec) / 1000.0;
+
+   if (cached) {
+      program_cache_store(&cache, program, ms);
+      printf("shaders: compiled in %.2f ms, stored in program cache\n", ms);
+   }
 
    u_matrix = glGetUniformLocation(program, "modelviewProjection");
 }
@@ -378,16 +1748,56 @@ create_shaders(void)
 static int
 init(struct shared_context *context)
 {
+   const char *extensions;
+
    glClearColor(0.4, 0.4, 0.4, 0.0);
+   /* Equal depths pass, so folds in the surface still draw in order */
+   glEnable(GL_DEPTH_TEST);
+   glDepthFunc(GL_LEQUAL);
 
+   stage_begin(STAGE_SHADERS);
+   trace_begin("shaders");
    create_shaders();
+   trace_end("shaders");
+   stage_end(STAGE_SHADERS);
+
+   extensions = (const char *) glGetString(GL_EXTENSIONS);
+   if (extensions && strstr(extensions, "GL_OES_mapbuffer")) {
+      map_buffer = (PFNGLMAPBUFFEROESPROC) eglGetProcAddress("glMapBufferOES");
+      unmap_buffer = (PFNGLUNMAPBUFFEROESPROC) eglGetProcAddress("glUnmapBufferOES");
+      if (!unmap_buffer)
+         map_buffer = NULL;
+   }
+
+   extensions = eglQueryString(context->egl_dpy, EGL_EXTENSIONS);
+   if (extensions && strstr(extensions, "EGL_KHR_fence_sync")) {
+      create_sync = (PFNEGLCREATESYNCKHRPROC) eglGetProcAddress("eglCreateSyncKHR");
+      client_wait_sync = (PFNEGLCLIENTWAITSYNCKHRPROC) eglGetProcAddress("eglClientWaitSyncKHR");
+      destroy_sync = (PFNEGLDESTROYSYNCKHRPROC) eglGetProcAddress("eglDestroySyncKHR");
+   }
 
-   if (!wobbly_init(&context->surface))
-	return 0;
+   if (context->mesh.depth > 1 && !(create_sync && client_wait_sync && destroy_sync)) {
+      printf("Warning: EGL_KHR_fence_sync unavailable, frames won't be pipelined\n");
+      context->mesh.depth = 1;
+   }
 
    return 1;
 }
 
+/* Wake event_loop out of XNextEvent with a message that makes it stop */
+static void
+quit_event_loop(struct shared_context *context)
+{
+   XEvent event;
+
+   memset(&event, 0, sizeof (event));
+   event.xclient.type = ClientMessage;
+   event.xclient.window = context->x_win;
+   event.xclient.format = 32;
+   XSendEvent(context->x_dpy, context->x_win, False, NoEventMask, &event);
+   XFlush(context->x_dpy);
+}
+
 /*
  * Create an RGB, double-buffered X window.
  * Return the window and context handles.
@@ -507,16 +1917,22 @@ make_x_window(Display *x_dpy, EGLDisplay egl_dpy,
    *ctxRet = ctx;
 }
 
+/* Hit test against the mesh as drawn; call with input_mutex held */
 static int
-point_on_surface(struct shared_context *context, GLint x, GLint y)
+point_on_surface(struct shared_context *context, GLint x, GLint y,
+                 float *u, float *v)
 {
-   if (x > context->surface.x &&
-       x < context->surface.x + context->surface.width &&
-       y > context->surface.y &&
-       y < context->surface.y + context->surface.height)
-      return 1;
+   if (scene)
+      return wobbly_scene_pick(scene, x, y, u, v) == &context->surface;
 
-   return 0;
+   return wobbly_hit_test(&context->surface, x, y, u, v);
+}
+
+/* Whether a grid of this many cells can be drawn with 16 bit indices */
+static int
+cells_fit(int x_cells, int y_cells)
+{
+   return (x_cells + 1) * (y_cells + 1) <= WOBBLY_MAX_VERTICES;
 }
 
 static void*
@@ -524,30 +1940,50 @@ event_loop(void *data)
 {
    struct shared_context *context = data;
    struct surface *surface = &context->surface;
+   long long events_processed = 0;
+
+   trace_thread_name("event loop");
 
    while (running) {
       XEvent event;
+      double receive_ms;
+      float u, v;
 
       XNextEvent(context->x_dpy, &event);
+      receive_ms = latency_now_ms();
 
+      trace_counter("events processed", ++events_processed);
+      trace_begin("event");
       switch (event.type) {
       case ButtonPress:
-         if (point_on_surface(context, event.xcrossing.x, event.xcrossing.y)) {
+         pthread_mutex_lock(&input_mutex);
+         if (point_on_surface(context, event.xcrossing.x, event.xcrossing.y, &u, &v)) {
             last_x = event.xcrossing.x;
             last_y = event.xcrossing.y;
+            predictor_reset(&predictor);
+            predictor_add_sample(&predictor, receive_ms, last_x, last_y);
+            predict_dx = predict_dy = 0;
             surface->grabbed = 1;
             surface->synced = 0;
-            wobbly_grab_notify(surface, last_x, last_y);
+            wobbly_grab_notify_uv(surface, u, v);
+            wobbly_set_snapping(surface, event.xbutton.state & ShiftMask);
          }
+         pthread_mutex_unlock(&input_mutex);
          break;
       case ButtonRelease:
+         pthread_mutex_lock(&input_mutex);
+         if (surface->grabbed && (predict_dx || predict_dy))
+            wobbly_move_notify(surface, -predict_dx, -predict_dy);
+         predict_dx = predict_dy = 0;
          surface->grabbed = 0;
          redraw = 1;
          wobbly_ungrab_notify(surface);
+         pthread_mutex_unlock(&input_mutex);
          break;
       case KeyPress:
          if (XLookupKeysym(&event.xkey, 0) == XK_Escape) {
             running = 0;
+            trace_end("event");
             continue;
          }
          break;
@@ -556,8 +1992,10 @@ event_loop(void *data)
          break;
       }
 
-      if (redraw)
+      if (redraw) {
+         trace_end("event");
          continue;
+      }
 
       switch (event.type) {
       case ConfigureNotify:
@@ -588,13 +2026,15 @@ event_loop(void *data)
                surface->height += 10;
                wobbly_resize_notify(surface);
             } else if (code == XK_d) {
-               surface->x_cells += 1;
+               if (cells_fit(surface->x_cells + 1, surface->y_cells))
+                  surface->x_cells += 1;
             } else if (code == XK_a) {
                surface->x_cells -= 1;
                if (surface->x_cells < 1)
                    surface->x_cells = 1;
             } else if (code == XK_w) {
-               surface->y_cells += 1;
+               if (cells_fit(surface->x_cells, surface->y_cells + 1))
+                  surface->y_cells += 1;
             } else if (code == XK_s) {
                surface->y_cells -= 1;
                if (surface->y_cells < 1)
@@ -602,12 +2042,16 @@ event_loop(void *data)
 	    } else if (code == XK_m) {
                if (++render_mode > 2)
                    render_mode = 0;
+            } else if (code == XK_p) {
+               predict_enabled = !predict_enabled;
+               printf("pointer prediction %s\n", predict_enabled ? "on" : "off");
             } else {
                XLookupString(&event.xkey, buffer, sizeof(buffer),
                                  NULL, NULL);
                if (buffer[0] == 43) {
 		  /* plus */
-                  surface->y_cells = ++surface->x_cells;
+                  if (cells_fit(surface->x_cells + 1, surface->x_cells + 1))
+                     surface->y_cells = ++surface->x_cells;
                }
                else if (buffer[0] == 45) {
 		  /* minus */
@@ -627,7 +2071,14 @@ event_loop(void *data)
                int dy = (pointer[1] - last_y);
                last_x = pointer[0];
                last_y = pointer[1];
+               pthread_mutex_lock(&input_mutex);
+               wobbly_set_snapping(surface, event.xmotion.state & ShiftMask);
                wobbly_move_notify(surface, dx, dy);
+               predictor_add_sample(&predictor, receive_ms, last_x, last_y);
+               pthread_mutex_unlock(&input_mutex);
+               tag_input(event.xmotion.time, receive_ms);
+               if (motion_log)
+                  fprintf(motion_log, "%.3f %d %d\n", receive_ms, last_x, last_y);
             }
             redraw = 1;
 	 }
@@ -635,17 +2086,96 @@ event_loop(void *data)
       default:
          ; /* process next event */
       }
+      trace_end("event");
    }
    pthread_exit(NULL);
 }
 
+struct startup_job {
+   struct surface *surface;
+   char *texFile;
+   int ok;
+};
+
+/* Decode the surface image; runs while X and EGL come up */
+static void *
+load_texture_thread(void *data)
+{
+   struct startup_job *job = data;
+   struct surface *surface = job->surface;
+   char *name = job->texFile ? job->texFile : "texture.png";
+   int ok;
+
+   trace_thread_name("texture loader");
+   trace_begin("texture decode");
+   stage_begin(STAGE_TEXTURE_DECODE);
+
+   surface->tex.levels = 1;
+   ok = loadEtc1Image(name, &surface->tex.width, &surface->tex.height,
+                      &surface->tex.levels, &surface->tex.data);
+   if (ok)
+      surface->tex.format = IMAGE_FORMAT_ETC1;
+   else
+      ok = loadPngImage(name, &surface->tex.width, &surface->tex.height,
+                        &surface->tex.format, &surface->tex.data);
+
+   if (!ok) {
+      surface->tex.data = NULL;
+      surface->tex.width = 0;
+      surface->tex.height = 0;
+      surface->tex.format = IMAGE_FORMAT_RGB;
+   }
+
+   stage_end(STAGE_TEXTURE_DECODE);
+   trace_end("texture decode");
+
+   job->ok = ok;
+
+   return NULL;
+}
+
+/* Build the spring model; needs no GL, so it overlaps window setup */
+static void *
+init_model_thread(void *data)
+{
+   struct startup_job *job = data;
+
+   trace_thread_name("model setup");
+   trace_begin("model setup");
+   stage_begin(STAGE_MODEL);
+   job->ok = wobbly_init(job->surface);
+   stage_end(STAGE_MODEL);
+   trace_end("model setup");
+
+   return NULL;
+}
+
 static void
 usage(void)
 {
    printf("Usage:\n");
    printf("  -display <displayname>  set the display to run on\n");
-   printf("  -texture texture.png    set the image to use\n");
-   printf("  -info                   display OpenGL renderer info\n\n");
+   printf("  -texture texture.png    set the image to use (png, ktx or pkm)\n");
+   printf("  -encode-etc1 out.ktx    compress the texture to ETC1 and exit\n");
+   printf("  -stream frame%%04d.png   animate the surface with an image sequence\n");
+   printf("  -fps <rate>             frame rate of the image sequence (30)\n");
+   printf("  -info                   display OpenGL renderer info\n");
+   printf("  -timeline               print the startup timeline\n");
+   printf("  -perf                   report hardware counters per stage on exit\n");
+   printf("  -latency                report motion to photon latency on exit\n");
+   printf("  -pipeline <depth>       frames in flight, 1 (default) to 4\n");
+   printf("  -frames <n>             draw n frames unthrottled, report throughput\n");
+   printf("  -physics-thread <hz>    step physics in its own thread at this rate\n");
+   printf("  -predict                start with pointer prediction on (p toggles)\n");
+   printf("  -record-motion out.txt  log drag motion for wobbly-bench predict\n");
+   printf("  -trace out.json         write a Chrome trace-event timeline on exit\n");
+   printf("  -budget <ms>            lower detail to keep frames within budget\n");
+   printf("  -adaptive <px>          tessellate finer only where the surface bends\n");
+   printf("  -cache-layers           draw the surface at rest from an offscreen copy\n");
+   printf("  -tess-threads <n>       split tessellating dense grids over n threads\n");
+   printf("  -gpu-physics <n>        add n surfaces stepped and drawn on the GPU\n");
+   printf("  -gpu-physics-check      compare gpu physics with the wobbly core and exit\n");
+   printf("  -export-mesh <name>     publish each frame's mesh to shared memory /name\n\n");
    printf("Hotkeys:\n");
    printf("   a/d/w/s:               adjust surface x/y cells\n");
    printf("   +/-:                   adjust surface x/y cells in sync\n");
@@ -658,14 +2188,26 @@ int
 main(int argc, char *argv[])
 {
    const int winWidth = 1000, winHeight = 500;
-   pthread_t threads[1];
+   pthread_t threads[1], texture_thread, model_thread;
+   struct startup_job texture_job, model_job;
    struct shared_context *context;
    struct surface *surface;
    Window win;
    EGLContext egl_ctx;
    char *dpyName = NULL;
    char *texFile = NULL;
+   char *etc1File = NULL;
+   char *streamPattern = NULL;
+   char *traceFile = NULL;
+   char *motionFile = NULL;
+   char *exportName = NULL;
+   int pipelineDepth = 1, benchFrames = 0, crowdSize = 0, status = 0;
+   double streamFps = 30.0;
    GLboolean printInfo = GL_FALSE;
+   GLboolean printTimeline = GL_FALSE;
+   GLboolean countPerf = GL_FALSE;
+   GLboolean printLatency = GL_FALSE;
+   GLboolean checkGpuPhysics = GL_FALSE;
    EGLint egl_major, egl_minor;
    int i;
    const char *s;
@@ -675,41 +2217,210 @@ main(int argc, char *argv[])
          dpyName = argv[i+1];
          i++;
       }
-      if (strcmp(argv[i], "-texture") == 0) {
+      else if (strcmp(argv[i], "-texture") == 0) {
          texFile = argv[i+1];
          i++;
       }
+      else if (strcmp(argv[i], "-stream") == 0) {
+         streamPattern = argv[i+1];
+         i++;
+      }
+      else if (strcmp(argv[i], "-fps") == 0) {
+         streamFps = atof(argv[i+1]);
+         i++;
+      }
+      else if (strcmp(argv[i], "-encode-etc1") == 0) {
+         etc1File = argv[i+1];
+         i++;
+      }
       else if (strcmp(argv[i], "-info") == 0) {
          printInfo = GL_TRUE;
       }
+      else if (strcmp(argv[i], "-timeline") == 0) {
+         printTimeline = GL_TRUE;
+      }
+      else if (strcmp(argv[i], "-perf") == 0) {
+         countPerf = GL_TRUE;
+      }
+      else if (strcmp(argv[i], "-latency") == 0) {
+         printLatency = GL_TRUE;
+      }
+      else if (strcmp(argv[i], "-pipeline") == 0) {
+         pipelineDepth = atoi(argv[i+1]);
+         if (pipelineDepth < 1 || pipelineDepth > PIPELINE_MAX_DEPTH) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "-physics-thread") == 0) {
+         physics_hz = atof(argv[i+1]);
+         if (physics_hz <= 0) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "-tess-threads") == 0) {
+         int threads = atoi(argv[i+1]);
+
+         if (threads < 1) {
+            usage();
+            return -1;
+         }
+         worker_pool_destroy(tess_pool);
+         tess_pool = worker_pool_create(threads);
+         if (!tess_pool)
+            printf("Warning: no tessellation threads, tessellating in one\n");
+         i++;
+      }
+      else if (strcmp(argv[i], "-frames") == 0) {
+         benchFrames = atoi(argv[i+1]);
+         i++;
+      }
+      else if (strcmp(argv[i], "-predict") == 0) {
+         predict_enabled = 1;
+      }
+      else if (strcmp(argv[i], "-record-motion") == 0) {
+         motionFile = argv[i+1];
+         i++;
+      }
+      else if (strcmp(argv[i], "-trace") == 0) {
+         traceFile = argv[i+1];
+         i++;
+      }
+      else if (strcmp(argv[i], "-cache-layers") == 0) {
+         cache_layers = 1;
+      }
+      else if (strcmp(argv[i], "-gpu-physics") == 0) {
+         crowdSize = atoi(argv[i+1]);
+         if (crowdSize < 1) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "-gpu-physics-check") == 0) {
+         checkGpuPhysics = GL_TRUE;
+      }
+      else if (strcmp(argv[i], "-export-mesh") == 0) {
+         exportName = argv[i+1];
+         i++;
+      }
+      else if (strcmp(argv[i], "-adaptive") == 0) {
+         adaptive_tolerance = atof(argv[i+1]);
+         if (adaptive_tolerance <= 0) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "-budget") == 0) {
+         governor_init(&governor, atof(argv[i+1]));
+         if (governor.budget_ms <= 0) {
+            usage();
+            return -1;
+         }
+         governing = 1;
+         i++;
+      }
       else {
          usage();
          return -1;
       }
    }
 
+   if (etc1File)
+      return encode_etc1(texFile ? texFile : "texture.png", etc1File) ? 0 : -1;
+
    context = malloc(sizeof (*context));
 
    if (!context)
       return -1;
 
+   context->stream = NULL;
+   context->stream_width = context->stream_height = 0;
+   context->stream_format = 0;
+   context->frame_has_input = 0;
+   memset(&context->mesh, 0, sizeof (context->mesh));
+   context->mesh.depth = pipelineDepth;
+   if (physics_hz > 0 && pipelineDepth > 1) {
+      printf("Warning: -pipeline has no effect with -physics-thread\n");
+      context->mesh.depth = 1;
+   }
+   if (physics_hz > 0 && adaptive_tolerance > 0) {
+      printf("Warning: -adaptive has no effect with -physics-thread\n");
+      adaptive_tolerance = 0;
+   }
+
+   gettimeofday(&startup_t0, NULL);
+
+   if (traceFile && !trace_init(traceFile))
+      return -1;
+
+   if (exportName) {
+      exporter = mesh_export_create(exportName, WOBBLY_MAX_VERTICES);
+      if (!exporter) {
+         printf("Error: couldn't create shared memory %s\n", exportName);
+         return -1;
+      }
+   }
+
+   if (motionFile) {
+      motion_log = fopen(motionFile, "w");
+      if (!motion_log) {
+         printf("Error: couldn't open %s\n", motionFile);
+         return -1;
+      }
+   }
+   trace_thread_name("render");
+
+   surface = &context->surface;
+
+   surface->width = 400;
+   surface->height = 200;
+   surface->x = winWidth / 2 - surface->width / 2;
+   surface->y = winHeight / 2 - surface->height / 2;
+   surface->grabbed = 0;
+   surface->synced = 1;
+   surface->x_cells = 8;
+   surface->y_cells = 8;
+   surface->v = NULL;
+   surface->vertex_count = 0;
+   surface->vertex_capacity = 0;
+   surface->tex.uv = NULL;
+   surface->tex.id = 0;
+
+   /* Decoding the texture and building the model need neither X nor
+    * GL, so run them while the display and window come up */
+   texture_job.surface = surface;
+   texture_job.texFile = texFile;
+   pthread_create(&texture_thread, NULL, load_texture_thread, &texture_job);
+
+   model_job.surface = surface;
+   model_job.texFile = NULL;
+   pthread_create(&model_thread, NULL, init_model_thread, &model_job);
+
+   stage_begin(STAGE_DISPLAY);
+
+   trace_begin("display");
    XInitThreads();
    context->x_dpy = XOpenDisplay(dpyName);
    if (!context->x_dpy) {
       printf("Error: couldn't open display %s\n",
 	     dpyName ? dpyName : getenv("DISPLAY"));
-      return -1;
+      goto startup_failed;
    }
 
    context->egl_dpy = eglGetDisplay(context->x_dpy);
    if (!context->egl_dpy) {
       printf("Error: eglGetDisplay() failed\n");
-      return -1;
+      goto startup_failed;
    }
 
    if (!eglInitialize(context->egl_dpy, &egl_major, &egl_minor)) {
       printf("Error: eglInitialize() failed\n");
-      return -1;
+      goto startup_failed;
    }
 
    s = eglQueryString(context->egl_dpy, EGL_VERSION);
@@ -728,6 +2439,11 @@ main(int argc, char *argv[])
    if (printInfo)
       printf("EGL_CLIENT_APIS = %s\n", s);
 
+   stage_end(STAGE_DISPLAY);
+   trace_end("display");
+   stage_begin(STAGE_WINDOW);
+   trace_begin("window");
+
    make_x_window(context->x_dpy, context->egl_dpy,
                  "OpenGL ES 2.x wobbly", 0, 0, winWidth, winHeight,
                  &win, &egl_ctx, &context->egl_surf);
@@ -736,9 +2452,12 @@ main(int argc, char *argv[])
    XMapWindow(context->x_dpy, win);
    if (!eglMakeCurrent(context->egl_dpy, context->egl_surf, context->egl_surf, egl_ctx)) {
       printf("Error: eglMakeCurrent() failed\n");
-      return -1;
+      goto startup_failed;
    }
 
+   stage_end(STAGE_WINDOW);
+   trace_end("window");
+
    if (printInfo) {
       printf("GL_RENDERER   = %s\n", (char *) glGetString(GL_RENDERER));
       printf("GL_VERSION    = %s\n", (char *) glGetString(GL_VERSION));
@@ -746,55 +2465,161 @@ main(int argc, char *argv[])
       printf("GL_EXTENSIONS = %s\n", (char *) glGetString(GL_EXTENSIONS));
    }
 
-   surface = &context->surface;
-
-   surface->width = 400;
-   surface->height = 200;
-   surface->x = winWidth / 2 - surface->width / 2;
-   surface->y = winHeight / 2 - surface->height / 2;
-   surface->grabbed = 0;
-   surface->synced = 1;
-   surface->x_cells = 8;
-   surface->y_cells = 8;
-   surface->v = NULL;
-   surface->tex.uv = NULL;
+   /* Counters follow the thread that opens them: the render thread */
+   if (countPerf) {
+      perf = perf_counters_create();
+      if (!perf)
+         printf("Warning: hardware counters unavailable\n");
+   }
 
-   i = loadPngImage(texFile ? texFile : "texture.png",
-		&surface->tex.width, &surface->tex.height, &surface->tex.data);
+   if (!init(context)) {
+      pthread_join(texture_thread, NULL);
+      pthread_join(model_thread, NULL);
+      status = -1;
+      goto cleanup;
+   }
 
-   if (!i) {
-      surface->tex.data = NULL;
-      surface->tex.width = 0;
-      surface->tex.height = 0;
+   pthread_join(texture_thread, NULL);
+   stage_begin(STAGE_TEXTURE_UPLOAD);
+   perf_stage_begin(perf, PERF_STAGE_UPLOAD);
+   trace_begin("texture upload");
+   create_texture(surface);
+   trace_end("texture upload");
+   perf_stage_end(perf, PERF_STAGE_UPLOAD);
+   stage_end(STAGE_TEXTURE_UPLOAD);
+
+   pthread_join(model_thread, NULL);
+   if (!model_job.ok) {
+      status = -1;
+      goto cleanup;
    }
 
-   if (!init(context))
+   if (checkGpuPhysics) {
+      if (!check_gpu_physics())
+         status = -1;
       goto cleanup;
+   }
+
+   if (crowdSize > 0)
+      create_crowd(crowdSize, winWidth, winHeight);
+
+   if (streamPattern) {
+      context->stream = texture_stream_create(streamPattern, streamFps);
+      if (!context->stream) {
+         status = -1;
+         goto cleanup;
+      }
+
+      /* Streamed frames replace only the base level */
+      glBindTexture(GL_TEXTURE_2D, surface->tex.id);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+      glBindTexture(GL_TEXTURE_2D, 0);
+   }
 
    /* Set initial projection/viewing transformation.
     * We can't be sure we'll get a ConfigureNotify event when the window
     * first appears.
     */
+   if (governing)
+      governor_add_surface(&governed, &context->surface);
+
+   scene = wobbly_scene_create(winWidth, winHeight);
+   if (scene)
+      wobbly_scene_add(scene, &context->surface);
+
    reshape(context, winWidth, winHeight);
 
    /* init reference timer */
    gettimeofday(&context->t1, NULL);
 
+   if (physics_hz > 0 && !start_physics_thread(context)) {
+      status = -1;
+      goto cleanup;
+   }
+
    pthread_create(threads, NULL, event_loop, context);
 
+   stage_begin(STAGE_FIRST_FRAME);
+   redraw = 1;
+   draw(context);
+   swap_buffers(context);
+   redraw = 0;
+   stage_end(STAGE_FIRST_FRAME);
+
+   if (printTimeline)
+      print_startup_timeline();
+
+   if (benchFrames > 0) {
+      run_frames(context, benchFrames);
+      quit_event_loop(context);
+   }
+
    while(running) {
+      usleep(16000);
       redraw = 1;
       draw(context);
-      eglSwapBuffers(context->egl_dpy, context->egl_surf);
+      swap_buffers(context);
       redraw = 0;
-      usleep(16000);
    }
 
    pthread_join(threads[0], NULL);
 
-   wobbly_fini(&context->surface);
+   stop_physics_thread();
+
+   perf_counters_report(perf, stdout);
+   trace_write();
+
+   if (motion_log)
+      fclose(motion_log);
+
+   if (governing)
+      governor_report(&governor, &governed, 1, stdout);
+
+   if (index_acmr > 0)
+      printf("indices: %.3f vertices transformed per triangle with a %d entry cache\n",
+             index_acmr, WOBBLY_VERTEX_CACHE);
+
+   printf("cull: %u frames off screen, %.1f Mpx of surface not drawn\n",
+          frames_culled, pixels_culled / 1000000.0);
+
+   if (cache_layers || layer.renders)
+      printf("layer: %u renders, %u frames composited\n", layer.renders,
+             layer.composites);
+
+   if (crowd)
+      printf("gpu physics: %d surfaces, %lld steps\n", crowd_size, crowd_steps);
+
+   if (exporter)
+      printf("export: %u frames published to %s\n", frames_exported, exportName);
+
+   if (printLatency) {
+      latency_report(&motion_latency, "motion to photon", stdout);
+      latency_report(&server_latency, "server to photon (estimated)", stdout);
+   }
+
+   if (context->stream) {
+      struct texture_stream_stats stats;
+
+      texture_stream_get_stats(context->stream, &stats);
+      printf("stream: %u decoded, %u displayed, %u dropped, %u late, %u errors\n",
+             stats.decoded, stats.displayed, stats.dropped, stats.late, stats.errors);
+   }
 
 cleanup:
+   if (model_job.ok)
+      wobbly_fini(surface);
+   mesh_export_destroy(exporter);
+   gpu_physics_destroy(crowd);
+   free(crowd_pulls);
+   layer_destroy(&layer);
+   worker_pool_destroy(tess_pool);
+   if (scene)
+      wobbly_scene_destroy(scene);
+   perf_counters_destroy(perf);
+   texture_stream_destroy(context->stream);
+   destroy_mesh_buffers(context);
+   glDeleteTextures(1, &surface->tex.id);
+
    eglDestroyContext(context->egl_dpy, egl_ctx);
    eglDestroySurface(context->egl_dpy, context->egl_surf);
    eglTerminate(context->egl_dpy);
@@ -805,5 +2630,16 @@ cleanup:
    free(surface->tex.data);
    free(context);
 
-   return 0;
+   return status;
+
+startup_failed:
+   /* No display or context, with the startup threads still running */
+   pthread_join(texture_thread, NULL);
+   pthread_join(model_thread, NULL);
+   if (model_job.ok)
+      wobbly_fini(surface);
+   free(surface->tex.data);
+   free(context);
+
+   return -1;
 }
@@ -0,0 +1,145 @@
+/**************************************************************************
+ *
+ * Copyright 2014 Scott Moreau <oreaus@gmail.com>
+ * All Rights Reserved.
+ *
+ **************************************************************************/
+
+/*
+ * Follows the meshes a wobbly run with -export-mesh publishes, the way
+ * an out of process compositor would, and checks that every frame it
+ * keeps is whole: the frame number at both ends of the slot agrees
+ * and the mesh lies within the frame's bounds.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "mesh-export.h"
+
+/* Patch points may round a little outside the hull of the net */
+#define BOUNDS_SLACK 0.01f
+
+struct consumer_stats {
+   unsigned int frames, skipped, retries, inconsistent;
+   double vertices;
+};
+
+static double
+now_ms(void)
+{
+   struct timeval t;
+
+   gettimeofday(&t, NULL);
+
+   return t.tv_sec * 1000.0 + t.tv_usec / 1000.0;
+}
+
+/* Nonzero if what was read of the frame hangs together */
+static int
+frame_consistent(struct mesh_export *export, const struct mesh_export_frame *frame)
+{
+   const GLfloat *vertices = mesh_export_vertices(export, frame);
+   const GLushort *indices = mesh_export_indices(export, frame);
+   int i;
+
+   if (mesh_export_tail(export, frame) != frame->frame)
+      return 0;
+
+   if (frame->num_vertices != (frame->x_cells + 1) * (frame->y_cells + 1) ||
+       frame->num_indices != frame->x_cells * frame->y_cells * 6)
+      return 0;
+
+   for (i = 0; i < frame->num_vertices; i++) {
+      if (vertices[4 * i] < frame->bounds[0] - BOUNDS_SLACK ||
+          vertices[4 * i] > frame->bounds[2] + BOUNDS_SLACK ||
+          vertices[4 * i + 1] < frame->bounds[1] - BOUNDS_SLACK ||
+          vertices[4 * i + 1] > frame->bounds[3] + BOUNDS_SLACK)
+         return 0;
+   }
+
+   for (i = 0; i < frame->num_indices; i++) {
+      if (indices[i] >= frame->num_vertices)
+         return 0;
+   }
+
+   return 1;
+}
+
+static void
+consume(struct mesh_export *export, double seconds, struct consumer_stats *stats)
+{
+   const struct mesh_export_frame *frame;
+   uint32_t sequence, number, last = 0;
+   double end = now_ms() + seconds * 1000.0;
+   int consistent, vertices;
+
+   while (now_ms() < end && !mesh_export_closed(export)) {
+      frame = mesh_export_begin_read(export, &sequence);
+      if (!frame || frame->frame == last) {
+         usleep(1000);
+         continue;
+      }
+
+      /* Read in place, then keep it only if it wasn't rewritten */
+      number = frame->frame;
+      vertices = frame->num_vertices;
+      consistent = frame_consistent(export, frame);
+      if (!mesh_export_end_read(export, frame, sequence)) {
+         stats->retries++;
+         continue;
+      }
+
+      if (!consistent)
+         stats->inconsistent++;
+      if (last && number > last + 1)
+         stats->skipped += number - last - 1;
+      stats->frames++;
+      stats->vertices += vertices;
+      last = number;
+   }
+}
+
+int
+main(int argc, char *argv[])
+{
+   struct mesh_export *export = NULL;
+   struct consumer_stats stats;
+   double seconds, start;
+
+   if (argc < 2) {
+      printf("Usage: wobbly-consumer <name> [seconds]\n");
+      printf("  follow the meshes wobbly -export-mesh <name> publishes\n");
+      return -1;
+   }
+   seconds = argc > 2 ? atof(argv[2]) : 10;
+
+   /* The producer may not be up yet */
+   start = now_ms();
+   while (!export && now_ms() - start < seconds * 1000.0) {
+      export = mesh_export_open(argv[1]);
+      if (!export)
+         usleep(100000);
+   }
+   if (!export) {
+      printf("Error: nothing exported as %s\n", argv[1]);
+      return -1;
+   }
+
+   memset(&stats, 0, sizeof (stats));
+   start = now_ms();
+   consume(export, seconds, &stats);
+
+   printf("consumer: %u frames in %.1f s, %.0f vertices each, %u skipped, "
+          "%u reread, %u inconsistent%s\n", stats.frames, (now_ms() - start) / 1000.0,
+          stats.frames ? stats.vertices / stats.frames : 0.0, stats.skipped,
+          stats.retries, stats.inconsistent,
+          mesh_export_closed(export) ? ", producer gone" : "");
+
+   mesh_export_destroy(export);
+
+   return stats.inconsistent ? -1 : 0;
+}
@@ -0,0 +1,337 @@
+/**************************************************************************
+ *
+ * Copyright 2014 Scott Moreau <oreaus@gmail.com>
+ * All Rights Reserved.
+ *
+ **************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "wobbly.h"
+#include "mesh-export.h"
+
+/* Slots start on their own cache lines, so writing one leaves the
+ * lines consumers poll in the others alone */
+#define MESH_EXPORT_ALIGN 64
+#define MESH_EXPORT_ALIGNED(n) (((n) + MESH_EXPORT_ALIGN - 1) & ~(MESH_EXPORT_ALIGN - 1))
+#define MESH_EXPORT_HEADER_SIZE MESH_EXPORT_ALIGNED(sizeof (struct mesh_export_header))
+
+/* Tries before a consumer gives up on a producer stuck mid-frame */
+#define MESH_EXPORT_READ_TRIES 100
+
+struct mesh_export {
+   struct mesh_export_header *header;
+   size_t size;
+   int fd;
+   char *name;          /* unlinked by the producer on destroy */
+   int producer;
+};
+
+static struct mesh_export_frame *
+export_slot(struct mesh_export *export, uint32_t slot)
+{
+   return (struct mesh_export_frame *)
+      ((char *) export->header + MESH_EXPORT_HEADER_SIZE + slot * export->header->slot_size);
+}
+
+static struct mesh_export *
+export_map(int fd, size_t size, int producer)
+{
+   struct mesh_export *export;
+
+   export = calloc(1, sizeof (*export));
+   if (!export)
+      return NULL;
+
+   export->header = mmap(NULL, size, producer ? PROT_READ | PROT_WRITE : PROT_READ,
+                         MAP_SHARED, fd, 0);
+   if (export->header == MAP_FAILED) {
+      free(export);
+      return NULL;
+   }
+   export->size = size;
+   export->fd = fd;
+   export->producer = producer;
+
+   return export;
+}
+
+/*
+ * Shared memory for meshes of up to max_vertices vertices, under
+ * /dev/shm/name, or anonymous if name is NULL, to be handed to
+ * consumers through mesh_export_fd.  Consumers can't open it until it
+ * is filled in.
+ */
+struct mesh_export *
+mesh_export_create(const char *name, int max_vertices)
+{
+   struct mesh_export_header header;
+   struct mesh_export *export;
+   size_t size;
+   int fd;
+
+   memset(&header, 0, sizeof (header));
+   header.version = MESH_EXPORT_VERSION;
+   header.slots = MESH_EXPORT_SLOTS;
+   header.max_vertices = max_vertices;
+   header.max_indices = max_vertices * 6;
+   header.points_offset = MESH_EXPORT_ALIGNED(sizeof (struct mesh_export_frame));
+   header.vertices_offset = header.points_offset +
+      MESH_EXPORT_ALIGNED(sizeof (GLfloat) * 2 * WOBBLY_GRID_SIZE * WOBBLY_GRID_SIZE);
+   header.indices_offset = header.vertices_offset +
+      MESH_EXPORT_ALIGNED(sizeof (GLfloat) * 4 * header.max_vertices);
+   header.tail_offset = header.indices_offset +
+      MESH_EXPORT_ALIGNED(sizeof (GLushort) * header.max_indices);
+   header.slot_size = header.tail_offset + MESH_EXPORT_ALIGN;
+
+   size = MESH_EXPORT_HEADER_SIZE + (size_t) header.slots * header.slot_size;
+
+   if (name)
+      fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+   else
+      fd = memfd_create("wobbly-mesh", MFD_CLOEXEC);
+   if (fd < 0)
+      return NULL;
+
+   /* Truncating to nothing first zeroes what an earlier run left */
+   if (ftruncate(fd, 0) || ftruncate(fd, size)) {
+      close(fd);
+      if (name)
+         shm_unlink(name);
+      return NULL;
+   }
+
+   export = export_map(fd, size, 1);
+   if (!export) {
+      close(fd);
+      if (name)
+         shm_unlink(name);
+      return NULL;
+   }
+   if (name)
+      export->name = strdup(name);
+
+   *export->header = header;
+   __atomic_store_n(&export->header->magic, MESH_EXPORT_MAGIC, __ATOMIC_RELEASE);
+
+   return export;
+}
+
+/* Map what a producer made, read only */
+struct mesh_export *
+mesh_export_open_fd(int fd)
+{
+   struct mesh_export_header *header;
+   struct mesh_export *export;
+   struct stat st;
+
+   fd = dup(fd);
+   if (fd < 0)
+      return NULL;
+
+   if (fstat(fd, &st) || st.st_size < (off_t) MESH_EXPORT_HEADER_SIZE) {
+      close(fd);
+      return NULL;
+   }
+
+   export = export_map(fd, st.st_size, 0);
+   if (!export) {
+      close(fd);
+      return NULL;
+   }
+
+   header = export->header;
+   if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != MESH_EXPORT_MAGIC ||
+       header->version != MESH_EXPORT_VERSION || !header->slots ||
+       header->slot_size < header->tail_offset + sizeof (uint32_t) ||
+       header->tail_offset < header->indices_offset +
+                             sizeof (GLushort) * header->max_indices ||
+       header->indices_offset < header->vertices_offset +
+                                sizeof (GLfloat) * 4 * header->max_vertices ||
+       export->size < MESH_EXPORT_HEADER_SIZE + (size_t) header->slots * header->slot_size) {
+      mesh_export_destroy(export);
+      return NULL;
+   }
+
+   return export;
+}
+
+struct mesh_export *
+mesh_export_open(const char *name)
+{
+   struct mesh_export *export;
+   int fd;
+
+   fd = shm_open(name, O_RDONLY, 0);
+   if (fd < 0)
+      return NULL;
+
+   export = mesh_export_open_fd(fd);
+   close(fd);
+
+   return export;
+}
+
+int
+mesh_export_fd(struct mesh_export *export)
+{
+   return export->fd;
+}
+
+void
+mesh_export_destroy(struct mesh_export *export)
+{
+   if (!export)
+      return;
+
+   if (export->producer) {
+      __atomic_store_n(&export->header->closed, 1, __ATOMIC_RELEASE);
+      if (export->name)
+         shm_unlink(export->name);
+   }
+
+   munmap(export->header, export->size);
+   close(export->fd);
+   free(export->name);
+   free(export);
+}
+
+/*
+ * Write the surface as it stands into the next slot of the ring and
+ * make it the newest frame.  Indices are only rewritten when the
+ * slot last held a grid of other dimensions.  Returns 0 if the grid
+ * is larger than the export was made for.
+ */
+int
+mesh_export_publish(struct mesh_export *export, struct surface *surface)
+{
+   struct mesh_export_header *header = export->header;
+   struct wobbly_mesh_layout layout;
+   struct mesh_export_frame *frame;
+   uint32_t published, sequence;
+   char *base;
+   int count, indices;
+
+   count = wobbly_vertex_count(surface);
+   indices = surface->x_cells * surface->y_cells * 6;
+   if (count > (int) header->max_vertices || indices > (int) header->max_indices)
+      return 0;
+
+   published = __atomic_load_n(&header->published, __ATOMIC_RELAXED);
+   frame = export_slot(export, published % header->slots);
+   base = (char *) frame;
+
+   sequence = __atomic_load_n(&frame->sequence, __ATOMIC_RELAXED);
+   __atomic_store_n(&frame->sequence, sequence + 1, __ATOMIC_RELAXED);
+   __atomic_thread_fence(__ATOMIC_RELEASE);
+
+   frame->frame = published + 1;
+   frame->num_points = wobbly_control_points(surface,
+                                             (GLfloat *) (base + header->points_offset));
+
+   layout.position = base + header->vertices_offset;
+   layout.position_stride = sizeof (GLfloat) * 4;
+   layout.texcoord = base + header->vertices_offset + sizeof (GLfloat) * 2;
+   layout.texcoord_stride = sizeof (GLfloat) * 4;
+   frame->num_vertices = wobbly_write_geometry(surface, &layout, header->max_vertices);
+
+   if (frame->x_cells != surface->x_cells || frame->y_cells != surface->y_cells ||
+       frame->num_indices != indices) {
+      frame->x_cells = surface->x_cells;
+      frame->y_cells = surface->y_cells;
+      frame->num_indices = wobbly_write_indices(surface,
+                                                (GLushort *) (base + header->indices_offset),
+                                                header->max_indices);
+   }
+
+   wobbly_bounds(surface, &frame->bounds[0], &frame->bounds[1],
+                 &frame->bounds[2], &frame->bounds[3]);
+
+   *(uint32_t *) (base + header->tail_offset) = published + 1;
+
+   __atomic_store_n(&frame->sequence, sequence + 2, __ATOMIC_RELEASE);
+   __atomic_store_n(&header->published, published + 1, __ATOMIC_RELEASE);
+
+   return 1;
+}
+
+/*
+ * The newest frame, to be read in place, or NULL if nothing has been
+ * published.  Whatever is read from it only counts if
+ * mesh_export_end_read then says the frame wasn't rewritten meanwhile.
+ */
+const struct mesh_export_frame *
+mesh_export_begin_read(struct mesh_export *export, uint32_t *sequence)
+{
+   struct mesh_export_header *header = export->header;
+   struct mesh_export_frame *frame;
+   uint32_t published, s;
+   int tries;
+
+   for (tries = 0; tries < MESH_EXPORT_READ_TRIES; tries++) {
+      published = __atomic_load_n(&header->published, __ATOMIC_ACQUIRE);
+      if (!published)
+         return NULL;
+
+      frame = export_slot(export, (published - 1) % header->slots);
+      s = __atomic_load_n(&frame->sequence, __ATOMIC_ACQUIRE);
+      if (!(s & 1)) {
+         *sequence = s;
+         return frame;
+      }
+
+      /* Lapped: the producer is already back at the newest slot */
+      sched_yield();
+   }
+
+   return NULL;
+}
+
+int
+mesh_export_end_read(struct mesh_export *export, const struct mesh_export_frame *frame,
+                     uint32_t sequence)
+{
+   __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+   return __atomic_load_n(&frame->sequence, __ATOMIC_RELAXED) == sequence;
+}
+
+int
+mesh_export_closed(struct mesh_export *export)
+{
+   return __atomic_load_n(&export->header->closed, __ATOMIC_ACQUIRE);
+}
+
+const GLfloat *
+mesh_export_points(struct mesh_export *export, const struct mesh_export_frame *frame)
+{
+   return (const GLfloat *) ((const char *) frame + export->header->points_offset);
+}
+
+const GLfloat *
+mesh_export_vertices(struct mesh_export *export, const struct mesh_export_frame *frame)
+{
+   return (const GLfloat *) ((const char *) frame + export->header->vertices_offset);
+}
+
+const GLushort *
+mesh_export_indices(struct mesh_export *export, const struct mesh_export_frame *frame)
+{
+   return (const GLushort *) ((const char *) frame + export->header->indices_offset);
+}
+
+/* The frame number written last; differs from frame->frame when torn */
+uint32_t
+mesh_export_tail(struct mesh_export *export, const struct mesh_export_frame *frame)
+{
+   return *(const uint32_t *) ((const char *) frame + export->header->tail_offset);
+}
@@ -0,0 +1,77 @@
+/**************************************************************************
+ *
+ * Copyright 2014 Scott Moreau <oreaus@gmail.com>
+ * All Rights Reserved.
+ *
+ **************************************************************************/
+
+#include <stdint.h>
+
+#include <GLES2/gl2.h>
+
+/*
+ * A surface's control points and deformed mesh, published every frame
+ * into shared memory for other processes to draw from in place.
+ *
+ * The memory is a header followed by a ring of frame slots.  Each slot
+ * carries a sequence number that is odd while the producer rewrites
+ * it, seqlock style: a consumer notes the sequence, reads the frame
+ * where it lies, and keeps what it read only if the sequence hasn't
+ * moved since.  The producer never waits for consumers, and with a few
+ * slots in the ring a consumer has that many frames' time to finish
+ * before the slot it reads comes round again.
+ */
+#define MESH_EXPORT_MAGIC 0x594c4257    /* "WBLY" */
+#define MESH_EXPORT_VERSION 1
+#define MESH_EXPORT_SLOTS 4
+
+struct mesh_export_header {
+   uint32_t magic, version;
+   uint32_t slots, slot_size;          /* slot_size in bytes */
+   uint32_t max_vertices, max_indices;
+   /* Byte offsets of each array from the start of its slot */
+   uint32_t points_offset, vertices_offset, indices_offset, tail_offset;
+   uint32_t published;                 /* newest frame is in slot (published - 1) % slots */
+   uint32_t closed;                    /* set once the producer is gone */
+};
+
+struct mesh_export_frame {
+   uint32_t sequence;                  /* odd while being written */
+   uint32_t frame;                     /* also at tail_offset when whole */
+   int32_t x_cells, y_cells;
+   int32_t num_points;                 /* control points, x, y each */
+   int32_t num_vertices;               /* x, y, u, v each */
+   int32_t num_indices;                /* triangles, 16 bit */
+   float bounds[4];                    /* x1, y1, x2, y2 of everything drawn */
+};
+
+struct mesh_export;
+struct surface;
+
+struct mesh_export *
+mesh_export_create(const char *name, int max_vertices);
+struct mesh_export *
+mesh_export_open(const char *name);
+struct mesh_export *
+mesh_export_open_fd(int fd);
+int
+mesh_export_fd(struct mesh_export *export);
+void
+mesh_export_destroy(struct mesh_export *export);
+int
+mesh_export_publish(struct mesh_export *export, struct surface *surface);
+const struct mesh_export_frame *
+mesh_export_begin_read(struct mesh_export *export, uint32_t *sequence);
+int
+mesh_export_end_read(struct mesh_export *export, const struct mesh_export_frame *frame,
+                     uint32_t sequence);
+int
+mesh_export_closed(struct mesh_export *export);
+const GLfloat *
+mesh_export_points(struct mesh_export *export, const struct mesh_export_frame *frame);
+const GLfloat *
+mesh_export_vertices(struct mesh_export *export, const struct mesh_export_frame *frame);
+const GLushort *
+mesh_export_indices(struct mesh_export *export, const struct mesh_export_frame *frame);
+uint32_t
+mesh_export_tail(struct mesh_export *export, const struct mesh_export_frame *frame);
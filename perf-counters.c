@@ -0,0 +1,219 @@
+/**************************************************************************
+ *
+ * Copyright 2014 Scott Moreau <oreaus@gmail.com>
+ * All Rights Reserved.
+ *
+ **************************************************************************/
+
+/*
+ * Hardware counter instrumentation through Linux perf_event_open.
+ * Every stage call reads the whole counter group before and after and
+ * accumulates the difference, so nested stages (a stage inside the
+ * frame) are counted in both.  All functions accept a NULL handle and
+ * do nothing, so call sites need no checks when counting is off.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "perf-counters.h"
+
+static const char *stage_names[PERF_STAGE_COUNT] = {
+   [PERF_STAGE_PHYSICS]      = "physics",
+   [PERF_STAGE_TESSELLATION] = "tessellation",
+   [PERF_STAGE_INDICES]      = "indices",
+   [PERF_STAGE_UPLOAD]       = "upload",
+   [PERF_STAGE_FRAME]        = "frame",
+};
+
+static int
+open_event(uint32_t type, uint64_t config, int group)
+{
+   struct perf_event_attr attr;
+
+   memset(&attr, 0, sizeof (attr));
+   attr.size = sizeof (attr);
+   attr.type = type;
+   attr.config = config;
+   attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                      PERF_FORMAT_TOTAL_TIME_RUNNING;
+   attr.disabled = group == -1;
+   /* Counting our own user space code needs no privileges */
+   attr.exclude_kernel = 1;
+   attr.exclude_hv = 1;
+
+   return syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+struct perf_counters *
+perf_counters_create(void)
+{
+   static const struct {
+      uint32_t type;
+      uint64_t config;
+   } events[PERF_EVENT_COUNT] = {
+      [PERF_EVENT_CYCLES]        = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+      [PERF_EVENT_INSTRUCTIONS]  = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+      [PERF_EVENT_L1D_MISSES]    = { PERF_TYPE_HW_CACHE,
+                                     PERF_COUNT_HW_CACHE_L1D |
+                                     (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                     (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+      [PERF_EVENT_LLC_MISSES]    = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+      [PERF_EVENT_BRANCH_MISSES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+   };
+   struct perf_counters *perf;
+   int i;
+
+   perf = calloc(1, sizeof (*perf));
+   if (!perf)
+      return NULL;
+
+   perf->leader = open_event(events[0].type, events[0].config, -1);
+   if (perf->leader < 0) {
+      free(perf);
+      return NULL;
+   }
+
+   perf->fd[0] = perf->leader;
+   perf->slot[0] = 0;
+   perf->members = 1;
+
+   for (i = 1; i < PERF_EVENT_COUNT; i++) {
+      perf->fd[i] = open_event(events[i].type, events[i].config, perf->leader);
+      perf->slot[i] = perf->fd[i] < 0 ? -1 : perf->members++;
+   }
+
+   ioctl(perf->leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+   ioctl(perf->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+
+   return perf;
+}
+
+void
+perf_counters_destroy(struct perf_counters *perf)
+{
+   int i;
+
+   if (!perf)
+      return;
+
+   for (i = PERF_EVENT_COUNT - 1; i >= 0; i--)
+      if (perf->fd[i] >= 0)
+         close(perf->fd[i]);
+
+   free(perf);
+}
+
+/* Counts of the group, and how long it was enabled and running */
+static int
+read_group(struct perf_counters *perf, uint64_t *values, uint64_t *enabled,
+           uint64_t *running)
+{
+   /* nr, time enabled, time running, then a value per member */
+   uint64_t buf[3 + PERF_EVENT_COUNT];
+   int i;
+
+   if (read(perf->leader, buf, sizeof (uint64_t) * (3 + perf->members)) <= 0)
+      return 0;
+
+   for (i = 0; i < PERF_EVENT_COUNT; i++)
+      values[i] = perf->slot[i] >= 0 ? buf[3 + perf->slot[i]] : 0;
+   *enabled = buf[1];
+   *running = buf[2];
+
+   return 1;
+}
+
+void
+perf_stage_begin(struct perf_counters *perf, enum perf_stage stage)
+{
+   struct perf_stage_stats *stats;
+
+   if (!perf)
+      return;
+
+   stats = &perf->stages[stage];
+   read_group(perf, stats->begin, &stats->begin_enabled, &stats->begin_running);
+}
+
+void
+perf_stage_end(struct perf_counters *perf, enum perf_stage stage)
+{
+   struct perf_stage_stats *stats;
+   uint64_t now[PERF_EVENT_COUNT], enabled, running;
+   double scale;
+   int i;
+
+   if (!perf || !read_group(perf, now, &enabled, &running))
+      return;
+
+   stats = &perf->stages[stage];
+   enabled -= stats->begin_enabled;
+   running -= stats->begin_running;
+
+   /* Extrapolate to the whole stage what was counted of it */
+   scale = running && running < enabled ? (double) enabled / running : 1.0;
+   for (i = 0; i < PERF_EVENT_COUNT; i++)
+      stats->count[i] += (now[i] - stats->begin[i]) * scale;
+   stats->enabled += enabled;
+   stats->running += running;
+   stats->calls++;
+
+   if (stage == PERF_STAGE_FRAME)
+      perf->frames++;
+}
+
+static void
+print_count(FILE *out, struct perf_counters *perf, struct perf_stage_stats *stats,
+            enum perf_event event, unsigned int frames)
+{
+   if (perf->slot[event] < 0)
+      fprintf(out, " %12s", "n/a");
+   else
+      fprintf(out, " %12.0f", (double) stats->count[event] / frames);
+}
+
+/* Per stage totals, averaged over the frames that were counted */
+void
+perf_counters_report(struct perf_counters *perf, FILE *out)
+{
+   unsigned int frames;
+   int i;
+
+   if (!perf)
+      return;
+
+   frames = perf->frames ? perf->frames : 1;
+
+   fprintf(out, "hardware counters, per frame over %u frames:\n", perf->frames);
+   fprintf(out, "  %-13s %6s %12s %12s %6s %12s %12s %12s\n",
+           "stage", "calls", "cycles", "instructions", "IPC",
+           "L1D misses", "LLC misses", "br misses");
+
+   for (i = 0; i < PERF_STAGE_COUNT; i++) {
+      struct perf_stage_stats *stats = &perf->stages[i];
+
+      if (!stats->calls)
+         continue;
+
+      fprintf(out, "  %-13s %6u", stage_names[i], stats->calls);
+      print_count(out, perf, stats, PERF_EVENT_CYCLES, frames);
+      print_count(out, perf, stats, PERF_EVENT_INSTRUCTIONS, frames);
+      if (perf->slot[PERF_EVENT_INSTRUCTIONS] >= 0 && stats->count[PERF_EVENT_CYCLES])
+         fprintf(out, " %6.2f", (double) stats->count[PERF_EVENT_INSTRUCTIONS] /
+                                stats->count[PERF_EVENT_CYCLES]);
+      else
+         fprintf(out, " %6s", "n/a");
+      print_count(out, perf, stats, PERF_EVENT_L1D_MISSES, frames);
+      print_count(out, perf, stats, PERF_EVENT_LLC_MISSES, frames);
+      print_count(out, perf, stats, PERF_EVENT_BRANCH_MISSES, frames);
+      if (stats->running < stats->enabled)
+         fprintf(out, "  scaled, counted %.0f%%",
+                 stats->enabled ? 100.0 * stats->running / stats->enabled : 0.0);
+      fprintf(out, "\n");
+   }
+}
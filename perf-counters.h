@@ -0,0 +1,66 @@
+/**************************************************************************
+ *
+ * Copyright 2014 Scott Moreau <oreaus@gmail.com>
+ * All Rights Reserved.
+ *
+ **************************************************************************/
+
+#include <stdio.h>
+#include <stdint.h>
+
+enum perf_stage {
+   PERF_STAGE_PHYSICS,
+   PERF_STAGE_TESSELLATION,
+   PERF_STAGE_INDICES,
+   PERF_STAGE_UPLOAD,
+   PERF_STAGE_FRAME,
+   PERF_STAGE_COUNT
+};
+
+enum perf_event {
+   PERF_EVENT_CYCLES,
+   PERF_EVENT_INSTRUCTIONS,
+   PERF_EVENT_L1D_MISSES,
+   PERF_EVENT_LLC_MISSES,
+   PERF_EVENT_BRANCH_MISSES,
+   PERF_EVENT_COUNT
+};
+
+/*
+ * When the PMU has more events to count than counters, the kernel
+ * multiplexes groups and a stage's counts only cover the time the group
+ * was running.  They are scaled up by enabled / running, and the
+ * report says how much of the time was actually counted.
+ */
+struct perf_stage_stats {
+   uint64_t count[PERF_EVENT_COUNT];
+   uint64_t begin[PERF_EVENT_COUNT];
+   uint64_t begin_enabled, begin_running;
+   uint64_t enabled, running;    /* ns, summed over calls */
+   unsigned int calls;
+};
+
+/*
+ * One counter group per thread: all events are scheduled on the PMU
+ * together, so the ratios between them (IPC, misses per instruction)
+ * stay meaningful.  Members the CPU doesn't support are left out.
+ */
+struct perf_counters {
+   int leader;
+   int fd[PERF_EVENT_COUNT];
+   int slot[PERF_EVENT_COUNT];   /* position in a group read, or -1 */
+   int members;
+   unsigned int frames;
+   struct perf_stage_stats stages[PERF_STAGE_COUNT];
+};
+
+struct perf_counters *
+perf_counters_create(void);
+void
+perf_counters_destroy(struct perf_counters *perf);
+void
+perf_stage_begin(struct perf_counters *perf, enum perf_stage stage);
+void
+perf_stage_end(struct perf_counters *perf, enum perf_stage stage);
+void
+perf_counters_report(struct perf_counters *perf, FILE *out);
@@ -0,0 +1,275 @@
+/**************************************************************************
+ *
+ * Copyright 2014 Scott Moreau <oreaus@gmail.com>
+ * All Rights Reserved.
+ *
+ **************************************************************************/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "predict.h"
+
+/* Samples older than this relative to the newest don't shape velocity */
+#define PREDICT_WINDOW_MS 50.0
+/* Never extrapolate further ahead than this */
+#define PREDICT_MAX_LEAD_MS 32.0
+/* Nor further than this many pixels */
+#define PREDICT_MAX_OFFSET 48.0
+/* No motion for this long means the pointer stopped */
+#define PREDICT_STOP_MS 40.0
+/* Fraction of the way the offset moves toward a new estimate per frame */
+#define PREDICT_EASE 0.5
+
+void
+predictor_reset(struct pointer_predictor *predictor)
+{
+   memset(predictor, 0, sizeof (*predictor));
+}
+
+void
+predictor_add_sample(struct pointer_predictor *predictor, double t, double x, double y)
+{
+   struct pointer_sample *sample = &predictor->samples[predictor->next];
+
+   sample->t = t;
+   sample->x = x;
+   sample->y = y;
+
+   predictor->next = (predictor->next + 1) % PREDICT_HISTORY;
+   if (predictor->count < PREDICT_HISTORY)
+      predictor->count++;
+}
+
+static const struct pointer_sample *
+sample_at(struct pointer_predictor *predictor, int age)
+{
+   return &predictor->samples[(predictor->next - 1 - age + PREDICT_HISTORY) %
+                              PREDICT_HISTORY];
+}
+
+/* Least-squares slope of position over time, in pixels per ms */
+static int
+fit_velocity(struct pointer_predictor *predictor, double *vx, double *vy)
+{
+   const struct pointer_sample *newest = sample_at(predictor, 0);
+   double mt = 0, mx = 0, my = 0, stt = 0, stx = 0, sty = 0;
+   int i, n = 0;
+
+   for (i = 0; i < predictor->count; i++) {
+      const struct pointer_sample *s = sample_at(predictor, i);
+
+      if (newest->t - s->t > PREDICT_WINDOW_MS)
+         break;
+      mt += s->t;
+      mx += s->x;
+      my += s->y;
+      n++;
+   }
+
+   if (n < 2)
+      return 0;
+
+   mt /= n;
+   mx /= n;
+   my /= n;
+
+   for (i = 0; i < n; i++) {
+      const struct pointer_sample *s = sample_at(predictor, i);
+      double dt = s->t - mt;
+
+      stt += dt * dt;
+      stx += dt * (s->x - mx);
+      sty += dt * (s->y - my);
+   }
+
+   if (stt < 1e-6)
+      return 0;
+
+   *vx = stx / stt;
+   *vy = sty / stt;
+
+   return 1;
+}
+
+/*
+ * Where the pointer should be at target, given what is known at now.
+ * Returns 0 and the newest sample if there is nothing to go on.
+ */
+int
+predictor_estimate(struct pointer_predictor *predictor, double now, double target,
+                   double *x, double *y)
+{
+   const struct pointer_sample *newest;
+   double vx, vy, lead, dx, dy, d;
+
+   if (!predictor->count) {
+      *x = *y = 0;
+      return 0;
+   }
+
+   newest = sample_at(predictor, 0);
+   *x = newest->x;
+   *y = newest->y;
+
+   if (now - newest->t > PREDICT_STOP_MS || !fit_velocity(predictor, &vx, &vy))
+      return 0;
+
+   lead = target - newest->t;
+   if (lead <= 0)
+      return 0;
+   if (lead > PREDICT_MAX_LEAD_MS)
+      lead = PREDICT_MAX_LEAD_MS;
+
+   dx = vx * lead;
+   dy = vy * lead;
+   d = sqrt(dx * dx + dy * dy);
+   if (d > PREDICT_MAX_OFFSET) {
+      dx *= PREDICT_MAX_OFFSET / d;
+      dy *= PREDICT_MAX_OFFSET / d;
+   }
+
+   *x += dx;
+   *y += dy;
+
+   return 1;
+}
+
+/*
+ * Ease the offset from the newest sample toward the current estimate,
+ * once per frame, and return it.  A stopped pointer eases back to 0.
+ */
+void
+predictor_update_offset(struct pointer_predictor *predictor, double now,
+                        double target, double *dx, double *dy)
+{
+   const struct pointer_sample *newest;
+   double x, y;
+
+   if (!predictor->count) {
+      *dx = *dy = 0;
+      return;
+   }
+
+   newest = sample_at(predictor, 0);
+   predictor_estimate(predictor, now, target, &x, &y);
+
+   predictor->offset_x += (x - newest->x - predictor->offset_x) * PREDICT_EASE;
+   predictor->offset_y += (y - newest->y - predictor->offset_y) * PREDICT_EASE;
+
+   *dx = predictor->offset_x;
+   *dy = predictor->offset_y;
+}
+
+/* Motion logs are "t x y" lines, as written by wobbly -record-motion */
+int
+predictor_load_samples(const char *path, struct pointer_sample **samples)
+{
+   struct pointer_sample *buf = NULL, *s;
+   int count = 0, capacity = 0;
+   FILE *fp;
+
+   fp = fopen(path, "r");
+   if (!fp)
+      return -1;
+
+   for (;;) {
+      if (count == capacity) {
+         capacity = capacity ? capacity * 2 : 1024;
+         s = realloc(buf, sizeof (*buf) * capacity);
+         if (!s) {
+            free(buf);
+            fclose(fp);
+            return -1;
+         }
+         buf = s;
+      }
+      s = &buf[count];
+      if (fscanf(fp, "%lf %lf %lf", &s->t, &s->x, &s->y) != 3)
+         break;
+      count++;
+   }
+
+   fclose(fp);
+   *samples = buf;
+
+   return count;
+}
+
+static void
+add_error(struct predict_error *error, double dx, double dy)
+{
+   double d = sqrt(dx * dx + dy * dy);
+
+   error->frames++;
+   error->mean += d;
+   error->rms += d * d;
+   if (d > error->max)
+      error->max = d;
+}
+
+static void
+finish_error(struct predict_error *error)
+{
+   if (!error->frames)
+      return;
+
+   error->mean /= error->frames;
+   error->rms = sqrt(error->rms / error->frames);
+}
+
+/*
+ * Play recorded motion back at frame_ms intervals, the way the demo
+ * samples it, and compare what each frame would show lead_ms later
+ * with where the pointer really was then.  The unpredicted error is
+ * that of showing the newest sample, as the demo does without
+ * prediction.  Long pauses start a new drag.
+ */
+void
+predictor_replay(const struct pointer_sample *samples, int count, double frame_ms,
+                 double lead_ms, struct predict_error *predicted,
+                 struct predict_error *unpredicted)
+{
+   struct pointer_predictor predictor;
+   double now, target, dx, dy, x, y, f;
+   int i = 0, j = 0;
+
+   memset(predicted, 0, sizeof (*predicted));
+   memset(unpredicted, 0, sizeof (*unpredicted));
+
+   if (count < 2)
+      return;
+
+   predictor_reset(&predictor);
+
+   for (now = samples[0].t; now + lead_ms <= samples[count - 1].t; now += frame_ms) {
+      for (; i < count && samples[i].t <= now; i++) {
+         if (i && samples[i].t - samples[i - 1].t > PREDICT_STOP_MS * 4)
+            predictor_reset(&predictor);
+         predictor_add_sample(&predictor, samples[i].t, samples[i].x, samples[i].y);
+      }
+
+      predictor_update_offset(&predictor, now, now + lead_ms, &dx, &dy);
+
+      /* Where the pointer really was when this frame got on screen */
+      target = now + lead_ms;
+      while (j + 1 < count && samples[j + 1].t < target)
+         j++;
+      f = samples[j + 1].t > samples[j].t ?
+          (target - samples[j].t) / (samples[j + 1].t - samples[j].t) : 0;
+      if (f < 0)
+         f = 0;
+      else if (f > 1)
+         f = 1;
+      x = samples[j].x + (samples[j + 1].x - samples[j].x) * f;
+      y = samples[j].y + (samples[j + 1].y - samples[j].y) * f;
+
+      add_error(predicted, samples[i - 1].x + dx - x, samples[i - 1].y + dy - y);
+      add_error(unpredicted, samples[i - 1].x - x, samples[i - 1].y - y);
+   }
+
+   finish_error(predicted);
+   finish_error(unpredicted);
+}
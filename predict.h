@@ -0,0 +1,47 @@
+/**************************************************************************
+ *
+ * Copyright 2014 Scott Moreau <oreaus@gmail.com>
+ * All Rights Reserved.
+ *
+ **************************************************************************/
+
+#define PREDICT_HISTORY 16
+
+struct pointer_sample {
+   double t;         /* milliseconds */
+   double x, y;
+};
+
+/*
+ * Extrapolates the pointer to the time a frame will be presented.
+ * Velocity is a least-squares fit over the recent samples; the lead
+ * time and the distance ahead are clamped so flicks don't overshoot,
+ * and the offset eases toward each new estimate instead of jumping.
+ */
+struct pointer_predictor {
+   struct pointer_sample samples[PREDICT_HISTORY];
+   int count, next;
+   double offset_x, offset_y;    /* smoothed offset from the last sample */
+};
+
+struct predict_error {
+   unsigned int frames;
+   double mean, rms, max;
+};
+
+void
+predictor_reset(struct pointer_predictor *predictor);
+void
+predictor_add_sample(struct pointer_predictor *predictor, double t, double x, double y);
+int
+predictor_estimate(struct pointer_predictor *predictor, double now, double target,
+                   double *x, double *y);
+void
+predictor_update_offset(struct pointer_predictor *predictor, double now,
+                        double target, double *dx, double *dy);
+int
+predictor_load_samples(const char *path, struct pointer_sample **samples);
+void
+predictor_replay(const struct pointer_sample *samples, int count, double frame_ms,
+                 double lead_ms, struct predict_error *predicted,
+                 struct predict_error *unpredicted);
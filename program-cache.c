@@ -0,0 +1,205 @@
+/**************************************************************************
+ *
+ * Copyright 2014 Scott Moreau <oreaus@gmail.com>
+ * All Rights Reserved.
+ *
+ **************************************************************************/
+
+/*
+ * On-disk cache of linked shader programs through OES_get_program_binary.
+ * Entries are keyed by a hash of the driver strings and the shader sources,
+ * so a driver update or a shader edit simply misses and recompiles.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <EGL/egl.h>
+
+#include "program-cache.h"
+
+#define CACHE_MAGIC 0x57425043   /* "WBPC" */
+
+struct cache_header {
+   unsigned int magic;
+   unsigned int format;
+   unsigned long long key;
+   double compile_ms;
+   int length;
+};
+
+/* 64-bit FNV-1a, folded over several strings */
+static unsigned long long
+hash_string(unsigned long long hash, const char *s)
+{
+   if (!s)
+      s = "";
+
+   for (; *s; s++) {
+      hash ^= (unsigned char) *s;
+      hash *= 0x100000001b3ULL;
+   }
+
+   /* Separator so "ab" + "c" differs from "a" + "bc" */
+   hash ^= 0xff;
+   hash *= 0x100000001b3ULL;
+
+   return hash;
+}
+
+static int
+make_cache_dir(char *path, size_t size)
+{
+   const char *base = getenv("XDG_CACHE_HOME");
+   char parent[PATH_MAX];
+
+   if (base && *base) {
+      snprintf(path, size, "%s/wobbly", base);
+   } else {
+      base = getenv("HOME");
+      if (!base || !*base)
+         return 0;
+      snprintf(parent, sizeof (parent), "%s/.cache", base);
+      mkdir(parent, 0700);
+      snprintf(path, size, "%s/.cache/wobbly", base);
+   }
+
+   mkdir(path, 0700);
+
+   return 1;
+}
+
+/*
+ * Returns 0 when the driver can't hand out program binaries, in which
+ * case the cache must not be used.  Needs a current context.
+ */
+int
+program_cache_init(struct program_cache *cache,
+                   const char *vert_source, const char *frag_source)
+{
+   const char *extensions = (const char *) glGetString(GL_EXTENSIONS);
+   char dir[PATH_MAX - 64];
+   GLint formats = 0;
+   unsigned long long key = 0xcbf29ce484222325ULL;
+
+   if (!extensions || !strstr(extensions, "GL_OES_get_program_binary"))
+      return 0;
+
+   glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS_OES, &formats);
+   if (formats <= 0)
+      return 0;
+
+   cache->get_binary = (PFNGLGETPROGRAMBINARYOESPROC)
+      eglGetProcAddress("glGetProgramBinaryOES");
+   cache->load_binary = (PFNGLPROGRAMBINARYOESPROC)
+      eglGetProcAddress("glProgramBinaryOES");
+   if (!cache->get_binary || !cache->load_binary)
+      return 0;
+
+   key = hash_string(key, (const char *) glGetString(GL_VENDOR));
+   key = hash_string(key, (const char *) glGetString(GL_RENDERER));
+   key = hash_string(key, (const char *) glGetString(GL_VERSION));
+   key = hash_string(key, vert_source);
+   key = hash_string(key, frag_source);
+   cache->key = key;
+
+   if (!make_cache_dir(dir, sizeof (dir)))
+      return 0;
+
+   snprintf(cache->path, sizeof (cache->path), "%s/program-%016llx.bin",
+            dir, key);
+
+   return 1;
+}
+
+/*
+ * Load the cached binary into program.  On success the link time that
+ * was recorded with the entry is returned through compile_ms.
+ */
+int
+program_cache_load(struct program_cache *cache, GLuint program,
+                   double *compile_ms)
+{
+   struct cache_header header;
+   GLint stat = 0;
+   void *binary;
+   FILE *fp;
+
+   fp = fopen(cache->path, "rb");
+   if (!fp)
+      return 0;
+
+   if (fread(&header, sizeof (header), 1, fp) != 1 ||
+       header.magic != CACHE_MAGIC || header.key != cache->key ||
+       header.length <= 0) {
+      fclose(fp);
+      return 0;
+   }
+
+   binary = malloc(header.length);
+   if (!binary || fread(binary, header.length, 1, fp) != 1) {
+      free(binary);
+      fclose(fp);
+      return 0;
+   }
+   fclose(fp);
+
+   cache->load_binary(program, header.format, binary, header.length);
+   free(binary);
+
+   /* Drivers reject stale binaries by failing the link */
+   glGetProgramiv(program, GL_LINK_STATUS, &stat);
+   if (!stat) {
+      remove(cache->path);
+      return 0;
+   }
+
+   *compile_ms = header.compile_ms;
+
+   return 1;
+}
+
+void
+program_cache_store(struct program_cache *cache, GLuint program,
+                    double compile_ms)
+{
+   struct cache_header header;
+   char tmp[PATH_MAX + 8];
+   GLint length = 0;
+   void *binary;
+   FILE *fp;
+   int ok;
+
+   glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH_OES, &length);
+   if (length <= 0)
+      return;
+
+   binary = malloc(length);
+   if (!binary)
+      return;
+
+   memset(&header, 0, sizeof (header));
+   header.magic = CACHE_MAGIC;
+   header.key = cache->key;
+   header.compile_ms = compile_ms;
+   cache->get_binary(program, length, &header.length, &header.format, binary);
+
+   /* Write beside the entry and rename, so a concurrent launch never
+    * reads a half written file */
+   snprintf(tmp, sizeof (tmp), "%s.tmp", cache->path);
+   fp = fopen(tmp, "wb");
+   if (fp) {
+      ok = header.length > 0 &&
+           fwrite(&header, sizeof (header), 1, fp) == 1 &&
+           fwrite(binary, header.length, 1, fp) == 1;
+      if (fclose(fp) != 0)
+         ok = 0;
+      if (ok)
+         rename(tmp, cache->path);
+      else
+         remove(tmp);
+   }
+
+   free(binary);
+}
@@ -0,0 +1,28 @@
+/**************************************************************************
+ *
+ * Copyright 2014 Scott Moreau <oreaus@gmail.com>
+ * All Rights Reserved.
+ *
+ **************************************************************************/
+
+#include <limits.h>
+
+#include <GLES2/gl2.h>
+#include <GLES2/gl2ext.h>
+
+struct program_cache {
+   char path[PATH_MAX];
+   unsigned long long key;
+   PFNGLGETPROGRAMBINARYOESPROC get_binary;
+   PFNGLPROGRAMBINARYOESPROC load_binary;
+};
+
+int
+program_cache_init(struct program_cache *cache,
+                   const char *vert_source, const char *frag_source);
+int
+program_cache_load(struct program_cache *cache, GLuint program,
+                   double *compile_ms);
+void
+program_cache_store(struct program_cache *cache, GLuint program,
+                    double compile_ms);
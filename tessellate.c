@@ -0,0 +1,63 @@
+/**************************************************************************
+ *
+ * Copyright 2014 Scott Moreau <oreaus@gmail.com>
+ * All Rights Reserved.
+ *
+ **************************************************************************/
+
+#include "wobbly.h"
+#include "worker-pool.h"
+#include "tessellate.h"
+
+/* Fewer vertices than this are quicker to write than to hand out */
+#define TESS_PARALLEL_MIN_VERTICES 8192
+/* Slices per thread, so a preempted thread's share gets picked up */
+#define TESS_SLICES_PER_THREAD 2
+
+struct tess_batch {
+   struct surface *surface;
+   const struct wobbly_mesh_layout *layout;
+   int capacity, rows, slices;
+};
+
+static void
+tessellate_slice(void *data, int slice)
+{
+   struct tess_batch *batch = data;
+   int first = batch->rows * slice / batch->slices;
+   int last = batch->rows * (slice + 1) / batch->slices;
+
+   wobbly_write_geometry_rows(batch->surface, batch->layout, batch->capacity,
+                              first, last - first);
+}
+
+/*
+ * wobbly_write_geometry with the rows of the grid split between the
+ * pool's threads, each writing its own slice of the output.  Small
+ * grids, and any without a pool, are written by the calling thread.
+ */
+int
+tessellate_parallel(struct worker_pool *pool, struct surface *surface,
+                    const struct wobbly_mesh_layout *layout, int capacity)
+{
+   struct tess_batch batch;
+   int count = wobbly_vertex_count(surface);
+
+   if (!pool || worker_pool_threads(pool) < 2 || count < TESS_PARALLEL_MIN_VERTICES)
+      return wobbly_write_geometry(surface, layout, capacity);
+
+   if (count > capacity)
+      return 0;
+
+   batch.surface = surface;
+   batch.layout = layout;
+   batch.capacity = capacity;
+   batch.rows = surface->y_cells + 1;
+   batch.slices = worker_pool_threads(pool) * TESS_SLICES_PER_THREAD;
+   if (batch.slices > batch.rows)
+      batch.slices = batch.rows;
+
+   worker_pool_run(pool, tessellate_slice, &batch, batch.slices);
+
+   return count;
+}
@@ -0,0 +1,14 @@
+/**************************************************************************
+ *
+ * Copyright 2014 Scott Moreau <oreaus@gmail.com>
+ * All Rights Reserved.
+ *
+ **************************************************************************/
+
+struct surface;
+struct wobbly_mesh_layout;
+struct worker_pool;
+
+int
+tessellate_parallel(struct worker_pool *pool, struct surface *surface,
+                    const struct wobbly_mesh_layout *layout, int capacity);
@@ -0,0 +1,238 @@
+/**************************************************************************
+ *
+ * Copyright 2014 Scott Moreau <oreaus@gmail.com>
+ * All Rights Reserved.
+ *
+ **************************************************************************/
+
+/*
+ * Stream an image sequence into a surface texture.  A background thread
+ * decodes numbered png frames into a small ring of reusable buffers and
+ * publishes each one at its due time; the renderer only ever uploads the
+ * newest completed frame.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "texture-stream.h"
+#include "image-loader.h"
+#include "trace.h"
+
+static double
+elapsed_ms(struct timeval *start)
+{
+   struct timeval now;
+
+   gettimeofday(&now, NULL);
+
+   return (now.tv_sec - start->tv_sec) * 1000.0 +
+          (now.tv_usec - start->tv_usec) / 1000.0;
+}
+
+/* The pattern is handed to snprintf, so allow exactly one integer
+ * conversion such as %d or %04d and nothing else. */
+static int
+valid_pattern(const char *pattern)
+{
+   const char *p;
+   int conversions = 0;
+
+   for (p = pattern; *p; p++) {
+      if (*p != '%')
+         continue;
+      if (*++p == '%')
+         continue;
+      while (*p >= '0' && *p <= '9')
+         p++;
+      if (*p != 'd')
+         return 0;
+      conversions++;
+   }
+
+   return conversions == 1;
+}
+
+static int
+frame_exists(const char *pattern, int index)
+{
+   char name[1024];
+
+   snprintf(name, sizeof (name), pattern, index);
+
+   return access(name, R_OK) == 0;
+}
+
+/* Sleep until the frame is due, waking early if the stream stops */
+static void
+wait_until(struct texture_stream *stream, double due)
+{
+   struct timespec ts;
+   double ms;
+
+   ms = stream->start.tv_sec * 1000.0 + stream->start.tv_usec / 1000.0 + due;
+   ts.tv_sec = (time_t) (ms / 1000.0);
+   ts.tv_nsec = (long) ((ms - ts.tv_sec * 1000.0) * 1000000.0);
+
+   pthread_mutex_lock(&stream->mutex);
+   while (stream->running &&
+          pthread_cond_timedwait(&stream->cond, &stream->mutex, &ts) != ETIMEDOUT)
+      ;
+   pthread_mutex_unlock(&stream->mutex);
+}
+
+static void *
+decode_thread(void *data)
+{
+   struct texture_stream *stream = data;
+   struct texture_frame *frame;
+   char name[1024];
+   double due;
+   int n, slot, late, ok;
+
+   trace_thread_name("stream decoder");
+
+   for (n = 0; ; n++) {
+      pthread_mutex_lock(&stream->mutex);
+      if (!stream->running) {
+         pthread_mutex_unlock(&stream->mutex);
+         break;
+      }
+      /* Any slot neither waiting nor on screen is ours */
+      for (slot = 0; slot == stream->ready || slot == stream->displayed; slot++)
+         ;
+      pthread_mutex_unlock(&stream->mutex);
+
+      frame = &stream->frames[slot];
+      due = n * stream->frame_ms;
+      snprintf(name, sizeof (name), stream->pattern, n % stream->frame_count);
+      trace_begin("stream decode");
+      ok = loadPngImageReuse(name, &frame->width, &frame->height,
+                             &frame->format, &frame->data, &frame->capacity);
+      trace_end("stream decode");
+      if (!ok) {
+         pthread_mutex_lock(&stream->mutex);
+         stream->stats.errors++;
+         pthread_mutex_unlock(&stream->mutex);
+         wait_until(stream, due);
+         continue;
+      }
+      frame->index = n;
+
+      late = elapsed_ms(&stream->start) > due;
+      if (!late)
+         wait_until(stream, due);
+
+      pthread_mutex_lock(&stream->mutex);
+      stream->stats.decoded++;
+      stream->stats.late += late;
+      if (stream->ready >= 0)
+         stream->stats.dropped++;
+      stream->ready = slot;
+      pthread_mutex_unlock(&stream->mutex);
+   }
+
+   return NULL;
+}
+
+struct texture_stream *
+texture_stream_create(const char *pattern, double fps)
+{
+   struct texture_stream *stream;
+
+   if (!valid_pattern(pattern) || fps <= 0.0) {
+      printf("Error: stream pattern needs one %%d conversion and fps > 0\n");
+      return NULL;
+   }
+
+   stream = calloc(1, sizeof (*stream));
+   if (!stream)
+      return NULL;
+
+   while (frame_exists(pattern, stream->frame_count))
+      stream->frame_count++;
+
+   if (!stream->frame_count) {
+      printf("Error: no frames found for %s\n", pattern);
+      free(stream);
+      return NULL;
+   }
+
+   stream->pattern = strdup(pattern);
+   stream->frame_ms = 1000.0 / fps;
+   stream->ready = -1;
+   stream->displayed = -1;
+   stream->running = 1;
+
+   pthread_mutex_init(&stream->mutex, NULL);
+   pthread_cond_init(&stream->cond, NULL);
+   gettimeofday(&stream->start, NULL);
+
+   if (pthread_create(&stream->thread, NULL, decode_thread, stream)) {
+      stream->running = 0;
+      texture_stream_destroy(stream);
+      return NULL;
+   }
+
+   return stream;
+}
+
+void
+texture_stream_destroy(struct texture_stream *stream)
+{
+   int i;
+
+   if (!stream)
+      return;
+
+   pthread_mutex_lock(&stream->mutex);
+   if (stream->running) {
+      stream->running = 0;
+      pthread_cond_broadcast(&stream->cond);
+      pthread_mutex_unlock(&stream->mutex);
+      pthread_join(stream->thread, NULL);
+   } else {
+      pthread_mutex_unlock(&stream->mutex);
+   }
+
+   for (i = 0; i < TEXTURE_STREAM_SLOTS; i++)
+      free(stream->frames[i].data);
+
+   pthread_mutex_destroy(&stream->mutex);
+   pthread_cond_destroy(&stream->cond);
+   free(stream->pattern);
+   free(stream);
+}
+
+/*
+ * Take the newest completed frame, or NULL if nothing new arrived since
+ * the last call.  The frame stays valid until the next call.
+ */
+struct texture_frame *
+texture_stream_acquire(struct texture_stream *stream)
+{
+   struct texture_frame *frame = NULL;
+
+   pthread_mutex_lock(&stream->mutex);
+   if (stream->ready >= 0) {
+      stream->displayed = stream->ready;
+      stream->ready = -1;
+      stream->stats.displayed++;
+      frame = &stream->frames[stream->displayed];
+   }
+   pthread_mutex_unlock(&stream->mutex);
+
+   return frame;
+}
+
+void
+texture_stream_get_stats(struct texture_stream *stream,
+                         struct texture_stream_stats *stats)
+{
+   pthread_mutex_lock(&stream->mutex);
+   *stats = stream->stats;
+   pthread_mutex_unlock(&stream->mutex);
+}
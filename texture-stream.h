@@ -0,0 +1,54 @@
+/**************************************************************************
+ *
+ * Copyright 2014 Scott Moreau <oreaus@gmail.com>
+ * All Rights Reserved.
+ *
+ **************************************************************************/
+
+#include <pthread.h>
+#include <sys/time.h>
+
+/* Three slots let the decoder fill one while another waits to be
+ * picked up and the renderer still reads from the third. */
+#define TEXTURE_STREAM_SLOTS 3
+
+struct texture_frame {
+   void *data;
+   int capacity;
+   int width, height, format;
+   int index;
+};
+
+struct texture_stream_stats {
+   unsigned int decoded;
+   unsigned int displayed;
+   unsigned int dropped;   /* replaced before the renderer picked them up */
+   unsigned int late;      /* finished decoding after their due time */
+   unsigned int errors;
+};
+
+struct texture_stream {
+   char *pattern;
+   int frame_count;
+   double frame_ms;
+   struct timeval start;
+
+   pthread_t thread;
+   pthread_mutex_t mutex;
+   pthread_cond_t cond;
+   int running;
+
+   struct texture_frame frames[TEXTURE_STREAM_SLOTS];
+   int ready, displayed;
+   struct texture_stream_stats stats;
+};
+
+struct texture_stream *
+texture_stream_create(const char *pattern, double fps);
+void
+texture_stream_destroy(struct texture_stream *stream);
+struct texture_frame *
+texture_stream_acquire(struct texture_stream *stream);
+void
+texture_stream_get_stats(struct texture_stream *stream,
+                         struct texture_stream_stats *stats);
@@ -0,0 +1,199 @@
+/**************************************************************************
+ *
+ * Copyright 2014 Scott Moreau <oreaus@gmail.com>
+ * All Rights Reserved.
+ *
+ **************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+
+/* 32 bytes each, so 2 MiB per traced thread */
+#define TRACE_BUFFER_EVENTS (1 << 16)
+
+struct trace_event {
+   const char *name;
+   long long value;
+   double ts;        /* microseconds since trace_init */
+   char phase;       /* 'B'egin, 'E'nd or 'C'ounter */
+};
+
+struct trace_buffer {
+   struct trace_buffer *next;
+   const char *thread_name;
+   int tid;
+   unsigned int count;     /* published with release stores */
+   unsigned int dropped;
+   struct trace_event events[TRACE_BUFFER_EVENTS];
+};
+
+static int enabled;
+static char *trace_path;
+static struct timespec trace_t0;
+
+/* Buffers are only ever pushed, never removed, until exit */
+static struct trace_buffer *buffers;
+static __thread struct trace_buffer *thread_buffer;
+
+static double
+trace_now(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+
+   return (ts.tv_sec - trace_t0.tv_sec) * 1000000.0 +
+          (ts.tv_nsec - trace_t0.tv_nsec) / 1000.0;
+}
+
+static struct trace_buffer *
+get_buffer(void)
+{
+   struct trace_buffer *buffer = thread_buffer;
+
+   if (buffer)
+      return buffer;
+
+   buffer = calloc(1, sizeof (*buffer));
+   if (!buffer)
+      return NULL;
+
+   buffer->tid = syscall(SYS_gettid);
+
+   buffer->next = __atomic_load_n(&buffers, __ATOMIC_RELAXED);
+   while (!__atomic_compare_exchange_n(&buffers, &buffer->next, buffer, 1,
+                                       __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      ;
+
+   thread_buffer = buffer;
+
+   return buffer;
+}
+
+static void
+record(const char *name, char phase, long long value)
+{
+   struct trace_buffer *buffer;
+   struct trace_event *event;
+
+   if (!enabled || !(buffer = get_buffer()))
+      return;
+
+   if (buffer->count == TRACE_BUFFER_EVENTS) {
+      buffer->dropped++;
+      return;
+   }
+
+   event = &buffer->events[buffer->count];
+   event->name = name;
+   event->phase = phase;
+   event->value = value;
+   event->ts = trace_now();
+
+   __atomic_store_n(&buffer->count, buffer->count + 1, __ATOMIC_RELEASE);
+}
+
+int
+trace_init(const char *path)
+{
+   trace_path = strdup(path);
+   if (!trace_path)
+      return 0;
+
+   clock_gettime(CLOCK_MONOTONIC, &trace_t0);
+   enabled = 1;
+
+   return 1;
+}
+
+void
+trace_thread_name(const char *name)
+{
+   struct trace_buffer *buffer;
+
+   if (enabled && (buffer = get_buffer()))
+      buffer->thread_name = name;
+}
+
+void
+trace_begin(const char *name)
+{
+   record(name, 'B', 0);
+}
+
+void
+trace_end(const char *name)
+{
+   record(name, 'E', 0);
+}
+
+void
+trace_counter(const char *name, long long value)
+{
+   record(name, 'C', value);
+}
+
+/*
+ * Write every thread's events as trace-event JSON.  Threads may still
+ * be recording; only the events published so far are written.
+ */
+int
+trace_write(void)
+{
+   struct trace_buffer *buffer;
+   unsigned int i, count;
+   int pid = getpid(), first = 1, ok;
+   FILE *fp;
+
+   if (!enabled)
+      return 1;
+
+   fp = fopen(trace_path, "w");
+   if (!fp) {
+      printf("Error: couldn't write trace to %s\n", trace_path);
+      return 0;
+   }
+
+   fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+   for (buffer = __atomic_load_n(&buffers, __ATOMIC_ACQUIRE); buffer;
+        buffer = buffer->next) {
+      if (buffer->thread_name) {
+         fprintf(fp, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,"
+                 "\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                 first ? "" : ",\n", pid, buffer->tid, buffer->thread_name);
+         first = 0;
+      }
+
+      count = __atomic_load_n(&buffer->count, __ATOMIC_ACQUIRE);
+      for (i = 0; i < count; i++) {
+         struct trace_event *event = &buffer->events[i];
+
+         fprintf(fp, "%s{\"ph\":\"%c\",\"name\":\"%s\",\"pid\":%d,\"tid\":%d,"
+                 "\"ts\":%.3f", first ? "" : ",\n", event->phase, event->name,
+                 pid, buffer->tid, event->ts);
+         if (event->phase == 'C')
+            fprintf(fp, ",\"args\":{\"value\":%lld}", event->value);
+         fprintf(fp, "}");
+         first = 0;
+      }
+
+      if (buffer->dropped)
+         printf("Warning: trace buffer of thread %d overflowed, %u events dropped\n",
+                buffer->tid, buffer->dropped);
+   }
+
+   fprintf(fp, "\n]}\n");
+
+   ok = fclose(fp) == 0;
+   if (ok)
+      printf("trace written to %s\n", trace_path);
+
+   return ok;
+}
@@ -0,0 +1,26 @@
+/**************************************************************************
+ *
+ * Copyright 2014 Scott Moreau <oreaus@gmail.com>
+ * All Rights Reserved.
+ *
+ **************************************************************************/
+
+/*
+ * Timeline tracing in the Chrome trace-event format, viewable in
+ * Perfetto or chrome://tracing.  Every thread records into its own
+ * buffer without locks; names must be string literals since only the
+ * pointers are stored.  All calls are no-ops until trace_init.
+ */
+
+int
+trace_init(const char *path);
+void
+trace_thread_name(const char *name);
+void
+trace_begin(const char *name);
+void
+trace_end(const char *name);
+void
+trace_counter(const char *name, long long value);
+int
+trace_write(void);
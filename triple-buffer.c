@@ -0,0 +1,53 @@
+/**************************************************************************
+ *
+ * Copyright 2014 Scott Moreau <oreaus@gmail.com>
+ * All Rights Reserved.
+ *
+ **************************************************************************/
+
+#include "triple-buffer.h"
+
+void
+triple_buffer_init(struct triple_buffer *buffer, void *a, void *b, void *c)
+{
+   buffer->slots[0] = a;
+   buffer->slots[1] = b;
+   buffer->slots[2] = c;
+   buffer->write = 0;
+   buffer->middle = 1;
+   buffer->read = 2;
+}
+
+/* The buffer the producer fills next; only it touches this one */
+void *
+triple_buffer_write_slot(struct triple_buffer *buffer)
+{
+   return buffer->slots[buffer->write];
+}
+
+/* Hand the filled buffer over, replacing any the consumer skipped */
+void
+triple_buffer_publish(struct triple_buffer *buffer)
+{
+   int old;
+
+   old = __atomic_exchange_n(&buffer->middle, buffer->write | TRIPLE_BUFFER_FRESH,
+                             __ATOMIC_ACQ_REL);
+   buffer->write = old & ~TRIPLE_BUFFER_FRESH;
+}
+
+/*
+ * The newest published buffer.  It stays the consumer's until the next
+ * call; fresh says whether it differs from what the last call returned.
+ */
+void *
+triple_buffer_acquire(struct triple_buffer *buffer, int *fresh)
+{
+   *fresh = __atomic_load_n(&buffer->middle, __ATOMIC_ACQUIRE) & TRIPLE_BUFFER_FRESH;
+
+   if (*fresh)
+      buffer->read = __atomic_exchange_n(&buffer->middle, buffer->read,
+                                         __ATOMIC_ACQ_REL) & ~TRIPLE_BUFFER_FRESH;
+
+   return buffer->slots[buffer->read];
+}
@@ -0,0 +1,29 @@
+/**************************************************************************
+ *
+ * Copyright 2014 Scott Moreau <oreaus@gmail.com>
+ * All Rights Reserved.
+ *
+ **************************************************************************/
+
+/*
+ * Single producer, single consumer handoff of the newest of a stream
+ * of buffers.  The producer always has a buffer to write and the
+ * consumer always has one to read; a third sits between them and the
+ * two swap with it atomically, so neither side ever waits.
+ */
+#define TRIPLE_BUFFER_FRESH 4
+
+struct triple_buffer {
+   void *slots[3];
+   int write, read;
+   int middle;          /* slot index, TRIPLE_BUFFER_FRESH when unread */
+};
+
+void
+triple_buffer_init(struct triple_buffer *buffer, void *a, void *b, void *c);
+void *
+triple_buffer_write_slot(struct triple_buffer *buffer);
+void
+triple_buffer_publish(struct triple_buffer *buffer);
+void *
+triple_buffer_acquire(struct triple_buffer *buffer, int *fresh);
@@ -33,15 +33,45 @@
 #include <string.h>
 #include <values.h>
 #include <math.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
 #include "wobbly.h"
 
-#define GRID_WIDTH  4
-#define GRID_HEIGHT 4
+#define GRID_WIDTH  WOBBLY_GRID_SIZE
+#define GRID_HEIGHT WOBBLY_GRID_SIZE
 
 #define MODEL_MAX_SPRINGS (GRID_WIDTH * GRID_HEIGHT * 2)
 
-#define MASS 50.0f
+#define MASS ((float) WOBBLY_MASS)
+
+#define EDGE_DISTANCE 25.0f
+#define EDGE_VELOCITY 13.0f
+
+#define NORTH 0
+#define SOUTH 1
+#define WEST  2
+#define EAST  3
+
+#define WestEdgeMask  (1L << 0)
+#define SouthEdgeMask (1L << 1)
+#define EastEdgeMask  (1L << 2)
+#define NorthEdgeMask (1L << 3)
+
+#define SCENE_CELL_SIZE 128
+
+#define HIT_LEAF_CELLS 2
+
+/* Finest adaptive lattice, keeping vertex indices within 16 bits */
+#define ADAPTIVE_MAX_LATTICE 128
+
+/* Cells across a strip of the index order, so that the two rows of
+ * vertices a strip is working on fit in WOBBLY_VERTEX_CACHE */
+#define INDEX_STRIP_CELLS (WOBBLY_VERTEX_CACHE / 2 - 1)
+#define INDEX_MAX_CACHE 64
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
 
 typedef struct _xy_pair {
     float x, y;
@@ -55,6 +85,8 @@ typedef struct _Edge {
 
     float attract;
     float velocity;
+
+    int   snapped;
 } Edge;
 
 typedef struct _Object {
@@ -63,6 +95,7 @@ typedef struct _Object {
     Vector	 velocity;
     float	 theta;
     int		 immobile;
+    unsigned int edgeMask;
     Edge	 vertEdge;
     Edge	 horzEdge;
 } Object;
@@ -82,20 +115,279 @@ typedef struct _Model {
     float	 steps;
     Point	 topLeft;
     Point	 bottomRight;
+    unsigned int edgeMask;
+    unsigned int snapCnt[4];
 } Model;
 
+typedef struct _Box {
+    float x1, y1, x2, y2;
+} Box;
+
+/*
+ * Node of a bounding volume hierarchy over a block of cells.  Leaves
+ * hold at most HIT_LEAF_CELLS cells a side; the nodes are laid out
+ * parents first, so refitting them in reverse visits children first.
+ */
+typedef struct _HitNode {
+    Box	box;
+    int	cellX1, cellY1, cellX2, cellY2;
+    int	left, right;
+} HitNode;
+
+/* The tessellated mesh as last drawn, for hit testing */
+typedef struct _HitMesh {
+    int	    xCells, yCells;
+    Point   *points;
+    HitNode *nodes;
+    int	    numNodes;
+    int	    pointCapacity, nodeCapacity;
+} HitMesh;
+
+/* A square region of the adaptive lattice, left whole */
+typedef struct _AdaptiveLeaf {
+    int x, y, size;
+} AdaptiveLeaf;
+
+/* Scratch space for wobbly_write_adaptive, sized for one lattice */
+typedef struct _AdaptiveMesh {
+    int		 lattice;
+    int		 *vertexOf;	/* per lattice point, -1 if unused */
+    AdaptiveLeaf *leaves;
+    int		 numLeaves;
+} AdaptiveMesh;
+
 typedef struct _WobblyWindow {
     Model        *model;
     int          wobbly;
     int	        grabbed;
     int	       velocity;
     unsigned int  state;
+    struct wobbly_scene *scene;
+    int		  sceneIndex;
+    int		  sceneQueued;
+    HitMesh	  *hit;
+    int		  hitDirty;
+    int		  stepBudget;
+    AdaptiveMesh  *adaptive;
 } WobblyWindow;
 
+/* A surface's outline as of the last wobbly_scene_update */
+typedef struct _SceneEntry {
+    Box		 box;
+    WobblyWindow *ww;
+} SceneEntry;
+
+/* Scene hierarchy node; entry is -1 for inner nodes */
+typedef struct _SceneNode {
+    Box	box;
+    int	left, right, parent;
+    int	entry;
+} SceneNode;
+
+/*
+ * Surface outlines binned into a uniform grid of SCENE_CELL_SIZE
+ * cells covering the screen, stored as one array of entry indices
+ * per cell (cellStart holds the offsets).  Outlines reaching past
+ * the screen are binned into the border cells.
+ */
+struct wobbly_scene {
+    int		   width, height;
+    struct surface **surfaces;
+    SceneEntry	   *entries;
+    int		   numSurfaces, surfaceCapacity;
+    int		   gridWidth, gridHeight;
+    int		   cellsX, cellsY;
+    int		   *cellStart;
+    int		   cellCapacity;
+    int		   *cellEntries;
+    int		   cellEntryCapacity;
+    SceneNode	   *nodes;
+    int		   *leafNodes;
+    int		   *order;
+    int		   numNodes, nodeCapacity;
+    int		   bvhDirty;
+    int		   *dirty;
+    int		   numDirty;
+};
+
 #define WobblyInitial  (1L << 0)
 #define WobblyForce    (1L << 1)
 #define WobblyVelocity (1L << 2)
 
+#define CACHE_LINE 64
+
+/*
+ * All of a surface's wobbly state lives in one cache aligned block,
+ * so creating a surface is a single pool allocation and the springs
+ * can point straight at the objects beside them.
+ */
+typedef struct _WobblyBlock {
+    union {
+	struct _WobblyBlock *next;
+	WobblyWindow	    ww;
+    };
+    Model		    model;
+    Object		    objects[GRID_WIDTH * GRID_HEIGHT];
+} __attribute__ ((aligned (CACHE_LINE))) WobblyBlock;
+
+#define POOL_SLAB_SIZE      (64 * 1024)
+#define POOL_HUGE_SLAB_SIZE (2 * 1024 * 1024)
+
+static int poolHugePages = 0;
+
+/* Most blocks a thread keeps for itself before handing them over */
+#define POOL_LOCAL_MAX (2 * POOL_SLAB_SIZE / sizeof (WobblyBlock))
+
+/*
+ * Blocks freed by a thread go back to that thread's list, so the
+ * steady state needs neither locks nor the system allocator.  A thread
+ * that frees more than it allocates, or exits, passes its list on to
+ * the shared one, which threads drain before mapping another slab.
+ */
+static __thread WobblyBlock *poolFreeList = NULL;
+static __thread WobblyBlock *poolFreeTail = NULL;
+static __thread size_t	     poolFreeCount = 0;
+
+static pthread_mutex_t poolSharedMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t  poolKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t   poolKey;
+static WobblyBlock     *poolSharedList = NULL;
+static WobblyBlock     *poolSharedTail = NULL;
+static size_t	       poolSharedCount = 0;
+
+/* Move the calling thread's list onto the shared one */
+static void
+poolRelease (void)
+{
+    if (!poolFreeList)
+	return;
+
+    pthread_mutex_lock (&poolSharedMutex);
+    poolFreeTail->next = poolSharedList;
+    if (!poolSharedList)
+	poolSharedTail = poolFreeTail;
+    poolSharedList   = poolFreeList;
+    poolSharedCount += poolFreeCount;
+    pthread_mutex_unlock (&poolSharedMutex);
+
+    poolFreeList  = NULL;
+    poolFreeTail  = NULL;
+    poolFreeCount = 0;
+}
+
+static void
+poolThreadExit (void *data)
+{
+    poolRelease ();
+}
+
+static void
+poolCreateKey (void)
+{
+    pthread_key_create (&poolKey, poolThreadExit);
+}
+
+/* Have the calling thread's list released when it exits */
+static void
+poolWatchThread (void)
+{
+    pthread_once (&poolKeyOnce, poolCreateKey);
+    if (!pthread_getspecific (poolKey))
+	pthread_setspecific (poolKey, &poolFreeList);
+}
+
+/* Take over whatever other threads handed over */
+static int
+poolReclaim (void)
+{
+    pthread_mutex_lock (&poolSharedMutex);
+    poolFreeList  = poolSharedList;
+    poolFreeTail  = poolSharedTail;
+    poolFreeCount = poolSharedCount;
+    poolSharedList  = NULL;
+    poolSharedTail  = NULL;
+    poolSharedCount = 0;
+    pthread_mutex_unlock (&poolSharedMutex);
+
+    return poolFreeList != NULL;
+}
+
+static int
+poolGrow (void)
+{
+    WobblyBlock *blocks = MAP_FAILED;
+    size_t	size = 0;
+    int		i, count;
+
+    poolWatchThread ();
+
+    if (poolReclaim ())
+	return 1;
+
+    if (poolHugePages)
+    {
+	size = POOL_HUGE_SLAB_SIZE;
+	blocks = mmap (NULL, size, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+
+    /* No huge pages reserved, fall back to normal ones */
+    if (blocks == MAP_FAILED)
+    {
+	size = POOL_SLAB_SIZE;
+	blocks = mmap (NULL, size, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (blocks == MAP_FAILED)
+	    return 0;
+    }
+
+    count = size / sizeof (WobblyBlock);
+    for (i = count - 1; i >= 0; i--)
+    {
+	blocks[i].next = poolFreeList;
+	poolFreeList = &blocks[i];
+    }
+    poolFreeTail  = &blocks[count - 1];
+    poolFreeCount = count;
+
+    return 1;
+}
+
+static WobblyBlock *
+poolAlloc (void)
+{
+    WobblyBlock *block;
+
+    if (!poolFreeList && !poolGrow ())
+	return NULL;
+
+    block = poolFreeList;
+    poolFreeList = block->next;
+    if (!poolFreeList)
+	poolFreeTail = NULL;
+    poolFreeCount--;
+
+    return block;
+}
+
+static void
+poolFree (WobblyBlock *block)
+{
+    /* Don't sit on blocks another thread keeps allocating */
+    if (poolFreeCount >= POOL_LOCAL_MAX)
+	poolRelease ();
+
+    if (!poolFreeList)
+    {
+	poolWatchThread ();
+	poolFreeTail = block;
+    }
+
+    block->next = poolFreeList;
+    poolFreeList = block;
+    poolFreeCount++;
+}
+
 static void
 objectInit (Object *object,
 	    float  positionX,
@@ -115,8 +407,12 @@ objectInit (Object *object,
     object->theta    = 0;
     object->immobile = 0;
 
-    object->vertEdge.next = 0.0f;
-    object->horzEdge.next = 0.0f;
+    object->edgeMask = 0;
+
+    object->vertEdge.next    = 0.0f;
+    object->vertEdge.snapped = 0;
+    object->horzEdge.next    = 0.0f;
+    object->horzEdge.snapped = 0;
 }
 
 static void
@@ -146,12 +442,12 @@ modelCalcBounds (Model *model)
     {
 	if (model->objects[i].position.x < model->topLeft.x)
 	    model->topLeft.x = model->objects[i].position.x;
-	else if (model->objects[i].position.x > model->bottomRight.x)
+	if (model->objects[i].position.x > model->bottomRight.x)
 	    model->bottomRight.x = model->objects[i].position.x;
 
 	if (model->objects[i].position.y < model->topLeft.y)
 	    model->topLeft.y = model->objects[i].position.y;
-	else if (model->objects[i].position.y > model->bottomRight.y)
+	if (model->objects[i].position.y > model->bottomRight.y)
 	    model->bottomRight.y = model->objects[i].position.y;
     }
 }
@@ -208,6 +504,8 @@ modelInitObjects (Model *model,
     gw = GRID_WIDTH  - 1;
     gh = GRID_HEIGHT - 1;
 
+    memset (model->snapCnt, 0, sizeof (model->snapCnt));
+
     for (gridY = 0; gridY < GRID_HEIGHT; gridY++)
     {
 	for (gridX = 0; gridX < GRID_WIDTH; gridX++)
@@ -259,37 +557,28 @@ modelInitSprings (Model *model,
     }
 }
 
-static Model *
-createModel (int	  x,
-	     int	  y,
-	     int	  width,
-	     int	  height)
+static void
+initModel (Model  *model,
+	   Object *objects,
+	   int	  x,
+	   int	  y,
+	   int	  width,
+	   int	  height)
 {
-    Model *model;
-
-    model = malloc (sizeof (Model));
-    if (!model)
-	return 0;
-
     model->numObjects = GRID_WIDTH * GRID_HEIGHT;
-    model->objects = malloc (sizeof (Object) * model->numObjects);
-    if (!model->objects)
-    {
-	free (model);
-	return 0;
-    }
+    model->objects = objects;
 
     model->anchorObject = 0;
     model->numSprings = 0;
 
     model->steps = 0;
 
+    model->edgeMask = 0;
+
     modelInitObjects (model, x, y, width, height);
     modelInitSprings (model, x, y, width, height);
 
     modelCalcBounds (model);
-
-    return model;
 }
 
 static void
@@ -321,11 +610,396 @@ springExertForces (Spring *spring,
     objectApplyForce (spring->b, k * db.x, k * db.y);
 }
 
+static int
+sceneCell (float v,
+	   int   cells)
+{
+    int cell = floor (v / SCENE_CELL_SIZE);
+
+    if (cell < 0)
+	return 0;
+    if (cell >= cells)
+	return cells - 1;
+
+    return cell;
+}
+
+/*
+ * Work through the outlines binned in one cell.  Positions along the
+ * direction of travel are multiplied by sign, so next is always the
+ * nearest edge at or beyond the object and prev the nearest behind
+ * it.  Outlines found in several cells are simply seen again.
+ */
+static void
+sceneScanCell (struct wobbly_scene *scene,
+	       WobblyWindow	   *ww,
+	       int		   cell,
+	       int		   dir,
+	       float		   sign,
+	       float		   along,
+	       float		   across,
+	       float		   *next,
+	       float		   *prev,
+	       float		   *start,
+	       float		   *end)
+{
+    SceneEntry *e;
+    float      s, en, v;
+    int	       i;
+
+    for (i = scene->cellStart[cell]; i < scene->cellStart[cell + 1]; i++)
+    {
+	e = &scene->entries[scene->cellEntries[i]];
+	if (e->ww == ww)
+	    continue;
+
+	if (dir == WEST || dir == EAST)
+	{
+	    s  = e->box.y1;
+	    en = e->box.y2;
+	    v  = dir == WEST ? e->box.x2 : e->box.x1;
+	}
+	else
+	{
+	    s  = e->box.x1;
+	    en = e->box.x2;
+	    v  = dir == NORTH ? e->box.y2 : e->box.y1;
+	}
+
+	if (s > across)
+	{
+	    if (s < *end)
+		*end = s;
+	}
+	else if (en < across)
+	{
+	    if (en > *start)
+		*start = en;
+	}
+	else
+	{
+	    if (s > *start)
+		*start = s;
+	    if (en < *end)
+		*end = en;
+
+	    v *= sign;
+	    if (v >= along)
+	    {
+		if (v < *next)
+		    *next = v;
+	    }
+	    else
+	    {
+		if (v > *prev)
+		    *prev = v;
+	    }
+	}
+    }
+}
+
+/*
+ * Find the edge an object on the dir side of its surface snaps to
+ * next, either the screen edge or the facing edge of a neighbour
+ * overlapping it, and the nearest one behind it.  The answer holds
+ * while the object stays between start and end across the direction
+ * of travel.  Only the grid row (or column) the object is in is
+ * searched, cell by cell outward from the object, stopping at the
+ * first cell that has an edge.
+ */
+static void
+objectFindEdge (WobblyWindow *ww,
+		Object	     *object,
+		int	     dir)
+{
+    struct wobbly_scene *scene = ww->scene;
+    Edge		*edge;
+    float		sign, along, across, bound, next, prev, start, end;
+    int			vertical, band, bands, cells, k0, k, step;
+
+    /* Out of any scene there is nothing to snap to */
+    if (!scene)
+	return;
+
+    vertical = dir == WEST || dir == EAST;
+    sign     = (dir == EAST || dir == SOUTH) ? 1.0f : -1.0f;
+
+    if (vertical)
+    {
+	edge   = &object->vertEdge;
+	along  = object->position.x;
+	across = object->position.y;
+	bound  = dir == EAST ? scene->gridWidth : 0;
+	cells  = scene->cellsX;
+	bands  = scene->cellsY;
+    }
+    else
+    {
+	edge   = &object->horzEdge;
+	along  = object->position.y;
+	across = object->position.x;
+	bound  = dir == SOUTH ? scene->gridHeight : 0;
+	cells  = scene->cellsY;
+	bands  = scene->cellsX;
+    }
+
+    along *= sign;
+    bound *= sign;
+
+    next = 65535.0f;
+    prev = -65535.0f;
+
+    /* Outlines outside this band can't overlap the object */
+    band  = sceneCell (across, bands);
+    start = band > 0 ? band * SCENE_CELL_SIZE : -65535.0f;
+    end   = band < bands - 1 ? (band + 1) * SCENE_CELL_SIZE : 65535.0f;
+
+    if (along <= bound)
+    {
+	next = bound;
+	step = sign;
+	k0   = sceneCell (along * sign, cells);
+
+	for (k = k0; k >= 0 && k < cells; k += step)
+	{
+	    sceneScanCell (scene, ww, vertical ? band * cells + k : k * bands + band,
+			   dir, sign, along, across, &next, &prev, &start, &end);
+	    if (next <= sign * (step > 0 ? k + 1 : k) * SCENE_CELL_SIZE)
+		break;
+	}
+
+	for (k = k0 - step; k >= 0 && k < cells; k -= step)
+	{
+	    sceneScanCell (scene, ww, vertical ? band * cells + k : k * bands + band,
+			   dir, sign, along, across, &next, &prev, &start, &end);
+	    if (prev >= sign * (step > 0 ? k : k + 1) * SCENE_CELL_SIZE)
+		break;
+	}
+    }
+    else
+    {
+	prev = bound;
+    }
+
+    next *= sign;
+    prev *= sign;
+
+    if ((int) next != (int) edge->next && edge->snapped)
+    {
+	edge->snapped = 0;
+	ww->model->snapCnt[dir]--;
+    }
+
+    edge->start = start;
+    edge->end   = end;
+
+    edge->next = next;
+    edge->prev = prev;
+
+    edge->attract  = next - sign * EDGE_DISTANCE;
+    edge->velocity = EDGE_VELOCITY;
+}
+
+static void
+objectSetEdgeMask (WobblyWindow *ww,
+		   Object	*object,
+		   unsigned int mask)
+{
+    Model	 *model = ww->model;
+    unsigned int vert = WestEdgeMask | EastEdgeMask;
+    unsigned int horz = NorthEdgeMask | SouthEdgeMask;
+    unsigned int old = object->edgeMask;
+
+    object->edgeMask = mask;
+
+    if (object->vertEdge.snapped && (old & vert) != (mask & vert))
+    {
+	object->vertEdge.snapped = 0;
+	model->snapCnt[(old & WestEdgeMask) ? WEST : EAST]--;
+    }
+
+    if (object->horzEdge.snapped && (old & horz) != (mask & horz))
+    {
+	object->horzEdge.snapped = 0;
+	model->snapCnt[(old & NorthEdgeMask) ? NORTH : SOUTH]--;
+    }
+
+    if (!object->vertEdge.snapped)
+    {
+	if (mask & WestEdgeMask)
+	    objectFindEdge (ww, object, WEST);
+	else if (mask & EastEdgeMask)
+	    objectFindEdge (ww, object, EAST);
+    }
+
+    if (!object->horzEdge.snapped)
+    {
+	if (mask & NorthEdgeMask)
+	    objectFindEdge (ww, object, NORTH);
+	else if (mask & SouthEdgeMask)
+	    objectFindEdge (ww, object, SOUTH);
+    }
+}
+
+/*
+ * Objects on the outline of the grid snap to edges on their side.
+ * Once one side has snapped, the opposite side stops snapping so the
+ * surface isn't squeezed between two edges.
+ */
+static void
+modelUpdateSnapping (WobblyWindow *ww)
+{
+    Model	 *model = ww->model;
+    unsigned int edgeMask, gridMask, mask;
+    int		 gridY, i, j;
+
+    edgeMask = model->edgeMask;
+
+    if (model->snapCnt[NORTH])
+	edgeMask &= ~SouthEdgeMask;
+    else if (model->snapCnt[SOUTH])
+	edgeMask &= ~NorthEdgeMask;
+
+    if (model->snapCnt[WEST])
+	edgeMask &= ~EastEdgeMask;
+    else if (model->snapCnt[EAST])
+	edgeMask &= ~WestEdgeMask;
+
+    for (i = 0, gridY = 0; i < GRID_HEIGHT; i++, gridY += GRID_WIDTH)
+    {
+	if (i == 0)
+	    gridMask = edgeMask & NorthEdgeMask;
+	else if (i == GRID_HEIGHT - 1)
+	    gridMask = edgeMask & SouthEdgeMask;
+	else
+	    gridMask = 0;
+
+	for (j = 0; j < GRID_WIDTH; j++)
+	{
+	    mask = gridMask;
+
+	    if (j == 0)
+		mask |= edgeMask & WestEdgeMask;
+	    else if (j == GRID_WIDTH - 1)
+		mask |= edgeMask & EastEdgeMask;
+
+	    if (mask != model->objects[gridY + j].edgeMask)
+		objectSetEdgeMask (ww, &model->objects[gridY + j], mask);
+	}
+    }
+}
+
+static int
+modelDisableSnapping (Model *model)
+{
+    Object *object;
+    int	   i, snapped = 0;
+
+    for (i = 0; i < model->numObjects; i++)
+    {
+	object = &model->objects[i];
+
+	if (object->vertEdge.snapped || object->horzEdge.snapped)
+	    snapped = 1;
+
+	object->vertEdge.snapped = 0;
+	object->horzEdge.snapped = 0;
+	object->edgeMask = 0;
+    }
+
+    memset (model->snapCnt, 0, sizeof (model->snapCnt));
+    model->edgeMask = 0;
+
+    return snapped;
+}
+
+/*
+ * Move an object on the outline along one axis.  It is pulled in when
+ * it comes within EDGE_DISTANCE of the edge ahead and sticks once it
+ * reaches it, until the springs drag it off faster than the edge's
+ * escape velocity.
+ */
+static void
+objectMoveNearEdge (WobblyWindow *ww,
+		    Object	 *object,
+		    int		 dir)
+{
+    Model *model = ww->model;
+    Edge  *edge;
+    float *position, *velocity, across, sign;
+
+    if (dir == WEST || dir == EAST)
+    {
+	edge	 = &object->vertEdge;
+	position = &object->position.x;
+	velocity = &object->velocity.x;
+	across	 = object->position.y;
+    }
+    else
+    {
+	edge	 = &object->horzEdge;
+	position = &object->position.y;
+	velocity = &object->velocity.y;
+	across	 = object->position.x;
+    }
+
+    /* Out of any scene there is nothing to snap to */
+    if (!ww->scene)
+    {
+	*position += *velocity;
+	return;
+    }
+
+    sign = (dir == EAST || dir == SOUTH) ? 1.0f : -1.0f;
+
+    if (across < edge->start || across > edge->end)
+	objectFindEdge (ww, object, dir);
+
+    if (edge->snapped)
+    {
+	if (fabs (*velocity) <= edge->velocity)
+	{
+	    *velocity = 0.0f;
+	    return;
+	}
+
+	*position += *velocity * 2.0f;
+	model->snapCnt[dir]--;
+	edge->snapped = 0;
+	object->edgeMask = 0;
+	modelUpdateSnapping (ww);
+    }
+
+    *position += *velocity;
+
+    if (sign * *velocity > 0.0f && sign * *position > sign * edge->attract)
+    {
+	if (sign * *position > sign * edge->next)
+	{
+	    edge->snapped = 1;
+	    *position = edge->next;
+	    *velocity = 0.0f;
+
+	    model->snapCnt[dir]++;
+
+	    modelUpdateSnapping (ww);
+	}
+	else
+	{
+	    *velocity += *position - edge->attract;
+	}
+    }
+
+    if (sign * *position < sign * edge->prev)
+	objectFindEdge (ww, object, dir);
+}
+
 static float
-modelStepObject (Model	    *model,
-		 Object	    *object,
-		 float	    friction,
-		 float	    *force)
+modelStepObject (WobblyWindow *ww,
+		 Model	      *model,
+		 Object	      *object,
+		 float	      friction,
+		 float	      *force)
 {
     object->theta += 0.05f;
 
@@ -349,8 +1023,19 @@ modelStepObject (Model	    *model,
 	object->velocity.x += object->force.x / MASS;
 	object->velocity.y += object->force.y / MASS;
 
-	object->position.x += object->velocity.x;
-	object->position.y += object->velocity.y;
+	if (object->edgeMask & WestEdgeMask)
+	    objectMoveNearEdge (ww, object, WEST);
+	else if (object->edgeMask & EastEdgeMask)
+	    objectMoveNearEdge (ww, object, EAST);
+	else
+	    object->position.x += object->velocity.x;
+
+	if (object->edgeMask & NorthEdgeMask)
+	    objectMoveNearEdge (ww, object, NORTH);
+	else if (object->edgeMask & SouthEdgeMask)
+	    objectMoveNearEdge (ww, object, SOUTH);
+	else
+	    object->position.y += object->velocity.y;
 
 	*force = fabs (object->force.x) + fabs (object->force.y);
 
@@ -362,10 +1047,12 @@ modelStepObject (Model	    *model,
 }
 
 static int
-modelStep (Model      *model,
+modelStep (WobblyWindow *ww,
+	   Model      *model,
 	   float      friction,
 	   float      k,
-	   float      time)
+	   float      time,
+	   int	      *stepsTaken)
 {
     int   i, j, steps, wobbly = 0;
     float velocitySum = 0.0f;
@@ -375,6 +1062,12 @@ modelStep (Model      *model,
     steps = floor (model->steps);
     model->steps -= steps;
 
+    /* Over budget, the model falls behind instead of the frame */
+    if (ww->stepBudget && steps > ww->stepBudget)
+	steps = ww->stepBudget;
+
+    *stepsTaken = steps;
+
     if (!steps)
 	return 1;
 
@@ -385,7 +1078,7 @@ modelStep (Model      *model,
 
 	for (i = 0; i < model->numObjects; i++)
 	{
-	    velocitySum += modelStepObject (model,
+	    velocitySum += modelStepObject (ww, model,
 					    &model->objects[i],
 					    friction,
 					    &force);
@@ -446,12 +1139,13 @@ static int
 wobblyEnsureModel(struct surface *surface)
 {
     WobblyWindow *ww = surface->ww;
+    WobblyBlock	 *block = (WobblyBlock *) ww;
 
     if (!ww->model)
     {
-	ww->model = createModel(surface->x, surface->y, surface->width, surface->height);
-	if (!ww->model)
-	    return 0;
+	initModel (&block->model, block->objects,
+		   surface->x, surface->y, surface->width, surface->height);
+	ww->model = &block->model;
     }
 
     return 1;
@@ -492,22 +1186,319 @@ modelFindNearestObject (Model *model,
     return object;
 }
 
-void
-wobbly_prepare_paint(struct surface *surface, int msSinceLastPaint)
+static void
+boxAddPoint (Box   *box,
+	     Point *p)
 {
-    WobblyWindow *ww = surface->ww;
-    float  friction, springK;
-    
-    friction = WOBBLY_FRICTION;
-    springK  = WOBBLY_SPRING_K;
+    if (p->x < box->x1)
+	box->x1 = p->x;
+    if (p->x > box->x2)
+	box->x2 = p->x;
+    if (p->y < box->y1)
+	box->y1 = p->y;
+    if (p->y > box->y2)
+	box->y2 = p->y;
+}
 
-    if (ww->wobbly)
-    {
-	if (ww->wobbly & (WobblyInitial | WobblyVelocity | WobblyForce))
+static void
+boxUnion (Box *box,
+	  Box *a,
+	  Box *b)
+{
+    box->x1 = MIN (a->x1, b->x1);
+    box->y1 = MIN (a->y1, b->y1);
+    box->x2 = MAX (a->x2, b->x2);
+    box->y2 = MAX (a->y2, b->y2);
+}
+
+static int
+boxContains (Box   *box,
+	     float x,
+	     float y)
+{
+    return x >= box->x1 && x <= box->x2 && y >= box->y1 && y <= box->y2;
+}
+
+static int
+boxOverlaps (Box *a,
+	     Box *b)
+{
+    return a->x1 <= b->x2 && a->x2 >= b->x1 && a->y1 <= b->y2 && a->y2 >= b->y1;
+}
+
+/*
+ * The surface's shape changed: its hit mesh needs evaluating again and
+ * its scene entry refitting.
+ */
+static void
+wobblyDamage (WobblyWindow *ww)
+{
+    struct wobbly_scene *scene = ww->scene;
+
+    ww->hitDirty = 1;
+
+    if (scene && !ww->sceneQueued)
+    {
+	scene->dirty[scene->numDirty++] = ww->sceneIndex;
+	ww->sceneQueued = 1;
+    }
+}
+
+/* Split the cell block in two across its longer side, recursively */
+static int
+hitMeshBuildNode (HitMesh *hit,
+		  int	  x1,
+		  int	  y1,
+		  int	  x2,
+		  int	  y2)
+{
+    HitNode *node;
+    int	    index = hit->numNodes++;
+
+    node = &hit->nodes[index];
+    node->cellX1 = x1;
+    node->cellY1 = y1;
+    node->cellX2 = x2;
+    node->cellY2 = y2;
+    node->left	 = -1;
+    node->right	 = -1;
+
+    if (x2 - x1 <= HIT_LEAF_CELLS && y2 - y1 <= HIT_LEAF_CELLS)
+	return index;
+
+    if (x2 - x1 >= y2 - y1)
+    {
+	node->left  = hitMeshBuildNode (hit, x1, y1, (x1 + x2) / 2, y2);
+	node = &hit->nodes[index];
+	node->right = hitMeshBuildNode (hit, (x1 + x2) / 2, y1, x2, y2);
+    }
+    else
+    {
+	node->left  = hitMeshBuildNode (hit, x1, y1, x2, (y1 + y2) / 2);
+	node = &hit->nodes[index];
+	node->right = hitMeshBuildNode (hit, x1, (y1 + y2) / 2, x2, y2);
+    }
+
+    return index;
+}
+
+/*
+ * Bring the hit mesh up to date with the surface.  The hierarchy is
+ * only built when the cell counts change; otherwise the mesh is
+ * evaluated again and the node boxes refit in place.
+ */
+static int
+hitMeshUpdate (struct surface *surface)
+{
+    WobblyWindow	     *ww = surface->ww;
+    HitMesh		     *hit = ww->hit;
+    HitNode		     *node;
+    struct wobbly_mesh_layout layout;
+    int			     numPoints, maxNodes, x, y, i;
+
+    if (!hit)
+    {
+	hit = calloc (1, sizeof (*hit));
+	if (!hit)
+	    return 0;
+	ww->hit = hit;
+	ww->hitDirty = 1;
+    }
+
+    if (hit->xCells != surface->x_cells || hit->yCells != surface->y_cells)
+    {
+	numPoints = wobbly_vertex_count (surface);
+	if (numPoints > hit->pointCapacity)
+	{
+	    Point *points = realloc (hit->points, sizeof (Point) * numPoints);
+
+	    if (!points)
+		return 0;
+	    hit->points	       = points;
+	    hit->pointCapacity = numPoints;
+	}
+
+	/* Twice the number of leaves bounds a binary tree's size */
+	maxNodes = 2 * (surface->x_cells + 1) * (surface->y_cells + 1);
+	if (maxNodes > hit->nodeCapacity)
+	{
+	    HitNode *nodes = realloc (hit->nodes, sizeof (HitNode) * maxNodes);
+
+	    if (!nodes)
+		return 0;
+	    hit->nodes	      = nodes;
+	    hit->nodeCapacity = maxNodes;
+	}
+
+	hit->numNodes = 0;
+	hitMeshBuildNode (hit, 0, 0, surface->x_cells, surface->y_cells);
+
+	hit->xCells   = surface->x_cells;
+	hit->yCells   = surface->y_cells;
+	ww->hitDirty = 1;
+    }
+
+    if (!ww->hitDirty)
+	return 1;
+
+    layout.position	   = hit->points;
+    layout.position_stride = sizeof (Point);
+    layout.texcoord	   = NULL;
+    layout.texcoord_stride = 0;
+
+    wobbly_write_geometry (surface, &layout, hit->pointCapacity);
+
+    for (i = hit->numNodes - 1; i >= 0; i--)
+    {
+	node = &hit->nodes[i];
+
+	if (node->left >= 0)
+	{
+	    boxUnion (&node->box, &hit->nodes[node->left].box,
+		      &hit->nodes[node->right].box);
+	    continue;
+	}
+
+	node->box.x1 = node->box.y1 = MAXSHORT;
+	node->box.x2 = node->box.y2 = MINSHORT;
+
+	for (y = node->cellY1; y <= node->cellY2; y++)
+	    for (x = node->cellX1; x <= node->cellX2; x++)
+		boxAddPoint (&node->box,
+			     &hit->points[y * (hit->xCells + 1) + x]);
+    }
+
+    ww->hitDirty = 0;
+
+    return 1;
+}
+
+/*
+ * Whether p lies in triangle abc, and if so where, as weights of b
+ * and c.
+ */
+static int
+triangleContains (Point *a,
+		  Point *b,
+		  Point *c,
+		  float x,
+		  float y,
+		  float *wb,
+		  float *wc)
+{
+    float e1x, e1y, e2x, e2y, px, py, det;
+
+    e1x = b->x - a->x;
+    e1y = b->y - a->y;
+    e2x = c->x - a->x;
+    e2y = c->y - a->y;
+    px	= x - a->x;
+    py	= y - a->y;
+
+    det = e1x * e2y - e1y * e2x;
+    if (det == 0.0f)
+	return 0;
+
+    *wb = (px * e2y - py * e2x) / det;
+    *wc = (e1x * py - e1y * px) / det;
+
+    return *wb >= 0.0f && *wc >= 0.0f && *wb + *wc <= 1.0f;
+}
+
+/*
+ * Find the cell of the drawn mesh under (x, y).  Where the mesh folds
+ * over itself, the cell drawn last wins, as it does on screen.
+ */
+static int
+hitMeshTest (HitMesh *hit,
+	     float   x,
+	     float   y,
+	     float   *u,
+	     float   *v)
+{
+    HitNode *node;
+    Point   *a, *b, *c, *d;
+    float   wb, wc, s, t;
+    int	    stack[64], depth = 0, best = -1, cell, stride, i, j;
+
+    stride = hit->xCells + 1;
+    stack[depth++] = 0;
+
+    while (depth)
+    {
+	node = &hit->nodes[stack[--depth]];
+
+	if (!boxContains (&node->box, x, y))
+	    continue;
+
+	if (node->left >= 0)
+	{
+	    stack[depth++] = node->left;
+	    stack[depth++] = node->right;
+	    continue;
+	}
+
+	for (j = node->cellY1; j < node->cellY2; j++)
+	{
+	    for (i = node->cellX1; i < node->cellX2; i++)
+	    {
+		cell = j * hit->xCells + i;
+		if (cell < best)
+		    continue;
+
+		a = &hit->points[j * stride + i];
+		b = a + 1;
+		c = a + stride + 1;
+		d = a + stride;
+
+		/* Cell corners a, b, c, d are (0,0), (1,0), (1,1), (0,1) */
+		if (triangleContains (a, b, c, x, y, &wb, &wc))
+		{
+		    s = wb + wc;
+		    t = wc;
+		}
+		else if (triangleContains (a, c, d, x, y, &wb, &wc))
+		{
+		    s = wb;
+		    t = wb + wc;
+		}
+		else
+		{
+		    continue;
+		}
+
+		best = cell;
+		*u = (i + s) / hit->xCells;
+		*v = (j + t) / hit->yCells;
+	    }
+	}
+    }
+
+    return best >= 0;
+}
+
+/*
+ * Advance the model by the time since the last paint.  Returns the
+ * number of integration steps that were taken, 0 when at rest.
+ */
+int
+wobbly_prepare_paint(struct surface *surface, int msSinceLastPaint)
+{
+    WobblyWindow *ww = surface->ww;
+    float  friction, springK;
+    int    steps = 0;
+
+    friction = WOBBLY_FRICTION;
+    springK  = WOBBLY_SPRING_K;
+
+    if (ww->wobbly)
+    {
+	if (ww->wobbly & (WobblyInitial | WobblyVelocity | WobblyForce))
 	{
-	    ww->wobbly = modelStep (ww->model, friction, springK,
+	    ww->wobbly = modelStep (ww, ww->model, friction, springK,
 				    (ww->wobbly & WobblyVelocity) ?
-				    msSinceLastPaint : 16);
+				    msSinceLastPaint : 16, &steps);
+	    wobblyDamage (ww);
 
 	    if (ww->wobbly)
                 modelCalcBounds (ww->model);
@@ -518,6 +1509,8 @@ wobbly_prepare_paint(struct surface *surface, int msSinceLastPaint)
 	    }
 	}
     }
+
+    return steps;
 }
 
 void
@@ -532,165 +1525,765 @@ wobbly_done_paint(struct surface *surface)
     }
 }
 
-void
-wobbly_add_geometry(struct surface *surface)
+int
+wobbly_vertex_count(struct surface *surface)
+{
+    return (surface->x_cells + 1) * (surface->y_cells + 1);
+}
+
+/*
+ * Rows first to first + count - 1 of the vertex grid, written where
+ * wobbly_write_geometry would put them.  Only reads the surface, so
+ * separate threads can fill disjoint rows of the same mesh.  Returns
+ * the number of vertices written, 0 if the grid doesn't fit.
+ */
+int
+wobbly_write_geometry_rows(struct surface *surface,
+			   const struct wobbly_mesh_layout *layout,
+			   int capacity,
+			   int first,
+			   int count)
 {
     WobblyWindow *ww = surface->ww;
 
     float    width, height;
-    float    deformedX, deformedY;
+    float    u, v;
     int      x, y, iw, ih;
-    float    cell_w, cell_h;
-    GLfloat  *v, *uv;
+    char     *pos, *tex;
+    GLfloat  *p;
 
-    if (ww->wobbly)
-    {
-	width  = surface->width;
-	height = surface->height;
+    iw = surface->x_cells + 1;
+    ih = surface->y_cells + 1;
+
+    if (iw * ih > capacity)
+	return 0;
 
-	cell_w = width / surface->x_cells;
-	cell_h = height / surface->y_cells;
+    first = MAX (first, 0);
+    count = MIN (count, ih - first);
+    if (count <= 0)
+	return 0;
 
-        iw = surface->x_cells + 1;
-        ih = surface->y_cells + 1;
+    width  = surface->width;
+    height = surface->height;
 
-	v = realloc(surface->v, sizeof(GLfloat) * 2 * iw * ih);
-	uv = realloc(surface->tex.uv, sizeof(GLfloat) * 2 * iw * ih);
+    pos = (char *) layout->position + first * iw * layout->position_stride;
+    tex = layout->texcoord;
+    if (tex)
+	tex += first * iw * layout->texcoord_stride;
 
-	surface->v = v;
-	surface->tex.uv = uv;
+    for (y = first; y < first + count; y++)
+    {
+	v = (float) y / surface->y_cells;
 
-	for (y = 0; y < ih; y++)
+	for (x = 0; x < iw; x++)
 	{
-	    for (x = 0; x < iw; x++)
-	    {
-	        bezierPatchEvaluate (ww->model,
-	    			 (x * cell_w) / width,
-	    			 (y * cell_h) / height,
-	    			 &deformedX,
-	    			 &deformedY);
+	    u = (float) x / surface->x_cells;
 
-	        *v++ = deformedX;
-	        *v++ = deformedY;
+	    p = (GLfloat *) pos;
+	    if (ww->wobbly)
+	    {
+		bezierPatchEvaluate (ww->model, u, v, &p[0], &p[1]);
+	    }
+	    else
+	    {
+		p[0] = surface->x + u * width;
+		p[1] = surface->y + v * height;
+	    }
+	    pos += layout->position_stride;
 
-	        *uv++ = (x * cell_w) / width;
-	        *uv++ = 1.0 - ((y * cell_h) / height);
+	    if (tex)
+	    {
+		p = (GLfloat *) tex;
+		p[0] = u;
+		p[1] = 1.0 - v;
+		tex += layout->texcoord_stride;
 	    }
 	}
     }
+
+    return iw * count;
 }
 
-void
-wobbly_resize_notify(struct surface *surface)
+/*
+ * Evaluate the surface grid straight into caller memory, which may be
+ * a mapped buffer object or an interleaved vertex array.  The deformed
+ * patch is written while wobbling, the resting rectangle otherwise.
+ * Returns the number of vertices written, 0 if they don't fit.
+ */
+int
+wobbly_write_geometry(struct surface *surface,
+		      const struct wobbly_mesh_layout *layout,
+		      int capacity)
 {
-    WobblyWindow *ww = surface->ww;
-    int x, y, w, h;
+    return wobbly_write_geometry_rows (surface, layout, capacity, 0,
+				       surface->y_cells + 1);
+}
 
-    x = surface->x;
-    y = surface->y;
-    w = surface->width;
-    h = surface->height;
+/*
+ * Two triangles per cell, indexing the vertices written by
+ * wobbly_write_geometry, in vertical strips of cells narrow enough
+ * that the row of vertices a strip left behind is still in a FIFO
+ * post-transform cache of WOBBLY_VERTEX_CACHE entries when the row
+ * below reuses it.  Walking whole rows instead transforms most vertices
+ * twice once a row outgrows the cache.  Returns the number of indices
+ * written, 0 if they don't fit or the grid has more vertices than 16
+ * bit indices reach.
+ */
+int
+wobbly_write_indices(struct surface *surface,
+		     GLushort	    *indices,
+		     int	    capacity)
+{
+    int x, y, i, iw, x0, x1;
 
-    if (ww->model)
+    if (wobbly_vertex_count (surface) > WOBBLY_MAX_VERTICES ||
+	surface->x_cells * surface->y_cells * 6 > capacity)
+	return 0;
+
+    iw = surface->x_cells + 1;
+
+    for (x0 = 0, i = 0; x0 < surface->x_cells; x0 = x1)
     {
-        if (!ww->wobbly)
-	    modelInitObjects (ww->model, x, y, w, h);
+	x1 = MIN (x0 + INDEX_STRIP_CELLS, surface->x_cells);
 
-	modelInitSprings (ww->model, x, y, w, h);
+	for (y = 0; y < surface->y_cells; y++)
+	{
+	    for (x = x0; x < x1; x++)
+	    {
+		indices[i++] = y * iw + x;
+		indices[i++] = y * iw + x + 1;
+		indices[i++] = (y + 1) * iw + x;
+
+		indices[i++] = y * iw + x + 1;
+		indices[i++] = (y + 1) * iw + x + 1;
+		indices[i++] = (y + 1) * iw + x;
+	    }
+	}
     }
+
+    return i;
 }
 
-void
-wobbly_move_notify(struct surface *surface, int dx, int dy)
+/*
+ * Average cache miss ratio of an indexed triangle list: vertices
+ * transformed per triangle through a FIFO cache of cache_size
+ * entries.  A large grid can get down to 0.5; 3 means no reuse.
+ */
+float
+wobbly_index_acmr(const GLushort *indices, int count, int cache_size)
 {
-    WobblyWindow *ww = surface->ww;
+    GLushort fifo[INDEX_MAX_CACHE];
+    int	     i, j, used = 0, next = 0, misses = 0;
 
-    if (ww->grabbed) {
-        ww->model->anchorObject->position.x += dx;
-        ww->model->anchorObject->position.y += dy;
-    
-        ww->wobbly |= WobblyInitial;
-        surface->synced = 0;
+    if (count < 3)
+	return 0;
+
+    cache_size = MAX (1, MIN (cache_size, INDEX_MAX_CACHE));
+
+    for (i = 0; i < count; i++)
+    {
+	for (j = 0; j < used; j++)
+	    if (fifo[j] == indices[i])
+		break;
+
+	if (j < used)
+	    continue;
+
+	misses++;
+	fifo[next] = indices[i];
+	next = (next + 1) % cache_size;
+	if (used < cache_size)
+	    used++;
     }
+
+    return (float) misses / (count / 3);
 }
 
-void
-wobbly_grab_notify(struct surface *surface, int x, int y)
+/* The lattice an adaptive mesh is refined on: the cell counts asked
+ * for, rounded up to a square power of two */
+static int
+adaptiveLattice (struct surface *surface)
 {
-    WobblyWindow *ww = surface->ww;
-
-    if (wobblyEnsureModel (surface))
-    {
-        Spring *s;
-        int	   i;
+    int n = 1;
 
-        if (ww->model->anchorObject)
-            ww->model->anchorObject->immobile = 0;
+    while (n < surface->x_cells || n < surface->y_cells)
+	n <<= 1;
 
-        ww->model->anchorObject = modelFindNearestObject (ww->model, x, y);
-        ww->model->anchorObject->immobile = 1;
+    return MIN (n, ADAPTIVE_MAX_LATTICE);
+}
 
-        ww->grabbed = 1;
+/*
+ * Room wobbly_write_adaptive may need: one vertex per lattice point
+ * plus the center of every leaf, and a triangle for each point on a
+ * leaf's outline, of which each lattice point is on at most four.
+ */
+void
+wobbly_adaptive_bounds(struct surface *surface, int *vertices, int *indices)
+{
+    int n = adaptiveLattice (surface);
 
-        for (i = 0; i < ww->model->numSprings; i++)
-        {
-            s = &ww->model->springs[i];
-            
-            if (s->a == ww->model->anchorObject)
-            {
-                s->b->velocity.x -= s->offset.x * 0.05f;
-                s->b->velocity.y -= s->offset.y * 0.05f;
-            }
-            else if (s->b == ww->model->anchorObject)
-            {
-                s->a->velocity.x += s->offset.x * 0.05f;
-                s->a->velocity.y += s->offset.y * 0.05f;
-            }
-        }
+    *vertices = (n + 1) * (n + 1) + n * n;
+    *indices  = 4 * (n + 1) * (n + 1) * 3;
+}
 
-        ww->wobbly |= WobblyInitial;
-    }
+/* Split a cubic's control points at t = 1/2 */
+static void
+bezierSplit (Point *p,
+	     int   stride,
+	     Point *a,
+	     Point *b)
+{
+    Point p01, p12, p23, p012, p123, mid;
+
+#define LERP(r, s, t) ((r).x = ((s).x + (t).x) * 0.5f, \
+		       (r).y = ((s).y + (t).y) * 0.5f)
+    LERP (p01, p[0], p[stride]);
+    LERP (p12, p[stride], p[2 * stride]);
+    LERP (p23, p[2 * stride], p[3 * stride]);
+    LERP (p012, p01, p12);
+    LERP (p123, p12, p23);
+    LERP (mid, p012, p123);
+#undef LERP
+
+    a[0]	  = p[0];
+    a[stride]	  = p01;
+    a[2 * stride] = p012;
+    a[3 * stride] = mid;
+
+    b[0]	  = mid;
+    b[stride]	  = p123;
+    b[2 * stride] = p23;
+    b[3 * stride] = p[3 * stride];
 }
 
-void
-wobbly_ungrab_notify(struct surface *surface)
+/*
+ * How far, in pixels, the patch with this control net can stray from
+ * the two triangles between its corners.  The net's distance from the
+ * bilinear patch through its corners bounds the patch's, and the
+ * bilinear patch is off its triangulation by a quarter of the twist.
+ */
+static float
+bezierNetDeviation (Point *net)
 {
-    WobblyWindow *ww = surface->ww;
+    Point *p00 = &net[0], *p30 = &net[3], *p03 = &net[12], *p33 = &net[15];
+    float u, v, bx, by, d, max = 0.0f;
+    int	  i, j;
 
-    if (ww->grabbed)
+    for (j = 0; j < 4; j++)
     {
-	if (ww->model)
+	v = j / 3.0f;
+
+	for (i = 0; i < 4; i++)
 	{
-	    if (ww->model->anchorObject)
-		ww->model->anchorObject->immobile = 0;
+	    u = i / 3.0f;
 
-	    ww->model->anchorObject = NULL;
+	    bx = (1 - v) * ((1 - u) * p00->x + u * p30->x) +
+		 v * ((1 - u) * p03->x + u * p33->x);
+	    by = (1 - v) * ((1 - u) * p00->y + u * p30->y) +
+		 v * ((1 - u) * p03->y + u * p33->y);
 
-	    ww->wobbly |= WobblyInitial;
+	    d = fabs (net[j * 4 + i].x - bx) + fabs (net[j * 4 + i].y - by);
+	    if (d > max)
+		max = d;
 	}
-
-	ww->grabbed = 0;
     }
+
+    d = (fabs (p00->x - p30->x - p03->x + p33->x) +
+	 fabs (p00->y - p30->y - p03->y + p33->y)) * 0.25f;
+
+    return max + d;
 }
 
-int
-wobbly_init(struct surface *surface)
+static void
+adaptiveAddLeaf (AdaptiveMesh *mesh,
+		 int	      x,
+		 int	      y,
+		 int	      size)
 {
-    WobblyWindow *ww;
+    AdaptiveLeaf *leaf = &mesh->leaves[mesh->numLeaves++];
+    int		 stride = mesh->lattice + 1;
 
-    ww = malloc(sizeof (WobblyWindow));
-    if (!ww)
-	return 0;
+    leaf->x    = x;
+    leaf->y    = y;
+    leaf->size = size;
 
-    ww->model   = 0;
-    ww->wobbly  = 0;
-    ww->grabbed = 0;
-    ww->state   = 0;
+    mesh->vertexOf[y * stride + x]		    = 0;
+    mesh->vertexOf[y * stride + x + size]	    = 0;
+    mesh->vertexOf[(y + size) * stride + x]	    = 0;
+    mesh->vertexOf[(y + size) * stride + x + size] = 0;
+}
 
-    surface->ww = ww;
+/* Quarter the region until its net is within tolerance of flat */
+static void
+adaptiveRefine (AdaptiveMesh *mesh,
+		Point	     *net,
+		int	     x,
+		int	     y,
+		int	     size,
+		float	     tolerance)
+{
+    Point left[16], right[16], quarters[4][16];
+    int	  i, half = size / 2;
 
-    if(!wobblyEnsureModel(surface)) {
-         free(ww);
+    if (size == 1 || bezierNetDeviation (net) <= tolerance)
+    {
+	adaptiveAddLeaf (mesh, x, y, size);
+	return;
+    }
+
+    /* Split across u, then each half across v */
+    for (i = 0; i < 4; i++)
+	bezierSplit (&net[i * 4], 1, &left[i * 4], &right[i * 4]);
+
+    for (i = 0; i < 4; i++)
+    {
+	bezierSplit (&left[i], 4, &quarters[0][i], &quarters[2][i]);
+	bezierSplit (&right[i], 4, &quarters[1][i], &quarters[3][i]);
+    }
+
+    adaptiveRefine (mesh, quarters[0], x, y, half, tolerance);
+    adaptiveRefine (mesh, quarters[1], x + half, y, half, tolerance);
+    adaptiveRefine (mesh, quarters[2], x, y + half, half, tolerance);
+    adaptiveRefine (mesh, quarters[3], x + half, y + half, half, tolerance);
+}
+
+static int
+adaptiveEmitVertex (struct surface		    *surface,
+		    const struct wobbly_mesh_layout *layout,
+		    int				    index,
+		    float			    u,
+		    float			    v)
+{
+    WobblyWindow *ww = surface->ww;
+    GLfloat	 *p;
+
+    p = (GLfloat *) ((char *) layout->position + index * layout->position_stride);
+    if (ww->wobbly)
+    {
+	bezierPatchEvaluate (ww->model, u, v, &p[0], &p[1]);
+    }
+    else
+    {
+	p[0] = surface->x + u * surface->width;
+	p[1] = surface->y + v * surface->height;
+    }
+
+    if (layout->texcoord)
+    {
+	p = (GLfloat *) ((char *) layout->texcoord + index * layout->texcoord_stride);
+	p[0] = u;
+	p[1] = 1.0 - v;
+    }
+
+    return index;
+}
+
+/*
+ * Tessellate the surface only as finely as its deformation needs.
+ * The control net is split into quarters until each region is within
+ * tolerance pixels of flat, down to the lattice of the surface's cell
+ * counts.  Each region is drawn as a fan over every vertex on its
+ * outline, including the corners of finer neighbours, so adjacent
+ * regions share their edges exactly and no cracks open between them.
+ * Returns the number of vertices written, or 0 if they or the indices
+ * don't fit; *count is set to the number of indices, 0 on failure.
+ */
+int
+wobbly_write_adaptive(struct surface *surface,
+		      const struct wobbly_mesh_layout *layout,
+		      int capacity,
+		      GLushort *indices,
+		      int index_capacity,
+		      float tolerance,
+		      int *count)
+{
+    WobblyWindow *ww = surface->ww;
+    AdaptiveMesh *mesh = ww->adaptive;
+    AdaptiveLeaf *leaf;
+    Point	 net[16];
+    float	 scale;
+    int		 maxVertices, maxIndices, n, stride, numVertices, numIndices;
+    int		 outline[4 * ADAPTIVE_MAX_LATTICE + 1], numOutline;
+    int		 i, j, k, x, y, first, center;
+
+    *count = 0;
+
+    wobbly_adaptive_bounds (surface, &maxVertices, &maxIndices);
+    if (maxVertices > capacity || maxIndices > index_capacity)
+	return 0;
+
+    n = adaptiveLattice (surface);
+    stride = n + 1;
+
+    if (!mesh || mesh->lattice != n)
+    {
+	if (!mesh)
+	{
+	    mesh = calloc (1, sizeof (*mesh));
+	    if (!mesh)
+		return 0;
+	    ww->adaptive = mesh;
+	}
+
+	free (mesh->vertexOf);
+	free (mesh->leaves);
+	mesh->vertexOf = malloc (sizeof (int) * stride * stride);
+	mesh->leaves   = malloc (sizeof (AdaptiveLeaf) * n * n);
+	mesh->lattice  = (mesh->vertexOf && mesh->leaves) ? n : 0;
+	if (!mesh->lattice)
+	    return 0;
+    }
+
+    for (i = 0; i < stride * stride; i++)
+	mesh->vertexOf[i] = -1;
+    mesh->numLeaves = 0;
+
+    if (ww->wobbly)
+    {
+	for (i = 0; i < 16; i++)
+	    net[i] = ww->model->objects[i].position;
+    }
+    else
+    {
+	/* At rest the surface is its rectangle, flat at any tolerance */
+	for (j = 0; j < 4; j++)
+	{
+	    for (i = 0; i < 4; i++)
+	    {
+		net[j * 4 + i].x = surface->x + surface->width * i / 3.0f;
+		net[j * 4 + i].y = surface->y + surface->height * j / 3.0f;
+	    }
+	}
+    }
+
+    adaptiveRefine (mesh, net, 0, 0, n, tolerance);
+
+    scale = 1.0f / n;
+    numVertices = 0;
+    for (y = 0; y < stride; y++)
+	for (x = 0; x < stride; x++)
+	    if (mesh->vertexOf[y * stride + x] >= 0)
+		mesh->vertexOf[y * stride + x] =
+		    adaptiveEmitVertex (surface, layout, numVertices++,
+					x * scale, y * scale);
+
+    numIndices = 0;
+    for (i = 0; i < mesh->numLeaves; i++)
+    {
+	leaf = &mesh->leaves[i];
+
+	/* Outline clockwise on screen from the top left corner */
+	numOutline = 0;
+	for (k = 0; k < leaf->size; k++)
+	    outline[numOutline++] = leaf->y * stride + leaf->x + k;
+	for (k = 0; k < leaf->size; k++)
+	    outline[numOutline++] = (leaf->y + k) * stride + leaf->x + leaf->size;
+	for (k = leaf->size; k > 0; k--)
+	    outline[numOutline++] = (leaf->y + leaf->size) * stride + leaf->x + k;
+	for (k = leaf->size; k > 0; k--)
+	    outline[numOutline++] = (leaf->y + k) * stride + leaf->x;
+
+	for (j = 0, k = 0; k < numOutline; k++)
+	    if (mesh->vertexOf[outline[k]] >= 0)
+		outline[j++] = mesh->vertexOf[outline[k]];
+	numOutline = j;
+
+	if (numOutline == 4)
+	{
+	    indices[numIndices++] = outline[0];
+	    indices[numIndices++] = outline[1];
+	    indices[numIndices++] = outline[3];
+
+	    indices[numIndices++] = outline[1];
+	    indices[numIndices++] = outline[2];
+	    indices[numIndices++] = outline[3];
+	    continue;
+	}
+
+	center = adaptiveEmitVertex (surface, layout, numVertices++,
+				     (leaf->x + leaf->size * 0.5f) * scale,
+				     (leaf->y + leaf->size * 0.5f) * scale);
+
+	for (k = 0; k < numOutline; k++)
+	{
+	    first = outline[k];
+	    indices[numIndices++] = center;
+	    indices[numIndices++] = first;
+	    indices[numIndices++] = outline[(k + 1) % numOutline];
+	}
+    }
+
+    *count = numIndices;
+
+    return numVertices;
+}
+
+void
+wobbly_add_geometry(struct surface *surface)
+{
+    WobblyWindow *ww = surface->ww;
+    struct wobbly_mesh_layout layout;
+    int      count;
+    GLfloat  *v, *uv;
+
+    if (ww->wobbly)
+    {
+	count = wobbly_vertex_count (surface);
+
+	/* Grow only, so a steady grid never touches the allocator */
+	if (count > surface->vertex_capacity)
+	{
+	    v = realloc(surface->v, sizeof(GLfloat) * 2 * count);
+	    if (!v)
+		return;
+	    surface->v = v;
+
+	    uv = realloc(surface->tex.uv, sizeof(GLfloat) * 2 * count);
+	    if (!uv)
+		return;
+	    surface->tex.uv = uv;
+
+	    surface->vertex_capacity = count;
+	}
+
+	layout.position = surface->v;
+	layout.position_stride = sizeof (GLfloat) * 2;
+	layout.texcoord = surface->tex.uv;
+	layout.texcoord_stride = sizeof (GLfloat) * 2;
+
+	surface->vertex_count = wobbly_write_geometry (surface, &layout,
+						       surface->vertex_capacity);
+    }
+}
+
+void
+wobbly_resize_notify(struct surface *surface)
+{
+    WobblyWindow *ww = surface->ww;
+    int x, y, w, h;
+
+    x = surface->x;
+    y = surface->y;
+    w = surface->width;
+    h = surface->height;
+
+    if (ww->model)
+    {
+        if (!ww->wobbly)
+	    modelInitObjects (ww->model, x, y, w, h);
+
+	modelInitSprings (ww->model, x, y, w, h);
+    }
+
+    wobblyDamage (ww);
+}
+
+void
+wobbly_move_notify(struct surface *surface, int dx, int dy)
+{
+    WobblyWindow *ww = surface->ww;
+
+    if (ww->grabbed) {
+        ww->model->anchorObject->position.x += dx;
+        ww->model->anchorObject->position.y += dy;
+    
+        ww->wobbly |= WobblyInitial;
+        wobblyDamage (ww);
+        surface->synced = 0;
+    }
+}
+
+static void
+wobblyGrabObject (WobblyWindow *ww,
+		  Object       *anchor)
+{
+        Spring *s;
+        int	   i;
+
+        if (ww->model->anchorObject)
+            ww->model->anchorObject->immobile = 0;
+
+        ww->model->anchorObject = anchor;
+        ww->model->anchorObject->immobile = 1;
+
+        ww->grabbed = 1;
+
+        for (i = 0; i < ww->model->numSprings; i++)
+        {
+            s = &ww->model->springs[i];
+            
+            if (s->a == ww->model->anchorObject)
+            {
+                s->b->velocity.x -= s->offset.x * 0.05f;
+                s->b->velocity.y -= s->offset.y * 0.05f;
+            }
+            else if (s->b == ww->model->anchorObject)
+            {
+                s->a->velocity.x += s->offset.x * 0.05f;
+                s->a->velocity.y += s->offset.y * 0.05f;
+            }
+        }
+
+        ww->wobbly |= WobblyInitial;
+}
+
+void
+wobbly_grab_notify(struct surface *surface, int x, int y)
+{
+    WobblyWindow *ww = surface->ww;
+
+    if (wobblyEnsureModel (surface))
+	wobblyGrabObject (ww, modelFindNearestObject (ww->model, x, y));
+}
+
+/*
+ * Grab the surface by the point at (u, v) across it, as returned by
+ * wobbly_hit_test.  The anchor is the object that rests nearest that
+ * point, which is the one that moves it most directly even when the
+ * mesh is folded and another object is closer on screen.
+ */
+void
+wobbly_grab_notify_uv(struct surface *surface, float u, float v)
+{
+    WobblyWindow *ww = surface->ww;
+    int		 i, j;
+
+    if (wobblyEnsureModel (surface))
+    {
+	i = u * (GRID_WIDTH - 1) + 0.5f;
+	j = v * (GRID_HEIGHT - 1) + 0.5f;
+	i = MAX (0, MIN (i, GRID_WIDTH - 1));
+	j = MAX (0, MIN (j, GRID_HEIGHT - 1));
+
+	wobblyGrabObject (ww, &ww->model->objects[j * GRID_WIDTH + i]);
+    }
+}
+
+/*
+ * Limit the integration steps one wobbly_prepare_paint may take, 0 for
+ * no limit.  Time that would need more is dropped.
+ */
+void
+wobbly_set_step_budget(struct surface *surface, int steps)
+{
+    WobblyWindow *ww = surface->ww;
+
+    ww->stepBudget = steps;
+}
+
+/*
+ * Copy the model's control points, row by row, as x, y pairs.  Returns
+ * how many there are, 0 if the surface has never had a model.
+ */
+int
+wobbly_control_points(struct surface *surface, GLfloat *points)
+{
+    WobblyWindow *ww = surface->ww;
+    int		 i;
+
+    if (!ww->model)
+	return 0;
+
+    for (i = 0; i < ww->model->numObjects; i++)
+    {
+	points[2 * i]	  = ww->model->objects[i].position.x;
+	points[2 * i + 1] = ww->model->objects[i].position.y;
+    }
+
+    return ww->model->numObjects;
+}
+
+/*
+ * Box around everything drawn of the surface.  The patch lies within
+ * the hull of its control points, so this holds while it wobbles.
+ */
+void
+wobbly_bounds(struct surface *surface, float *x1, float *y1, float *x2, float *y2)
+{
+    WobblyWindow *ww = surface->ww;
+
+    if (ww->model && ww->wobbly)
+    {
+	modelCalcBounds (ww->model);
+	*x1 = ww->model->topLeft.x;
+	*y1 = ww->model->topLeft.y;
+	*x2 = ww->model->bottomRight.x;
+	*y2 = ww->model->bottomRight.y;
+    }
+    else
+    {
+	*x1 = surface->x;
+	*y1 = surface->y;
+	*x2 = surface->x + surface->width;
+	*y2 = surface->y + surface->height;
+    }
+}
+
+/*
+ * Test a point against the mesh as it is drawn, deformed.  On a hit,
+ * u and v say where across the surface it landed, from 0 at the top
+ * left to 1 at the bottom right.
+ */
+int
+wobbly_hit_test(struct surface *surface, float x, float y, float *u, float *v)
+{
+    WobblyWindow *ww = surface->ww;
+
+    if (!hitMeshUpdate (surface))
+	return 0;
+
+    return hitMeshTest (ww->hit, x, y, u, v);
+}
+
+void
+wobbly_ungrab_notify(struct surface *surface)
+{
+    WobblyWindow *ww = surface->ww;
+
+    if (ww->grabbed)
+    {
+	if (ww->model)
+	{
+	    if (ww->model->anchorObject)
+		ww->model->anchorObject->immobile = 0;
+
+	    ww->model->anchorObject = NULL;
+
+	    modelDisableSnapping (ww->model);
+
+	    ww->wobbly |= WobblyInitial;
+	}
+
+	ww->grabbed = 0;
+    }
+}
+
+int
+wobbly_init(struct surface *surface)
+{
+    WobblyBlock  *block;
+    WobblyWindow *ww;
+
+    block = poolAlloc ();
+    if (!block)
+	return 0;
+
+    ww = &block->ww;
+
+    ww->model   = 0;
+    ww->wobbly  = 0;
+    ww->grabbed = 0;
+    ww->state   = 0;
+    ww->scene   = NULL;
+    ww->hit     = NULL;
+
+    ww->stepBudget = 0;
+    ww->adaptive   = NULL;
+
+    surface->ww = ww;
+
+    if(!wobblyEnsureModel(surface)) {
+         poolFree(block);
          return 0;
     }
 
@@ -702,12 +2295,592 @@ wobbly_fini(struct surface *surface)
 {
     WobblyWindow *ww = surface->ww;
 
-    if (ww->model)
+    if (ww->scene)
+	wobbly_scene_remove (ww->scene, surface);
+
+    if (ww->hit)
+    {
+	free (ww->hit->points);
+	free (ww->hit->nodes);
+	free (ww->hit);
+    }
+
+    if (ww->adaptive)
+    {
+	free (ww->adaptive->vertexOf);
+	free (ww->adaptive->leaves);
+	free (ww->adaptive);
+    }
+
+    free(surface->v);
+    free(surface->tex.uv);
+    surface->v = NULL;
+    surface->tex.uv = NULL;
+    surface->vertex_count = 0;
+    surface->vertex_capacity = 0;
+
+    poolFree ((WobblyBlock *) ww);
+    surface->ww = NULL;
+}
+
+/* Build the hierarchy over entries order[first..last) top down */
+static int
+sceneBuildNode (struct wobbly_scene *scene,
+		int		    first,
+		int		    last,
+		int		    parent)
+{
+    SceneNode  *node;
+    SceneEntry *e;
+    float      split, c;
+    int	       index = scene->numNodes++;
+    int	       i, j, tmp, vertical;
+
+    node = &scene->nodes[index];
+    node->parent = parent;
+    node->left	 = -1;
+    node->right	 = -1;
+    node->entry	 = -1;
+
+    node->box = scene->entries[scene->order[first]].box;
+
+    if (last - first == 1)
+    {
+	node->entry = scene->order[first];
+	scene->leafNodes[node->entry] = index;
+	return index;
+    }
+
+    for (i = first + 1; i < last; i++)
+	boxUnion (&node->box, &node->box, &scene->entries[scene->order[i]].box);
+
+    /* Split at the middle of the longer side, falling back to halving
+     * the count when all centers land on one side */
+    vertical = node->box.x2 - node->box.x1 >= node->box.y2 - node->box.y1;
+    split = vertical ? (node->box.x1 + node->box.x2) / 2 :
+		       (node->box.y1 + node->box.y2) / 2;
+
+    for (i = first, j = last - 1; i <= j;)
+    {
+	e = &scene->entries[scene->order[i]];
+	c = vertical ? e->box.x1 + e->box.x2 : e->box.y1 + e->box.y2;
+
+	if (c < split * 2)
+	{
+	    i++;
+	}
+	else
+	{
+	    tmp = scene->order[i];
+	    scene->order[i] = scene->order[j];
+	    scene->order[j--] = tmp;
+	}
+    }
+
+    if (i == first || i == last)
+	i = (first + last) / 2;
+
+    tmp = sceneBuildNode (scene, first, i, index);
+    scene->nodes[index].left = tmp;
+    tmp = sceneBuildNode (scene, i, last, index);
+    scene->nodes[index].right = tmp;
+
+    return index;
+}
+
+static void
+sceneEntryBounds (struct surface *surface,
+		  SceneEntry	 *e)
+{
+    e->ww = surface->ww;
+
+    wobbly_bounds (surface, &e->box.x1, &e->box.y1, &e->box.x2, &e->box.y2);
+}
+
+/*
+ * Take the surfaces' current outlines and bring the hierarchy over
+ * them up to date.  It is only built again when surfaces come or go;
+ * otherwise each leaf that moved is refit and the change carried up
+ * until it stops making a difference.  Unless all is set, only the
+ * surfaces damaged since the last call are looked at.
+ */
+static int
+sceneUpdateEntries (struct wobbly_scene *scene,
+		    int			all)
+{
+    WobblyWindow *ww;
+    SceneEntry	 e;
+    SceneNode	 *node;
+    Box		 box;
+    int		 i, k, n, count;
+
+    for (i = 0; i < scene->numDirty; i++)
+    {
+	ww = scene->surfaces[scene->dirty[i]]->ww;
+	ww->sceneQueued = 0;
+    }
+
+    if (scene->bvhDirty)
+    {
+	scene->numDirty = 0;
+
+	for (i = 0; i < scene->numSurfaces; i++)
+	    sceneEntryBounds (scene->surfaces[i], &scene->entries[i]);
+
+	if (2 * scene->numSurfaces > scene->nodeCapacity)
+	{
+	    SceneNode *nodes;
+	    int	      *array;
+
+	    n = scene->surfaceCapacity * 2;
+
+	    nodes = realloc (scene->nodes, sizeof (SceneNode) * n);
+	    if (!nodes)
+		return 0;
+	    scene->nodes = nodes;
+
+	    array = realloc (scene->leafNodes, sizeof (int) * n / 2);
+	    if (!array)
+		return 0;
+	    scene->leafNodes = array;
+
+	    array = realloc (scene->order, sizeof (int) * n / 2);
+	    if (!array)
+		return 0;
+	    scene->order = array;
+
+	    scene->nodeCapacity = n;
+	}
+
+	for (i = 0; i < scene->numSurfaces; i++)
+	    scene->order[i] = i;
+
+	scene->numNodes = 0;
+	if (scene->numSurfaces)
+	    sceneBuildNode (scene, 0, scene->numSurfaces, -1);
+
+	scene->bvhDirty = 0;
+
+	return 1;
+    }
+
+    count = all ? scene->numSurfaces : scene->numDirty;
+    scene->numDirty = 0;
+
+    for (k = 0; k < count; k++)
+    {
+	i = all ? k : scene->dirty[k];
+
+	sceneEntryBounds (scene->surfaces[i], &e);
+
+	if (!memcmp (&e, &scene->entries[i], sizeof (e)))
+	    continue;
+
+	scene->entries[i] = e;
+
+	n = scene->leafNodes[i];
+	scene->nodes[n].box = e.box;
+
+	for (n = scene->nodes[n].parent; n >= 0; n = node->parent)
+	{
+	    node = &scene->nodes[n];
+
+	    boxUnion (&box, &scene->nodes[node->left].box,
+		      &scene->nodes[node->right].box);
+	    if (!memcmp (&box, &node->box, sizeof (box)))
+		break;
+
+	    node->box = box;
+	}
+    }
+
+    return 1;
+}
+
+struct wobbly_scene *
+wobbly_scene_create(int width, int height)
+{
+    struct wobbly_scene *scene;
+
+    scene = calloc (1, sizeof (*scene));
+    if (!scene)
+	return NULL;
+
+    scene->width  = width;
+    scene->height = height;
+
+    if (!wobbly_scene_update (scene))
+    {
+	free (scene);
+	return NULL;
+    }
+
+    return scene;
+}
+
+void
+wobbly_scene_destroy(struct wobbly_scene *scene)
+{
+    int i;
+
+    for (i = 0; i < scene->numSurfaces; i++)
+    {
+	WobblyWindow *ww = scene->surfaces[i]->ww;
+
+	if (ww->model && modelDisableSnapping (ww->model))
+	    ww->wobbly |= WobblyInitial;
+
+	ww->scene = NULL;
+    }
+
+    free (scene->surfaces);
+    free (scene->entries);
+    free (scene->cellStart);
+    free (scene->cellEntries);
+    free (scene->dirty);
+    free (scene->nodes);
+    free (scene->leafNodes);
+    free (scene->order);
+    free (scene);
+}
+
+int
+wobbly_scene_add(struct wobbly_scene *scene, struct surface *surface)
+{
+    WobblyWindow   *ww = surface->ww;
+    struct surface **surfaces;
+    SceneEntry	   *entries;
+    int		   *dirty, capacity;
+
+    if (ww->scene == scene)
+	return 1;
+    if (ww->scene)
+	wobbly_scene_remove (ww->scene, surface);
+
+    if (scene->numSurfaces == scene->surfaceCapacity)
+    {
+	capacity = scene->surfaceCapacity ? scene->surfaceCapacity * 2 : 16;
+
+	surfaces = realloc (scene->surfaces, sizeof (*surfaces) * capacity);
+	if (!surfaces)
+	    return 0;
+	scene->surfaces = surfaces;
+
+	entries = realloc (scene->entries, sizeof (*entries) * capacity);
+	if (!entries)
+	    return 0;
+	scene->entries = entries;
+
+	dirty = realloc (scene->dirty, sizeof (*dirty) * capacity);
+	if (!dirty)
+	    return 0;
+	scene->dirty = dirty;
+
+	scene->surfaceCapacity = capacity;
+    }
+
+    ww->scene	    = scene;
+    ww->sceneIndex  = scene->numSurfaces;
+    ww->sceneQueued = 0;
+
+    scene->surfaces[scene->numSurfaces++] = surface;
+    scene->bvhDirty = 1;
+
+    return 1;
+}
+
+void
+wobbly_scene_remove(struct wobbly_scene *scene, struct surface *surface)
+{
+    WobblyWindow *ww = surface->ww;
+    int		 i;
+
+    /* Everything is refit when the hierarchy is built again */
+    for (i = 0; i < scene->numDirty; i++)
+	((WobblyWindow *) scene->surfaces[scene->dirty[i]]->ww)->sceneQueued = 0;
+    scene->numDirty = 0;
+
+    for (i = 0; i < scene->numSurfaces; i++)
+    {
+	if (scene->surfaces[i] == surface)
+	{
+	    /* Keep the stacking order */
+	    memmove (&scene->surfaces[i], &scene->surfaces[i + 1],
+		     sizeof (*scene->surfaces) * (--scene->numSurfaces - i));
+	    scene->bvhDirty = 1;
+	    break;
+	}
+    }
+
+    for (; i < scene->numSurfaces; i++)
+	((WobblyWindow *) scene->surfaces[i]->ww)->sceneIndex = i;
+
+    if (ww->model && modelDisableSnapping (ww->model))
+	ww->wobbly |= WobblyInitial;
+
+    ww->scene = NULL;
+    wobbly_scene_update (scene);
+}
+
+void
+wobbly_scene_set_size(struct wobbly_scene *scene, int width, int height)
+{
+    scene->width  = width;
+    scene->height = height;
+}
+
+/*
+ * Rebin every surface's current outline.  This is a counting sort into
+ * the cells, linear in the number of surfaces plus the cells they
+ * cover, and allocates only when the scene outgrows its arrays.  Edges
+ * found since the last update are found again against the new grid.
+ */
+int
+wobbly_scene_update(struct wobbly_scene *scene)
+{
+    WobblyWindow   *ww;
+    SceneEntry	   *e;
+    int		   cellsX, cellsY, cells, total, x, y, x1, y1, x2, y2, i, j;
+    int		   *array;
+
+    cellsX = (scene->width + SCENE_CELL_SIZE - 1) / SCENE_CELL_SIZE;
+    cellsY = (scene->height + SCENE_CELL_SIZE - 1) / SCENE_CELL_SIZE;
+    if (cellsX < 1)
+	cellsX = 1;
+    if (cellsY < 1)
+	cellsY = 1;
+    cells = cellsX * cellsY;
+
+    if (cells + 1 > scene->cellCapacity)
+    {
+	array = realloc (scene->cellStart, sizeof (int) * (cells + 1));
+	if (!array)
+	    return 0;
+	scene->cellStart    = array;
+	scene->cellCapacity = cells + 1;
+    }
+
+    scene->cellsX     = cellsX;
+    scene->cellsY     = cellsY;
+    scene->gridWidth  = scene->width;
+    scene->gridHeight = scene->height;
+
+    memset (scene->cellStart, 0, sizeof (int) * (cells + 1));
+
+    if (!sceneUpdateEntries (scene, 1))
+	return 0;
+
+    total = 0;
+    for (i = 0; i < scene->numSurfaces; i++)
+    {
+	e = &scene->entries[i];
+
+	x1 = sceneCell (e->box.x1, cellsX);
+	y1 = sceneCell (e->box.y1, cellsY);
+	x2 = sceneCell (e->box.x2, cellsX);
+	y2 = sceneCell (e->box.y2, cellsY);
+
+	for (y = y1; y <= y2; y++)
+	    for (x = x1; x <= x2; x++)
+		scene->cellStart[y * cellsX + x]++;
+
+	total += (x2 - x1 + 1) * (y2 - y1 + 1);
+    }
+
+    if (total > scene->cellEntryCapacity)
     {
-	free(ww->model->objects);
-	free(ww->model);
-	free(surface->v);
+	array = realloc (scene->cellEntries, sizeof (int) * total);
+	if (!array)
+	    return 0;
+	scene->cellEntries	 = array;
+	scene->cellEntryCapacity = total;
     }
 
-    free (ww);
+    for (j = 1; j < cells; j++)
+	scene->cellStart[j] += scene->cellStart[j - 1];
+    scene->cellStart[cells] = total;
+
+    /* Fill each cell from its end, leaving cellStart at its start */
+    for (i = scene->numSurfaces - 1; i >= 0; i--)
+    {
+	e = &scene->entries[i];
+
+	x1 = sceneCell (e->box.x1, cellsX);
+	y1 = sceneCell (e->box.y1, cellsY);
+	x2 = sceneCell (e->box.x2, cellsX);
+	y2 = sceneCell (e->box.y2, cellsY);
+
+	for (y = y1; y <= y2; y++)
+	    for (x = x1; x <= x2; x++)
+		scene->cellEntries[--scene->cellStart[y * cellsX + x]] = i;
+    }
+
+    for (i = 0; i < scene->numSurfaces; i++)
+    {
+	ww = scene->surfaces[i]->ww;
+	if (!ww->model || !ww->model->edgeMask)
+	    continue;
+
+	for (j = 0; j < ww->model->numObjects; j++)
+	{
+	    Object *object = &ww->model->objects[j];
+
+	    if (object->edgeMask & WestEdgeMask)
+		objectFindEdge (ww, object, WEST);
+	    else if (object->edgeMask & EastEdgeMask)
+		objectFindEdge (ww, object, EAST);
+
+	    if (object->edgeMask & NorthEdgeMask)
+		objectFindEdge (ww, object, NORTH);
+	    else if (object->edgeMask & SouthEdgeMask)
+		objectFindEdge (ww, object, SOUTH);
+	}
+    }
+
+    return 1;
+}
+
+static int
+sceneCompareDepth (const void *a,
+		   const void *b)
+{
+    WobblyWindow *wa = (*(struct surface * const *) a)->ww;
+    WobblyWindow *wb = (*(struct surface * const *) b)->ww;
+
+    return wb->sceneIndex - wa->sceneIndex;
+}
+
+/*
+ * The surfaces whose outlines overlap the rectangle from (x1, y1) to
+ * (x2, y2), topmost first, for drawing opaque surfaces front to back.
+ * Returns how many overlap; only the first capacity found are stored,
+ * so pass room for the whole scene to get all of them in order.
+ */
+int
+wobbly_scene_visible(struct wobbly_scene *scene,
+		     float x1,
+		     float y1,
+		     float x2,
+		     float y2,
+		     struct surface **surfaces,
+		     int capacity)
+{
+    SceneNode *node;
+    Box	      view;
+    int	      *stack, depth = 0, count = 0;
+
+    if (!sceneUpdateEntries (scene, 0) || !scene->numNodes)
+	return 0;
+
+    view.x1 = x1;
+    view.y1 = y1;
+    view.x2 = x2;
+    view.y2 = y2;
+
+    stack = scene->order;
+    stack[depth++] = 0;
+
+    while (depth)
+    {
+	node = &scene->nodes[stack[--depth]];
+
+	if (!boxOverlaps (&node->box, &view))
+	    continue;
+
+	if (node->entry < 0)
+	{
+	    stack[depth++] = node->left;
+	    stack[depth++] = node->right;
+	}
+	else
+	{
+	    if (count < capacity)
+		surfaces[count] = scene->surfaces[node->entry];
+	    count++;
+	}
+    }
+
+    qsort (surfaces, MIN (count, capacity), sizeof (*surfaces),
+	   sceneCompareDepth);
+
+    return count;
+}
+
+/*
+ * The topmost surface whose drawn mesh is under (x, y), or NULL.
+ * Surfaces added later are above those added before.  Only surfaces
+ * whose outline contains the point are tested against their mesh.
+ */
+struct surface *
+wobbly_scene_pick(struct wobbly_scene *scene, float x, float y,
+		  float *u, float *v)
+{
+    SceneNode *node;
+    float     hitU, hitV;
+    int	      *stack, depth = 0, best = -1;
+
+    if (!sceneUpdateEntries (scene, 0) || !scene->numNodes)
+	return NULL;
+
+    /* The tree is at most as deep as there are surfaces; order is
+     * free to use as the stack */
+    stack = scene->order;
+    stack[depth++] = 0;
+
+    while (depth)
+    {
+	node = &scene->nodes[stack[--depth]];
+
+	if (!boxContains (&node->box, x, y))
+	    continue;
+
+	if (node->entry < 0)
+	{
+	    stack[depth++] = node->left;
+	    stack[depth++] = node->right;
+	}
+	else if (node->entry > best &&
+		 wobbly_hit_test (scene->surfaces[node->entry], x, y,
+				  &hitU, &hitV))
+	{
+	    best = node->entry;
+	    *u = hitU;
+	    *v = hitV;
+	}
+    }
+
+    return best >= 0 ? scene->surfaces[best] : NULL;
+}
+
+/*
+ * While enabled, the outline of a grabbed surface snaps to the screen
+ * edges and to the facing edges of other surfaces in its scene.
+ */
+void
+wobbly_set_snapping(struct surface *surface, int enable)
+{
+    WobblyWindow *ww = surface->ww;
+
+    if (!ww->model || !ww->scene)
+	return;
+
+    if (enable)
+    {
+	if (ww->model->edgeMask)
+	    return;
+
+	ww->model->edgeMask = WestEdgeMask | EastEdgeMask |
+			      NorthEdgeMask | SouthEdgeMask;
+	modelUpdateSnapping (ww);
+    }
+    else if (modelDisableSnapping (ww->model))
+    {
+	ww->wobbly |= WobblyInitial;
+    }
+}
+
+void
+wobbly_use_huge_pages(int enable)
+{
+    poolHugePages = enable;
 }
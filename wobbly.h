@@ -11,19 +11,33 @@
 
 #define WOBBLY_FRICTION 3
 #define WOBBLY_SPRING_K 8
+#define WOBBLY_MASS 50
+
+/* The model is a lattice of this many control points each way */
+#define WOBBLY_GRID_SIZE 4
+
+/* Post-transform vertex cache entries index order is planned for */
+#define WOBBLY_VERTEX_CACHE 16
+
+/* Indices are 16 bit, so a grid drawn through them has at most this
+ * many vertices, 255x255 cells */
+#define WOBBLY_MAX_VERTICES 65536
 
 struct surface {
    void *ww;
    int x, y, width, height;
    int x_cells, y_cells;
    int grabbed, synced;
-   int vertex_count;
+   int vertex_count, vertex_capacity;
    GLfloat *v;
    struct {
       void *data;
       void *uv;
       int width;
       int height;
+      int format;
+      int levels;
+      GLuint id;
    } tex;
 };
 
@@ -31,6 +45,28 @@ struct window {
    int width, height;
 };
 
+/*
+ * Destination for wobbly_write_geometry.  Each vertex gets two floats
+ * of position and, if texcoord is set, two floats of texture
+ * coordinates, with the given byte strides between vertices.  Both
+ * can point into the same interleaved array.
+ */
+struct wobbly_mesh_layout {
+   void *position;
+   int position_stride;
+   void *texcoord;
+   int texcoord_stride;
+};
+
+/*
+ * A set of surfaces that snap to each other and to the edges of a
+ * width by height screen.  Outlines are indexed on a coarse grid, so
+ * finding the edge a surface snaps to only looks at its neighbours.
+ * Call wobbly_scene_update once per frame before stepping the
+ * surfaces, after they have moved.
+ */
+struct wobbly_scene;
+
 int
 wobbly_init(struct surface *surface);
 void
@@ -38,14 +74,73 @@ wobbly_fini(struct surface *surface);
 void
 wobbly_grab_notify(struct surface *surface, int x, int y);
 void
+wobbly_grab_notify_uv(struct surface *surface, float u, float v);
+void
 wobbly_ungrab_notify(struct surface *surface);
 void
 wobbly_resize_notify(struct surface *surface);
 void
 wobbly_move_notify(struct surface *surface, int dx, int dy);
-void
+int
 wobbly_prepare_paint(struct surface *surface, int msSinceLastPaint);
 void
 wobbly_done_paint(struct surface *surface);
 void
 wobbly_add_geometry(struct surface *surface);
+int
+wobbly_vertex_count(struct surface *surface);
+int
+wobbly_write_geometry(struct surface *surface,
+                      const struct wobbly_mesh_layout *layout,
+                      int capacity);
+int
+wobbly_write_geometry_rows(struct surface *surface,
+                           const struct wobbly_mesh_layout *layout,
+                           int capacity,
+                           int first,
+                           int count);
+int
+wobbly_write_indices(struct surface *surface, GLushort *indices, int capacity);
+float
+wobbly_index_acmr(const GLushort *indices, int count, int cache_size);
+void
+wobbly_adaptive_bounds(struct surface *surface, int *vertices, int *indices);
+int
+wobbly_write_adaptive(struct surface *surface,
+                      const struct wobbly_mesh_layout *layout,
+                      int capacity,
+                      GLushort *indices,
+                      int index_capacity,
+                      float tolerance,
+                      int *count);
+void
+wobbly_set_step_budget(struct surface *surface, int steps);
+int
+wobbly_control_points(struct surface *surface, GLfloat *points);
+void
+wobbly_bounds(struct surface *surface, float *x1, float *y1, float *x2, float *y2);
+int
+wobbly_hit_test(struct surface *surface, float x, float y, float *u, float *v);
+void
+wobbly_use_huge_pages(int enable);
+struct wobbly_scene *
+wobbly_scene_create(int width, int height);
+void
+wobbly_scene_destroy(struct wobbly_scene *scene);
+int
+wobbly_scene_add(struct wobbly_scene *scene, struct surface *surface);
+void
+wobbly_scene_remove(struct wobbly_scene *scene, struct surface *surface);
+void
+wobbly_scene_set_size(struct wobbly_scene *scene, int width, int height);
+int
+wobbly_scene_update(struct wobbly_scene *scene);
+int
+wobbly_scene_visible(struct wobbly_scene *scene, float x1, float y1,
+                     float x2, float y2, struct surface **surfaces,
+                     int capacity);
+struct surface *
+wobbly_scene_pick(struct wobbly_scene *scene, float x, float y,
+                  float *u, float *v);
+void
+wobbly_set_snapping(struct surface *surface, int enable);
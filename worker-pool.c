@@ -0,0 +1,168 @@
+/**************************************************************************
+ *
+ * Copyright 2014 Scott Moreau <oreaus@gmail.com>
+ * All Rights Reserved.
+ *
+ **************************************************************************/
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+
+#include "worker-pool.h"
+
+struct worker_pool {
+   pthread_t *helpers;
+   int num_helpers;
+   pthread_mutex_t mutex;
+   pthread_cond_t wake;
+   unsigned int generation;      /* bumped for each batch */
+   int quit;
+   int active;                   /* helpers inside a batch */
+
+   worker_func func;
+   void *data;
+   int jobs;
+   int next_job, done_jobs;
+};
+
+static void
+run_jobs(struct worker_pool *pool, worker_func func, void *data, int jobs)
+{
+   int job;
+
+   while ((job = __atomic_fetch_add(&pool->next_job, 1, __ATOMIC_RELAXED)) < jobs) {
+      func(data, job);
+      __atomic_fetch_add(&pool->done_jobs, 1, __ATOMIC_RELEASE);
+   }
+}
+
+static void *
+helper_thread(void *arg)
+{
+   struct worker_pool *pool = arg;
+   unsigned int seen = 0;
+   worker_func func;
+   void *data;
+   int jobs;
+
+   for (;;) {
+      pthread_mutex_lock(&pool->mutex);
+      while (pool->generation == seen && !pool->quit)
+         pthread_cond_wait(&pool->wake, &pool->mutex);
+      if (pool->quit) {
+         pthread_mutex_unlock(&pool->mutex);
+         break;
+      }
+      /* Take the batch as it is now; the next one can't start
+       * until this thread has left it */
+      seen = pool->generation;
+      func = pool->func;
+      data = pool->data;
+      jobs = pool->jobs;
+      __atomic_fetch_add(&pool->active, 1, __ATOMIC_RELAXED);
+      pthread_mutex_unlock(&pool->mutex);
+
+      run_jobs(pool, func, data, jobs);
+      __atomic_fetch_sub(&pool->active, 1, __ATOMIC_RELEASE);
+   }
+
+   return NULL;
+}
+
+/* Threads counts the caller, which works on every batch it runs */
+struct worker_pool *
+worker_pool_create(int threads)
+{
+   struct worker_pool *pool;
+   int i;
+
+   pool = calloc(1, sizeof (*pool));
+   if (!pool)
+      return NULL;
+
+   pthread_mutex_init(&pool->mutex, NULL);
+   pthread_cond_init(&pool->wake, NULL);
+
+   if (threads > 1) {
+      pool->helpers = calloc(threads - 1, sizeof (*pool->helpers));
+      if (!pool->helpers) {
+         worker_pool_destroy(pool);
+         return NULL;
+      }
+   }
+
+   for (i = 0; i < threads - 1; i++) {
+      if (pthread_create(&pool->helpers[i], NULL, helper_thread, pool))
+         break;
+      pool->num_helpers++;
+   }
+
+   return pool;
+}
+
+void
+worker_pool_destroy(struct worker_pool *pool)
+{
+   int i;
+
+   if (!pool)
+      return;
+
+   pthread_mutex_lock(&pool->mutex);
+   pool->quit = 1;
+   pthread_cond_broadcast(&pool->wake);
+   pthread_mutex_unlock(&pool->mutex);
+
+   for (i = 0; i < pool->num_helpers; i++)
+      pthread_join(pool->helpers[i], NULL);
+
+   pthread_cond_destroy(&pool->wake);
+   pthread_mutex_destroy(&pool->mutex);
+   free(pool->helpers);
+   free(pool);
+}
+
+int
+worker_pool_threads(struct worker_pool *pool)
+{
+   return pool->num_helpers + 1;
+}
+
+/*
+ * Call func(data, job) for every job from 0 to jobs - 1, spread over
+ * the pool and the calling thread, and return when all are done.
+ */
+void
+worker_pool_run(struct worker_pool *pool, worker_func func, void *data, int jobs)
+{
+   if (!pool->num_helpers || jobs < 2) {
+      int job;
+
+      for (job = 0; job < jobs; job++)
+         func(data, job);
+      return;
+   }
+
+   pthread_mutex_lock(&pool->mutex);
+   /* A helper that woke too late for the last batch may still be
+    * on its way out of it */
+   while (__atomic_load_n(&pool->active, __ATOMIC_ACQUIRE)) {
+      pthread_mutex_unlock(&pool->mutex);
+      sched_yield();
+      pthread_mutex_lock(&pool->mutex);
+   }
+   pool->func = func;
+   pool->data = data;
+   pool->jobs = jobs;
+   __atomic_store_n(&pool->next_job, 0, __ATOMIC_RELAXED);
+   __atomic_store_n(&pool->done_jobs, 0, __ATOMIC_RELAXED);
+   pool->generation++;
+   pthread_cond_broadcast(&pool->wake);
+   pthread_mutex_unlock(&pool->mutex);
+
+   run_jobs(pool, func, data, jobs);
+
+   while (__atomic_load_n(&pool->done_jobs, __ATOMIC_ACQUIRE) < jobs)
+      sched_yield();
+}
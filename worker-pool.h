@@ -0,0 +1,24 @@
+/**************************************************************************
+ *
+ * Copyright 2014 Scott Moreau <oreaus@gmail.com>
+ * All Rights Reserved.
+ *
+ **************************************************************************/
+
+/*
+ * A fixed set of threads that split a numbered batch of jobs with the
+ * caller.  Jobs are handed out through an atomic counter, so a batch
+ * costs one wakeup per thread and nothing per job beyond an add.
+ */
+struct worker_pool;
+
+typedef void (*worker_func)(void *data, int job);
+
+struct worker_pool *
+worker_pool_create(int threads);
+void
+worker_pool_destroy(struct worker_pool *pool);
+int
+worker_pool_threads(struct worker_pool *pool);
+void
+worker_pool_run(struct worker_pool *pool, worker_func func, void *data, int jobs);